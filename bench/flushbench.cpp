@@ -0,0 +1,177 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmark of the CPU work done by the log flusher on each page, i.e., everything that
+ * happens between consuming a page from the log buffer and writing it to the log device.
+ */
+
+#include <iostream>
+#include <chrono>
+#include <memory>
+#include <cstring>
+
+#include "default_templates.h"
+#include "logsort.h"
+#include "logblock.h"
+#include "logcodec.h"
+#include "generator.h"
+#include "log_index_native.h"
+
+using namespace fineline;
+
+constexpr unsigned Iterations = 200;
+constexpr unsigned MaxNodeId = 100000;
+
+using Clock = std::chrono::steady_clock;
+
+// Keeps the compiler from optimizing away checksum computations
+volatile uint32_t checksum_sink;
+
+void fill_page(ExtLogPage& page)
+{
+    gen::NumberGenerator<uint32_t, 1, MaxNodeId> node_gen;
+    gen::StringGenerator<20, 200> payload_gen;
+    std::vector<uint32_t> seqs(MaxNodeId + 1, 0);
+
+    page.clear();
+    while (true) {
+        auto id = node_gen.next();
+        DftLogrecHeader hdr {id, ++seqs[id], LRType::Insert};
+        if (!page.try_insert(hdr, payload_gen.next())) { break; }
+    }
+}
+
+/*
+ * Turns the page into the given number of sorted runs, like the pages produced by transactions
+ * that sort their private logs at commit time.
+ */
+void make_runs(ExtLogPage& page, unsigned runs)
+{
+    std::unique_ptr<ExtLogPage> tmp {new ExtLogPage};
+    ::memcpy(tmp.get(), &page, sizeof(ExtLogPage));
+    tmp->sort_slots();
+
+    // Deal sorted records round-robin into runs, so that runs overlap in the key space
+    page.clear();
+    for (unsigned r = 0; r < runs; r++) {
+        for (size_t i = r; i < tmp->slot_count(); i += runs) {
+            auto& slot = tmp->get_slot(i);
+            auto payload = static_cast<const char*>(tmp->get_payload(slot.ptr));
+            page.try_insert_raw(slot.key, payload);
+        }
+    }
+}
+
+template <class Func>
+void run(const std::string& name, const ExtLogPage& orig, ExtLogPage& page, Func f)
+{
+    Clock::duration total {0};
+    for (unsigned i = 0; i < Iterations; i++) {
+        ::memcpy(&page, &orig, sizeof(ExtLogPage));
+        auto begin = Clock::now();
+        f(page);
+        total += Clock::now() - begin;
+        foster::assert<0>(page.slots_are_sorted());
+    }
+
+    auto usec = std::chrono::duration_cast<std::chrono::microseconds>(total).count();
+    std::cout << name << ": " << usec / Iterations << " us/page ("
+        << orig.slot_count() << " records)" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    Options options {argc, argv};
+    auto threads = options.get<unsigned>("log_sort_threads");
+
+    std::unique_ptr<ExtLogPage> orig {new ExtLogPage};
+    std::unique_ptr<ExtLogPage> page {new ExtLogPage};
+    fill_page(*orig);
+
+    run("sort_slots", *orig, *page, [](ExtLogPage& p) { p.sort_slots(); });
+
+    SlotSorter<ExtLogPage> radix;
+    run("radix", *orig, *page, [&radix](ExtLogPage& p) { radix.sort(p); });
+
+    if (threads > 1) {
+        SlotSorter<ExtLogPage> parallel {threads, 0};
+        run("radix x" + std::to_string(threads), *orig, *page,
+                [&parallel](ExtLogPage& p) { parallel.sort(p); });
+    }
+
+    for (unsigned runs : {4, 16, 64, 256, 1024}) {
+        make_runs(*orig, runs);
+        auto suffix = " (" + std::to_string(runs) + " sorted runs)";
+        run("sort_slots" + suffix, *orig, *page, [](ExtLogPage& p) { p.sort_slots(); });
+        run("merge" + suffix, *orig, *page, [&radix](ExtLogPage& p) { radix.sort(p); });
+    }
+
+    // Checksum of the block header, which is computed on every page after sorting
+    radix.sort(*orig);
+    run("crc32c", *orig, *page, [](ExtLogPage& p) {
+        LogBlockHeader hdr;
+        hdr.seal(&p, sizeof(ExtLogPage));
+        checksum_sink = hdr.checksum;
+    });
+    run("crc32c (software)", *orig, *page, [](ExtLogPage& p) {
+        checksum_sink = crc32c::compute_sw(0, &p, sizeof(ExtLogPage));
+    });
+
+    // Block compression, which replaces the page image with its encoding in the block body
+    LogPageCodec<ExtLogPage> codec;
+    std::unique_ptr<char[]> encoded {new char[sizeof(ExtLogPage)]};
+    size_t encoded_length = 0;
+    run("compress (lz)", *orig, *page, [&](ExtLogPage& p) {
+        encoded_length = codec.encode(p, encoded.get(), sizeof(ExtLogPage));
+    });
+    std::cout << "compressed block: " << encoded_length << " bytes ("
+        << 100 * encoded_length / sizeof(ExtLogPage) << "% of page)" << std::endl;
+    run("decompress (lz)", *orig, *page, [&](ExtLogPage& p) {
+        codec.decode(encoded.get(), encoded_length, p);
+    });
+
+    // Index maintenance, which follows the write of every block
+    namespace fs = boost::filesystem;
+    auto dir = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(dir);
+    options.set("logpath", dir.string());
+    {
+        legacy::SQLiteLogIndex sqlite {options};
+        NativeLogIndex native {options};
+        auto time_inserts = [] (const std::string& name, std::function<void(uint32_t)> insert) {
+            auto begin = Clock::now();
+            for (uint32_t i = 0; i < Iterations; i++) { insert(i); }
+            auto usec = std::chrono::duration_cast<std::chrono::microseconds>(
+                    Clock::now() - begin).count();
+            std::cout << name << ": " << usec / Iterations << " us/block" << std::endl;
+        };
+        time_inserts("index insert (sqlite)", [&sqlite] (uint32_t i) {
+            sqlite.insert_block(1, i, i, i, i + 100);
+        });
+        time_inserts("index insert (native)", [&native] (uint32_t i) {
+            native.insert_block(1, i, i, i, i + 100);
+        });
+    }
+    fs::remove_all(dir);
+
+    return EXIT_SUCCESS;
+}
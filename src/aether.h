@@ -69,7 +69,7 @@ public:
     static constexpr unsigned DftTimeout = 10;
 
     AetherInsertBuffer(std::shared_ptr<Buffer<LogPage>> buffer)
-        : buffer_(buffer), timeout_policy_{new TimeoutRelease{this, DftTimeout}}
+        : buffer_(buffer), curr_epoch_{0}, timeout_policy_{new TimeoutRelease{this, DftTimeout}}
     {}
 
     template <class PrivateLogPage>
@@ -152,8 +152,10 @@ protected:
 
         if (!curr_page_ || space_needed > curr_page_->free_space()) {
             // release current page and get new one
-            cslot->epoch = release_current_epoch();
+            release_current_epoch();
         }
+        // Group commits with the epoch of the page it is copied into, which may be older
+        cslot->epoch = curr_epoch_;
         dbg::trace("Reserving space for {} bytes on page with {} bytes free",
                 space_needed, curr_page_->free_space());
 
@@ -209,6 +211,7 @@ protected:
         // shared_ptr ref count. Once it reaches zero, flusher can pick it up.
         curr_page_ = buffer_->produce(epoch);
         curr_page_->clear();
+        curr_epoch_ = epoch;
         assert<1>(curr_page_->slot_count() == 0);
         return epoch;
     }
@@ -267,6 +270,8 @@ private:
     Latch latch_;
     std::shared_ptr<Buffer<LogPage>> buffer_;
     std::shared_ptr<LogPage> curr_page_;
+    // Epoch of curr_page_
+    EpochNumber curr_epoch_;
     std::unique_ptr<TimeoutRelease> timeout_policy_;
 };
 
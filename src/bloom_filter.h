@@ -0,0 +1,101 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef FINELINE_BLOOM_FILTER_H
+#define FINELINE_BLOOM_FILTER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+namespace fineline {
+
+/**
+ * \brief Bloom filter over the node IDs of a log block.
+ *
+ * The filter has a fixed size of Bytes bytes, which matches the bloom_filter column of the
+ * SQLite log index, so that it can be stored as is in any index. Each key sets Hashes bits,
+ * which are derived from a single 64-bit hash of the key by double hashing. With the default
+ * size, a block with a thousand distinct nodes yields about 2% false positives.
+ *
+ * Filters are plain bit arrays without any pointers, so they can be copied, written to, and
+ * read from files with memcpy.
+ */
+struct BloomFilter
+{
+    static constexpr size_t Bytes = 1024;
+    static constexpr size_t Bits = Bytes * 8;
+    static constexpr unsigned Hashes = 4;
+
+    uint64_t words[Bytes / sizeof(uint64_t)];
+
+    BloomFilter() { clear(); }
+
+    void clear()
+    {
+        ::memset(words, 0, Bytes);
+    }
+
+    void add(uint64_t key)
+    {
+        uint64_t h1, h2;
+        hash(key, h1, h2);
+        for (unsigned i = 0; i < Hashes; i++) {
+            uint64_t bit = (h1 + i * h2) % Bits;
+            words[bit / 64] |= uint64_t{1} << (bit % 64);
+        }
+    }
+
+    /// False only if the key was certainly not added
+    bool may_contain(uint64_t key) const
+    {
+        uint64_t h1, h2;
+        hash(key, h1, h2);
+        for (unsigned i = 0; i < Hashes; i++) {
+            uint64_t bit = (h1 + i * h2) % Bits;
+            if (!(words[bit / 64] & (uint64_t{1} << (bit % 64)))) { return false; }
+        }
+        return true;
+    }
+
+    const char* data() const { return reinterpret_cast<const char*>(words); }
+    char* data() { return reinterpret_cast<char*>(words); }
+
+private:
+    static void hash(uint64_t key, uint64_t& h1, uint64_t& h2)
+    {
+        // Finalizer of splitmix64, which spreads consecutive node IDs across all bits
+        key += 0x9e3779b97f4a7c15ull;
+        key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+        key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+        key ^= key >> 31;
+        h1 = key;
+        // Odd step, so that the probed bits are distinct
+        h2 = (key >> 32) | 1;
+    }
+};
+
+static_assert(sizeof(BloomFilter) == BloomFilter::Bytes, "Unexpected padding in BloomFilter");
+
+} // namespace fineline
+
+#endif
@@ -0,0 +1,224 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FINELINE_CRC32C_H
+#define FINELINE_CRC32C_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace fineline {
+
+/*
+ * CRC-32C (Castagnoli) checksums, used to validate log blocks.
+ *
+ * On x86-64 CPUs with SSE 4.2, the crc32 instruction is used on three independent streams, which
+ * hides its 3-cycle latency, and the three partial CRCs are combined with precomputed "shift by N
+ * zero bytes" tables -- this is the algorithm of Mark Adler's crc32c.c. Other CPUs fall back to a
+ * byte-wise table lookup. The hardware path is selected once at runtime, so the code does not
+ * require compiling with -msse4.2.
+ */
+namespace crc32c {
+
+constexpr uint32_t Poly = 0x82f63b78; // reflected Castagnoli polynomial
+constexpr size_t LongBlock = 8192;
+constexpr size_t ShortBlock = 256;
+
+using ShiftTable = uint32_t[4][256];
+
+struct Tables
+{
+    uint32_t bytewise[256];
+    ShiftTable long_shift;
+    ShiftTable short_shift;
+    bool has_hw;
+
+    Tables()
+    {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t crc = n;
+            for (int k = 0; k < 8; k++) {
+                crc = crc & 1 ? (crc >> 1) ^ Poly : crc >> 1;
+            }
+            bytewise[n] = crc;
+        }
+        build_shift_table(long_shift, LongBlock);
+        build_shift_table(short_shift, ShortBlock);
+#if defined(__x86_64__)
+        has_hw = __builtin_cpu_supports("sse4.2");
+#else
+        has_hw = false;
+#endif
+    }
+
+    static uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec)
+    {
+        uint32_t sum = 0;
+        while (vec) {
+            if (vec & 1) { sum ^= *mat; }
+            vec >>= 1;
+            mat++;
+        }
+        return sum;
+    }
+
+    static void gf2_matrix_square(uint32_t* square, const uint32_t* mat)
+    {
+        for (int n = 0; n < 32; n++) {
+            square[n] = gf2_matrix_times(mat, mat[n]);
+        }
+    }
+
+    // Builds the operator that appends len zero bytes (len must be a power of two) to a CRC
+    static void build_shift_table(ShiftTable& table, size_t len)
+    {
+        uint32_t even[32], odd[32];
+
+        // operator for one zero bit
+        odd[0] = Poly;
+        uint32_t row = 1;
+        for (int n = 1; n < 32; n++) {
+            odd[n] = row;
+            row <<= 1;
+        }
+        // two, then four zero bits
+        gf2_matrix_square(even, odd);
+        gf2_matrix_square(odd, even);
+
+        // keep squaring until the operator covers len bytes
+        uint32_t* op = nullptr;
+        do {
+            gf2_matrix_square(even, odd);
+            len >>= 1;
+            op = even;
+            if (len == 0) { break; }
+            gf2_matrix_square(odd, even);
+            len >>= 1;
+            op = odd;
+        } while (len);
+
+        for (uint32_t n = 0; n < 256; n++) {
+            table[0][n] = gf2_matrix_times(op, n);
+            table[1][n] = gf2_matrix_times(op, n << 8);
+            table[2][n] = gf2_matrix_times(op, n << 16);
+            table[3][n] = gf2_matrix_times(op, n << 24);
+        }
+    }
+};
+
+inline const Tables& get_tables()
+{
+    static const Tables tables;
+    return tables;
+}
+
+inline uint32_t shift(const ShiftTable& table, uint32_t crc)
+{
+    return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff]
+        ^ table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+inline uint32_t compute_sw(uint32_t crc, const void* buf, size_t len)
+{
+    auto& t = get_tables().bytewise;
+    auto next = static_cast<const unsigned char*>(buf);
+    crc = ~crc;
+    while (len--) {
+        crc = t[(crc ^ *next++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+template <size_t Block>
+__attribute__((target("sse4.2")))
+inline uint64_t compute_hw_3way(uint64_t crc0, const unsigned char*& next, size_t& len,
+        const ShiftTable& table)
+{
+    while (len >= Block * 3) {
+        uint64_t crc1 = 0, crc2 = 0;
+        const unsigned char* end = next + Block;
+        do {
+            uint64_t w0, w1, w2;
+            ::memcpy(&w0, next, 8);
+            ::memcpy(&w1, next + Block, 8);
+            ::memcpy(&w2, next + 2 * Block, 8);
+            crc0 = _mm_crc32_u64(crc0, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+            next += 8;
+        } while (next < end);
+        crc0 = shift(table, crc0) ^ crc1;
+        crc0 = shift(table, crc0) ^ crc2;
+        next += Block * 2;
+        len -= Block * 3;
+    }
+    return crc0;
+}
+
+__attribute__((target("sse4.2")))
+inline uint32_t compute_hw(uint32_t crc, const void* buf, size_t len)
+{
+    auto& tables = get_tables();
+    auto next = static_cast<const unsigned char*>(buf);
+    uint64_t crc0 = ~crc;
+
+    while (len && (reinterpret_cast<uintptr_t>(next) & 7) != 0) {
+        crc0 = _mm_crc32_u8(crc0, *next++);
+        len--;
+    }
+
+    crc0 = compute_hw_3way<LongBlock>(crc0, next, len, tables.long_shift);
+    crc0 = compute_hw_3way<ShortBlock>(crc0, next, len, tables.short_shift);
+
+    while (len >= 8) {
+        uint64_t w;
+        ::memcpy(&w, next, 8);
+        crc0 = _mm_crc32_u64(crc0, w);
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        crc0 = _mm_crc32_u8(crc0, *next++);
+        len--;
+    }
+    return ~static_cast<uint32_t>(crc0);
+}
+#endif
+
+/// Extends the given CRC (0 for a new checksum) with len bytes from buf
+inline uint32_t compute(uint32_t crc, const void* buf, size_t len)
+{
+#if defined(__x86_64__)
+    if (get_tables().has_hw) { return compute_hw(crc, buf, len); }
+#endif
+    return compute_sw(crc, buf, len);
+}
+
+} // namespace crc32c
+} // namespace fineline
+
+#endif
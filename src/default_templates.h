@@ -37,6 +37,7 @@
 #include "legacy/log_index_sqlite.h"
 #include "legacy/log_storage.h"
 #include "log_fs.h"
+#include "log_index.h"
 
 namespace fineline {
 
@@ -63,7 +64,7 @@ using DftLogBuffer = AsyncRingBuffer<ExtLogPage, LogBufferSize>;
 using DftCommitBuffer = AetherInsertBuffer<ExtLogPage, foster::MutexLatch,
       DftLogBufferTemp, legacy::ConsolidationArray>;
 template <class P>
-using DftPersistentLogTemp = FileBasedLog<P, legacy::SQLiteLogIndex, legacy::log_storage>;
+using DftPersistentLogTemp = FileBasedLog<P, SelectableLogIndex, legacy::log_storage>;
 using DftPersistentLog = DftPersistentLogTemp<ExtLogPage>;
 using DftLogFlusher = LogFlusher<ExtLogPage, DftLogBufferTemp, DftPersistentLogTemp>;
 
@@ -36,10 +36,11 @@ void init(int argc, char** argv)
 
 void SysEnv::do_init(const Options& options)
 {
-    log_buffer = std::make_shared<DftLogBuffer>();
+    // Epochs continue from the last one found in the log
     log = std::make_shared<DftPersistentLog>(options);
+    log_buffer = std::make_shared<DftLogBuffer>(log->last_epoch() + 1);
     commit_buffer = std::make_shared<DftCommitBuffer>(log_buffer);
-    log_flusher = std::make_shared<DftLogFlusher>(log_buffer, log);
+    log_flusher = std::make_shared<DftLogFlusher>(log_buffer, log, options);
 }
 
 std::shared_ptr<DftLogBuffer> SysEnv::log_buffer;
@@ -0,0 +1,227 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef FINELINE_LEGACY_LOG_FD_CACHE_H
+#define FINELINE_LEGACY_LOG_FD_CACHE_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fineline {
+namespace legacy {
+
+/**
+ * \brief Bounded cache of the read file descriptors of log files.
+ *
+ * Each log file embeds an entry, which holds its read descriptor while the file is in the
+ * cache. Readers pin the entry for the duration of a read, which keeps the descriptor from
+ * being closed under them. Pinning a cached descriptor only takes an atomic increment, so
+ * concurrent readers of the same file do not serialize on a lock; only opening a file (i.e., a
+ * cache miss) takes the cache mutex.
+ *
+ * When more than capacity descriptors are open, unpinned ones are closed following the CLOCK
+ * approximation of LRU: pinning sets a reference bit, which the eviction sweep clears and then
+ * evicts entries whose bit is still clear on the next pass. Pinned entries are never evicted,
+ * so the number of open descriptors may exceed the capacity by the number of concurrent
+ * readers. A capacity of zero means the cache is unbounded.
+ */
+class log_fd_cache
+{
+public:
+    static constexpr int invalid_fd = -1;
+
+    class entry
+    {
+    public:
+        entry() : _fd(invalid_fd), _pins(0), _referenced(false), _cached(false) {}
+
+        entry(const entry&) = delete;
+        entry& operator=(const entry&) = delete;
+
+        /// Pins the entry if its descriptor is open and returns it; invalid_fd otherwise
+        int try_pin()
+        {
+            // Negative pin count means the entry is being evicted
+            int64_t pins = _pins.load(std::memory_order_acquire);
+            do {
+                if (pins < 0) { return invalid_fd; }
+            } while (!_pins.compare_exchange_weak(pins, pins + 1, std::memory_order_acq_rel));
+
+            int fd = _fd.load(std::memory_order_acquire);
+            if (fd == invalid_fd) {
+                unpin();
+                return invalid_fd;
+            }
+            // Avoid writing to a shared cache line on every read
+            if (!_referenced.load(std::memory_order_relaxed)) {
+                _referenced.store(true, std::memory_order_relaxed);
+            }
+            return fd;
+        }
+
+        void unpin()
+        {
+            _pins.fetch_sub(1, std::memory_order_release);
+        }
+
+    private:
+        friend class log_fd_cache;
+
+        std::atomic<int> _fd;
+        std::atomic<int64_t> _pins;
+        std::atomic<bool> _referenced;
+        // Protected by the cache mutex
+        bool _cached;
+    };
+
+    /// Unpins an entry when going out of scope
+    class unpin_guard
+    {
+    public:
+        explicit unpin_guard(entry& e) : _entry(e) {}
+        ~unpin_guard() { _entry.unpin(); }
+    private:
+        entry& _entry;
+    };
+
+    explicit log_fd_cache(size_t capacity = 0)
+        : _capacity(capacity), _hand(0)
+    {}
+
+    ~log_fd_cache()
+    {
+        for (auto e : _entries) {
+            ::close(e->_fd.load());
+            e->_fd = invalid_fd;
+            e->_cached = false;
+        }
+    }
+
+    /// Pins the entry, opening the given file if its descriptor is not cached
+    int pin(entry& e, const std::string& path)
+    {
+        int fd = e.try_pin();
+        if (fd != invalid_fd) { return fd; }
+
+        std::unique_lock<std::mutex> lck(_mutex);
+        // Another thread may have opened it in the meantime
+        fd = e.try_pin();
+        if (fd != invalid_fd) { return fd; }
+
+        fd = ::open(path.c_str(), O_RDONLY, 0);
+        if (fd < 0) { throw std::runtime_error("Error opening log file " + path); }
+        e._fd.store(fd, std::memory_order_release);
+        if (!e._cached) {
+            _entries.push_back(&e);
+            e._cached = true;
+        }
+
+        // No eviction can happen while the mutex is held, so pinning must succeed
+        fd = e.try_pin();
+        evict();
+        return fd;
+    }
+
+    /// Closes the descriptor of the entry, waiting for readers that pinned it
+    void remove(entry& e)
+    {
+        std::unique_lock<std::mutex> lck(_mutex);
+        if (!e._cached) { return; }
+
+        int64_t unpinned = 0;
+        while (!e._pins.compare_exchange_weak(unpinned, -1, std::memory_order_acq_rel)) {
+            unpinned = 0;
+            std::this_thread::yield();
+        }
+        for (size_t i = 0; i < _entries.size(); i++) {
+            if (_entries[i] == &e) {
+                close_entry(i);
+                break;
+            }
+        }
+    }
+
+    /// Number of descriptors currently open
+    size_t size()
+    {
+        std::unique_lock<std::mutex> lck(_mutex);
+        return _entries.size();
+    }
+
+private:
+    // Must be called with the mutex held
+    void evict()
+    {
+        if (_capacity == 0) { return; }
+
+        // Two full sweeps clear all reference bits, so a third one only finds pinned entries
+        size_t steps = 3 * _entries.size();
+        while (_entries.size() > _capacity && steps-- > 0) {
+            if (_hand >= _entries.size()) { _hand = 0; }
+            entry* e = _entries[_hand];
+
+            int64_t unpinned = 0;
+            if (e->_referenced.load(std::memory_order_relaxed)) {
+                e->_referenced.store(false, std::memory_order_relaxed);
+                _hand++;
+            }
+            else if (e->_pins.compare_exchange_strong(unpinned, -1,
+                        std::memory_order_acq_rel))
+            {
+                close_entry(_hand);
+            }
+            else {
+                _hand++;
+            }
+        }
+    }
+
+    // Closes the descriptor of the i-th entry, which must be marked with a negative pin count
+    void close_entry(size_t i)
+    {
+        entry* e = _entries[i];
+        ::close(e->_fd.load(std::memory_order_relaxed));
+        e->_fd.store(invalid_fd, std::memory_order_relaxed);
+        e->_referenced.store(false, std::memory_order_relaxed);
+        e->_cached = false;
+        _entries[i] = _entries.back();
+        _entries.pop_back();
+        e->_pins.store(0, std::memory_order_release);
+    }
+
+    const size_t _capacity;
+    std::mutex _mutex;
+    // Entries with an open descriptor, swept by the clock hand
+    std::vector<entry*> _entries;
+    size_t _hand;
+};
+
+} // namespace legacy
+} // namespace fineline
+
+#endif
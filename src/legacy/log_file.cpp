@@ -78,13 +78,17 @@ Rome Research Laboratory Contract No. F30602-97-2-0247.
 #include "log_file.h"
 
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdexcept>
 #include <string>
 #include <cerrno>
 #include <fcntl.h>
+#include <memory>
+#include <algorithm>
 
 #include "assertions.h"
 #include "log_storage.h"
+#include "logblock.h"
 
 namespace fineline {
 namespace legacy {
@@ -92,10 +96,33 @@ namespace legacy {
 using foster::assert;
 
 template<size_t PageSize>
-log_file<PageSize>::log_file(fs::path path, FileNumber num)
-    : _logpath(path), _num(num), _size(-1),
-      _fhdl_rd(invalid_fhdl), _fhdl_app(invalid_fhdl)
+log_file<PageSize>::log_file(fs::path path, FileNumber num,
+        std::shared_ptr<LogDeviceEmulator> device, size_t memory_capacity,
+        std::shared_ptr<log_fd_cache> fd_cache)
+    : _logpath(path), _num(num), _size(invalid_size),
+      _fhdl_app(invalid_fhdl), _device(device),
+      _capacity(memory_capacity), _mapped_length(0), _fd_cache(fd_cache), _temporary(false)
 {
+    if (!_fd_cache) { _fd_cache = std::make_shared<log_fd_cache>(); }
+    if (memory_capacity > 0) {
+        // Not initialized, so memory is only committed as blocks are appended
+        _memory.reset(new char[memory_capacity], std::default_delete<char[]>());
+        _size = 0;
+    }
+}
+
+template<size_t PageSize>
+size_t log_file<PageSize>::total_length(const iovec* iov, int iovcnt)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) { total += iov[i].iov_len; }
+    return total;
+}
+
+template<size_t PageSize>
+log_file<PageSize>::~log_file()
+{
+    _fd_cache->remove(_rd_entry);
 }
 
 template<size_t PageSize>
@@ -110,9 +137,10 @@ void log_file<PageSize>::check_error(int res)
 template<size_t PageSize>
 void log_file<PageSize>::open_for_append()
 {
+    if (is_volatile()) { return; }
     std::unique_lock<std::mutex> lck(_mutex);
 
-    assert<1>(!is_open_for_append());
+    assert<1>(_fhdl_app == invalid_fhdl);
 
     int fd, flags = O_RDWR | O_CREAT;
     string fname = make_log_name();
@@ -121,23 +149,6 @@ void log_file<PageSize>::open_for_append()
     _fhdl_app = fd;
 }
 
-template<size_t PageSize>
-void log_file<PageSize>::open_for_read()
-{
-    std::unique_lock<std::mutex> lck(_mutex);
-
-    if(_fhdl_rd == invalid_fhdl) {
-        string fname = make_log_name();
-        int flags = O_RDONLY;
-        int fd = ::open(fname.c_str(), flags, 0);
-        if (fd < 0) { throw std::runtime_error("Error opening log file"); }
-
-        assert<3>(_fhdl_rd == invalid_fhdl);
-        _fhdl_rd = fd;
-    }
-    assert<3>(is_open_for_read());
-}
-
 template<size_t PageSize>
 void log_file<PageSize>::close_for_append()
 {
@@ -152,19 +163,23 @@ void log_file<PageSize>::close_for_append()
 template<size_t PageSize>
 void log_file<PageSize>::close_for_read()
 {
-    std::unique_lock<std::mutex> lck(_mutex);
+    _fd_cache->remove(_rd_entry);
+}
 
-    if (_fhdl_rd != invalid_fhdl)  {
-        check_error(::close(_fhdl_rd));
-        _fhdl_rd = invalid_fhdl;
-    }
+template<size_t PageSize>
+int log_file<PageSize>::pin_for_read()
+{
+    // Path is only built on a cache miss
+    int fd = _rd_entry.try_pin();
+    if (fd == log_fd_cache::invalid_fd) { fd = _fd_cache->pin(_rd_entry, make_log_name()); }
+    return fd;
 }
 
 template<size_t PageSize>
 size_t log_file<PageSize>::get_size()
 {
-    if (_size < 0) { scan_for_size(); }
-    assert<3>(_size >= 0);
+    if (_size == invalid_size) { scan_for_size(); }
+    assert<3>(_size != invalid_size);
     return _size;
 }
 
@@ -172,50 +187,222 @@ template<size_t PageSize>
 void log_file<PageSize>::scan_for_size()
 {
     // start scanning backwards from end of file until first valid log page is found
-    open_for_read();
-
     std::unique_lock<std::mutex> lck(_mutex);
-    if (_size >= 0) { return; }
+    if (_size != invalid_size) { return; }
+
+    int fd = pin_for_read();
+    log_fd_cache::unpin_guard unpin {_rd_entry};
 
     struct stat statbuf;
-    ::fstat(_fhdl_rd, &statbuf);
+    check_error(::fstat(fd, &statbuf));
     size_t fsize = statbuf.st_size;
 
-    if (statbuf.st_size == 0) {
-        _size = 0;
-        return;
-    }
-
     /*
-     * For now, we just assume that if the file size is a multiple of the page size, then the
-     * file is consistent. Otherwise, we just trim out whatever leftover is at the end.
-     * In the future, we would probably want to check a CRC of each page, or something like that.
+     * A crash during a flush may leave a partially written block at the end of the file, i.e.,
+     * a block whose checksum does not match or that extends beyond the end of the file. Since
+     * blocks are appended in order and each append is synced before the next one starts, only
+     * the last block can be torn, so it is enough to look for the valid block that starts last.
+     * Blocks start at aligned offsets, so these are examined from the end of the file backwards,
+     * one window at a time. Anything after the last valid block is ignored and will be
+     * overwritten by the next append.
+     *
+     * A non-empty file without any valid block is rejected, unless it starts with a block
+     * header, i.e., its first block was torn. Such a file was most likely written in the format
+     * that preceded block headers, and treating it as empty would overwrite it.
      */
-    _size -= fsize % PageSize;
+    static_assert(PageSize > sizeof(LogBlockHeader), "Log file blocks must contain a header");
+    constexpr size_t max_body = PageSize - sizeof(LogBlockHeader);
+    constexpr size_t align = LogBlockHeader::Alignment;
+    std::unique_ptr<char[]> buffer;
+
+    size_t size = 0;
+    // Block starts below scan_end remain to be examined
+    size_t scan_end = fsize;
+    while (scan_end > 0 && size == 0) {
+        // Window covers all blocks that start in [lo, scan_end)
+        size_t lo = scan_end > PageSize ? (scan_end - PageSize) / align * align : 0;
+        size_t hi = std::min(fsize, scan_end + PageSize);
+        if (!buffer) { buffer.reset(new char[2 * PageSize + align]); }
+        check_error(::pread(fd, buffer.get(), hi - lo, lo));
+
+        for (size_t o = (scan_end + align - 1) / align * align; o > lo; ) {
+            o -= align;
+            if (o + sizeof(LogBlockHeader) > hi) { continue; }
+
+            LogBlockHeader hdr;
+            const char* block = buffer.get() + (o - lo);
+            ::memcpy(&hdr, block, sizeof(LogBlockHeader));
+            if (hdr.magic != LogBlockHeader::Magic || hdr.length > max_body
+                    || o + sizeof(LogBlockHeader) + hdr.length > hi)
+            {
+                continue;
+            }
+            if (hdr.is_valid(block + sizeof(LogBlockHeader), max_body)) {
+                size = o + aligned_block_size(hdr.length);
+                break;
+            }
+        }
+
+        scan_end = lo;
+    }
+
+    if (size == 0 && fsize > 0) {
+        uint32_t magic = 0;
+        size_t length = std::min(fsize, sizeof(magic));
+        check_error(::pread(fd, &magic, length, 0));
+        if (length < sizeof(magic) || magic != LogBlockHeader::Magic) {
+            throw std::runtime_error("Log file " + make_log_name()
+                    + " has no valid log block (written by an older version?)");
+        }
+    }
+
+    _size = size;
 }
 
 template<size_t PageSize>
-typename log_file<PageSize>::BlockOffset log_file<PageSize>::append(const void* src)
+typename log_file<PageSize>::BlockOffset log_file<PageSize>::append(const iovec* iov, int iovcnt,
+        bool sync)
 {
     assert<1>(is_open_for_append());
 
-    BlockOffset offset = std::atomic_fetch_add(&_size, PageSize);
-    check_error(::pwrite(_fhdl_app, src, PageSize, offset));
-    check_error(::fsync(_fhdl_app));
+    size_t length = total_length(iov, iovcnt);
+    assert<1>(length <= PageSize);
+    assert<1>(length >= sizeof(LogBlockHeader));
+
+    BlockOffset offset = std::atomic_fetch_add(&_size,
+            aligned_block_size(length - sizeof(LogBlockHeader)));
+
+    if (is_volatile()) {
+        assert<1>(offset + length <= _capacity);
+        char* dest = _memory.get() + offset;
+        for (int i = 0; i < iovcnt; i++) {
+            ::memcpy(dest, iov[i].iov_base, iov[i].iov_len);
+            dest += iov[i].iov_len;
+        }
+        if (_device) {
+            _device->write(length);
+            if (sync) { _device->sync(); }
+        }
+        return offset;
+    }
+
+    check_error(::pwritev(_fhdl_app, iov, iovcnt, offset));
+    if (_device) { _device->write(length); }
+    if (sync) { this->sync(); }
 
     return offset;
 }
 
 template<size_t PageSize>
-void log_file<PageSize>::read(BlockOffset offset, void* dest)
+void log_file<PageSize>::sync()
 {
-    assert<1>(is_open_for_read());
-    check_error(::pread(_fhdl_rd, dest, PageSize, offset));
+    if (is_volatile()) {
+        if (_device) { _device->sync(); }
+        return;
+    }
+
+    assert<1>(is_open_for_append());
+    if (_device) {
+        if (_device->real_sync()) { check_error(::fsync(_fhdl_app)); }
+        _device->sync();
+    }
+    else {
+        check_error(::fsync(_fhdl_app));
+    }
+}
+
+template<size_t PageSize>
+void log_file<PageSize>::make_permanent()
+{
+    if (!_temporary) { return; }
+    if (is_volatile()) {
+        _temporary = false;
+        return;
+    }
+
+    sync();
+    close_for_append();
+    close_for_read();
+    fs::path temp = make_log_path();
+    _temporary = false;
+    fs::rename(temp, make_log_path());
+}
+
+template<size_t PageSize>
+void log_file<PageSize>::read(BlockOffset offset, void* dest, size_t length)
+{
+    assert<1>(length <= PageSize);
+
+    if (is_volatile()) {
+        if (offset + length > _size) {
+            throw std::runtime_error("Log block at offset " + std::to_string(offset)
+                    + " extends beyond end of volatile file " + _num.str());
+        }
+        ::memcpy(dest, _memory.get() + offset, length);
+        return;
+    }
+
+    int fd = pin_for_read();
+    log_fd_cache::unpin_guard unpin {_rd_entry};
+    auto res = ::pread(fd, dest, length, offset);
+    check_error(res);
+    if (static_cast<size_t>(res) < length) {
+        throw std::runtime_error("Log block at offset " + std::to_string(offset)
+                + " extends beyond end of file " + make_log_name());
+    }
+}
+
+template<size_t PageSize>
+std::shared_ptr<const char> log_file<PageSize>::map_for_read(size_t length)
+{
+    if (is_volatile()) { return _memory; }
+
+    // Length is published after the mapping, so the mapping covers at least that length
+    if (_mapped_length.load(std::memory_order_acquire) >= length) {
+        auto mapping = std::atomic_load(&_mapping);
+        if (mapping) { return mapping; }
+    }
+
+    std::unique_lock<std::mutex> lck(_mutex);
+    if (_mapped_length >= length && _mapping) { return _mapping; }
+
+    /*
+     * The file being appended to may have to be remapped as it grows, so the mapping is made
+     * larger than requested to make that rare. This only reserves address space.
+     */
+    constexpr size_t granularity = 64 * 1024 * 1024;
+    size_t map_length = (length + granularity - 1) / granularity * granularity;
+    void* addr;
+    {
+        // Mapping remains valid after the descriptor is closed
+        int fd = pin_for_read();
+        log_fd_cache::unpin_guard unpin {_rd_entry};
+        addr = ::mmap(nullptr, map_length, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (addr == MAP_FAILED) { check_error(-1); }
+
+    // Fetches read scattered blocks, so readahead is only enabled by scans (see log_fs.h)
+    ::madvise(addr, map_length, MADV_RANDOM);
+
+    std::shared_ptr<const char> mapping {static_cast<const char*>(addr),
+        [map_length] (const char* p) { ::munmap(const_cast<char*>(p), map_length); }};
+    std::atomic_store(&_mapping, mapping);
+    _mapped_length.store(map_length, std::memory_order_release);
+    return mapping;
 }
 
 template<size_t PageSize>
 void log_file<PageSize>::destroy()
 {
+    // Memory of volatile files is released with the last reference to them
+    if (is_volatile()) { return; }
+
+    {
+        // Readers that still use the mapping keep it alive
+        std::unique_lock<std::mutex> lck(_mutex);
+        _mapped_length.store(0, std::memory_order_release);
+        std::atomic_store(&_mapping, std::shared_ptr<const char>{});
+    }
     close_for_read();
     close_for_append();
 
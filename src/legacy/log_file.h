@@ -82,12 +82,16 @@ Rome Research Laboratory Contract No. F30602-97-2-0247.
 #include <memory>
 #include <atomic>
 #include <mutex>
+#include <limits>
+#include <sys/uio.h>
 
 #define BOOST_FILESYSTEM_NO_DEPRECATED
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
 
 #include "lsn.h"
+#include "log_device.h"
+#include "log_fd_cache.h"
 
 namespace fineline {
 namespace legacy {
@@ -110,17 +114,46 @@ public:
     using FileNumber = UnsignedNumberPair<FileHighNumBits, FileLowNumBits>;
 
     static constexpr int invalid_fhdl = -1;
+    static constexpr size_t invalid_size = std::numeric_limits<size_t>::max();
 
-    log_file(fs::path logpath, FileNumber);
-    virtual ~log_file() { }
+    /*
+     * A non-zero memory capacity creates a volatile log file, whose blocks are kept in a memory
+     * buffer of that size instead of on disk (see log_volatile option). Appends to a volatile
+     * file are lock-free: space is reserved with an atomic increment and then copied into.
+     *
+     * Files are opened for reading on demand, and the read descriptor is kept in the given
+     * cache, which is shared by all files of a log_storage. Without a cache, the file uses a
+     * private one, i.e., its descriptor stays open until close_for_read().
+     */
+    log_file(fs::path logpath, FileNumber,
+            std::shared_ptr<LogDeviceEmulator> device = nullptr, size_t memory_capacity = 0,
+            std::shared_ptr<log_fd_cache> fd_cache = nullptr);
+    virtual ~log_file();
 
     void open_for_append();
-    void open_for_read();
     void close_for_append();
+    /// Closes the read descriptor, if it is cached
     void close_for_read();
 
-    void read(BlockOffset, void* dest);
-    BlockOffset append(const void* src);
+    /*
+     * Blocks are written with gather I/O, so that a block header and the log page that follows
+     * it can be kept in separate buffers. Blocks are variable-length, up to PageSize bytes, and
+     * each one takes up a multiple of LogBlockHeader::Alignment bytes in the file. Reads are
+     * plain byte ranges, which allows reading a block header before its body.
+     */
+    void read(BlockOffset, void* dest, size_t length);
+    BlockOffset append(const iovec* iov, int iovcnt, bool sync = true);
+    /// Makes blocks appended without a sync durable
+    void sync();
+
+    /*
+     * Returns a read-only mapping of the file which covers at least its first length bytes, so
+     * that blocks can be read in place instead of copied (see log_read_mmap option). The mapping
+     * remains valid while a reference to it is held, even if the file grows and is remapped, or
+     * is deleted. Only the range of valid blocks may be accessed, since pages of the mapping
+     * beyond the end of the file are not backed. Volatile files return their memory buffer.
+     */
+    std::shared_ptr<const char> map_for_read(size_t length);
 
     size_t get_size();
 
@@ -130,12 +163,20 @@ public:
 
     FileNumber num() const { return _num; }
 
-    bool is_open_for_read() const { return (_fhdl_rd != invalid_fhdl); }
+    bool is_volatile() const { return _memory.get() != nullptr; }
 
-    bool is_open_for_append() const { return (_fhdl_app != invalid_fhdl); }
+    bool is_open_for_append() const { return is_volatile() || (_fhdl_app != invalid_fhdl); }
 
     void set_size(size_t s) { _size = s; }
 
+    /*
+     * Files written by a merge are temporary until the merge is committed, i.e., they are named
+     * with merge_prefix instead of log_prefix, so that a file left behind by an interrupted
+     * merge is never taken for a log file. Making the file permanent syncs it and renames it.
+     */
+    void set_temporary() { _temporary = true; }
+    void make_permanent();
+
     std::string make_log_name() const
     {
         return make_log_path().string();
@@ -143,7 +184,8 @@ public:
 
     fs::path make_log_path() const
     {
-        auto s = log_storage<PageSize>::log_prefix;
+        auto s = _temporary ? log_storage<PageSize>::merge_prefix
+            : log_storage<PageSize>::log_prefix;
         auto s2 = _num.str();
         auto s3 = s + s2;
         return _logpath / fs::path(s3);
@@ -151,14 +193,23 @@ public:
 
 private:
     void check_error(int);
+    int pin_for_read();
+    static size_t total_length(const iovec* iov, int iovcnt);
 
 private:
     fs::path _logpath;
     FileNumber _num;
     std::atomic<size_t> _size;
-    int _fhdl_rd;
     int _fhdl_app;
     std::mutex _mutex;
+    std::shared_ptr<LogDeviceEmulator> _device;
+    std::shared_ptr<char> _memory;
+    size_t _capacity;
+    std::shared_ptr<const char> _mapping;
+    std::atomic<size_t> _mapped_length;
+    std::shared_ptr<log_fd_cache> _fd_cache;
+    log_fd_cache::entry _rd_entry;
+    bool _temporary;
 };
 
 } // namespace legacy
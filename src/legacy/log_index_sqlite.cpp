@@ -21,6 +21,9 @@
 
 #include <sqlite3.h>
 #include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <limits>
 
 #include "log_index_sqlite.h"
 
@@ -33,6 +36,17 @@ namespace legacy {
 
 using foster::assert;
 
+/*
+ * Version 1 keys blocks by their position, since the blocks of a merged run share the epoch of
+ * the run. Tables of older versions are dropped, which makes FileBasedLog rebuild the index.
+ */
+constexpr int SchemaVersion = 1;
+
+const auto DropTablesQuery =
+    "drop table if exists logblocks;"
+    "drop table if exists indexmeta;"
+;
+
 const auto CreateTablesQuery =
     "create table if not exists logblocks ("
     "   first_epoch unsigned big int,"
@@ -43,170 +57,563 @@ const auto CreateTablesQuery =
     "   min_key int,"
     "   max_key int,"
     "   bloom_filter blob(1024),"
-    "   primary key(level desc, first_epoch)"
+    "   primary key(level desc, file_number, block_number)"
     ");"
+    "create index if not exists logblocks_epoch on logblocks(level, first_epoch);"
+    "create table if not exists indexmeta ("
+    "   name text primary key,"
+    "   value unsigned big int"
+    ");"
+    "pragma user_version = 1;"
+;
+
+const auto ConfigureQuery =
+    "pragma journal_mode=wal;"
+    "pragma synchronous=normal;"
 ;
 
 const auto InsertBlockQuery =
-    "insert into logblocks values (?,?,0,?,?,?,?,NULL)";
+    "insert into logblocks values (?,?,?,?,?,?,?,?)";
+
+const auto DeleteFileQuery =
+    "delete from logblocks where file_number = ?";
 
+// Epoch of the last block covered by the index
+const auto UpdateCoveredEpochQuery =
+    "insert or replace into indexmeta values ('covered_epoch', ?)";
+
+const auto FetchLastBlockQuery =
+    "select file_number, block_number, last_epoch "
+    "from logblocks "
+    "where level = 0 and first_epoch = "
+    "   (select value from indexmeta where name = 'covered_epoch')"
+;
+
+// Merged levels are only written by merges, which index them before committing them
+const auto FetchLastMergedBlockQuery =
+    "select file_number, block_number, last_epoch "
+    "from logblocks "
+    "where level = ? "
+    "order by file_number desc, block_number desc "
+    "limit 1"
+;
+
+const auto LoadCacheQuery =
+    "select file_number, block_number, first_epoch, min_key, max_key, bloom_filter "
+    "from logblocks "
+    "order by level asc, file_number asc, block_number asc"
+;
+
+// Deeper levels hold older blocks, so forward fetches visit them first (see MemoryLogIndex)
 const auto FetchAllBlocksForward =
     "select file_number, block_number "
     "from logblocks "
-    "where level = ? "
-    "order by first_epoch asc, last_epoch desc"
+    "order by level desc, file_number asc, block_number asc"
 ;
 
 const auto FetchAllBlocksBackward =
     "select file_number, block_number "
     "from logblocks "
-    "where level = ? "
-    "order by last_epoch desc, first_epoch asc"
+    "order by level asc, file_number desc, block_number desc"
 ;
 
-const auto FetchForwardHistoryByLevelQuery =
+// Uses the epoch index, so only the blocks in the range are visited
+const auto FetchEpochRangeQuery =
     "select file_number, block_number "
     "from logblocks "
-    "where level = ? and ? >= min_key and ? <= max_key "
-    "order by first_epoch asc, last_epoch desc"
+    "where level = 0 and first_epoch >= ? and first_epoch < ? "
+    "order by first_epoch asc"
+;
+
+// Blocks overlapping a range of keys, which is a single key for fetches of one node
+const auto FetchForwardHistoryByLevelQuery =
+    "select file_number, block_number, bloom_filter, min_key, max_key "
+    "from logblocks "
+    "where ? >= min_key and ? <= max_key "
+    "order by level desc, file_number asc, block_number asc"
 ;
 
 const auto FetchBackwardHistoryByLevelQuery =
-    "select file_number, block_number "
+    "select file_number, block_number, bloom_filter, min_key, max_key "
+    "from logblocks "
+    "where ? >= min_key and ? <= max_key "
+    "order by level asc, file_number desc, block_number desc"
+;
+
+// Blocks of a key in a single level, which uses the primary key
+const auto FetchForwardHistoryOfLevelQuery =
+    "select file_number, block_number, bloom_filter, min_key, max_key "
     "from logblocks "
-    "where level = ? and ? >= min_key and ? <= max_key "
-    "order by last_epoch desc, first_epoch asc"
+    "where ? >= min_key and ? <= max_key and level = ? "
+    "order by file_number asc, block_number asc"
 ;
 
+const auto FetchBackwardHistoryOfLevelQuery =
+    "select file_number, block_number, bloom_filter, min_key, max_key "
+    "from logblocks "
+    "where ? >= min_key and ? <= max_key and level = ? "
+    "order by file_number desc, block_number desc"
+;
+
+// Time SQLite itself waits for locks before returning SQLITE_BUSY
+constexpr int BusyTimeoutMs = 100;
+
 SQLiteLogIndex::SQLiteLogIndex(const Options& options)
-    : db_(nullptr), max_level_(0) // TODO get max level during "recovery"
+    : db_(nullptr), writer_db_(nullptr),
+    inserted_count_(0), committed_count_(0), flush_requested_(0), shutdown_(false)
 {
     db_path_ = options.get<string>("log_index_path");
     if (options.get<bool>("log_index_path_relative")) {
         auto path = fs::path{options.get<string>("logpath")} / db_path_;
         db_path_ = path.string();
     }
+    batch_interval_ = std::chrono::milliseconds{
+        options.get<unsigned>("log_index_batch_interval")};
     connect();
     init();
+
+    if (options.get<bool>("log_index_cache")) {
+        cache_.reset(new MemoryLogIndex);
+        load_cache();
+    }
+
+    if (batch_interval_.count() > 0) {
+        writer_.reset(new std::thread {&SQLiteLogIndex::writer_loop, this});
+    }
 }
 
 SQLiteLogIndex::~SQLiteLogIndex()
 {
+    if (writer_) {
+        {
+            std::unique_lock<std::mutex> lck {pending_mutex_};
+            shutdown_ = true;
+        }
+        pending_cond_.notify_all();
+        writer_->join();
+    }
+    finalize();
     disconnect();
 }
 
 void SQLiteLogIndex::sql_check(int rc, int expected)
 {
     if (rc != expected) {
-        disconnect();
-        throw std::runtime_error("Error executing SQLite3 function");
+        throw std::runtime_error(std::string{"Error executing SQLite3 function: "}
+                + sqlite3_errstr(rc));
     }
 }
 
 void SQLiteLogIndex::connect()
 {
-    if (!db_) {
-        sql_check(sqlite3_open(db_path_.c_str(), &db_));
+    for (auto db : {&db_, &writer_db_}) {
+        if (!*db) {
+            sql_check(sqlite3_open(db_path_.c_str(), db));
+            sqlite3_busy_timeout(*db, BusyTimeoutMs);
+        }
     }
 }
 
 void SQLiteLogIndex::disconnect()
 {
-    if (db_) {
-        sqlite3_close(db_);
+    for (auto db : {&db_, &writer_db_}) {
+        if (*db) {
+            sqlite3_close(*db);
+            *db = nullptr;
+        }
     }
 }
 
 void SQLiteLogIndex::init()
 {
-    sql_check(sqlite3_exec(db_, CreateTablesQuery, 0, 0, 0));
-    sql_check(sqlite3_prepare_v2(db_, InsertBlockQuery, -1, &insert_stmt_, 0));
+    sql_check(sqlite3_exec(writer_db_, ConfigureQuery, 0, 0, 0));
+
+    sqlite3_stmt* stmt;
+    sql_check(sqlite3_prepare_v2(writer_db_, "pragma user_version", -1, &stmt, 0));
+    int version = step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
+    if (version < SchemaVersion) {
+        sql_check(sqlite3_exec(writer_db_, DropTablesQuery, 0, 0, 0));
+    }
+
+    sql_check(sqlite3_exec(writer_db_, CreateTablesQuery, 0, 0, 0));
+    sql_check(sqlite3_prepare_v2(writer_db_, InsertBlockQuery, -1, &insert_stmt_, 0));
+    sql_check(sqlite3_prepare_v2(writer_db_, DeleteFileQuery, -1, &delete_stmt_, 0));
+    sql_check(sqlite3_prepare_v2(writer_db_, UpdateCoveredEpochQuery, -1, &marker_stmt_, 0));
 }
 
 void SQLiteLogIndex::finalize()
 {
     sqlite3_finalize(insert_stmt_);
+    sqlite3_finalize(delete_stmt_);
+    sqlite3_finalize(marker_stmt_);
 }
 
-void SQLiteLogIndex::insert_block(uint32_t file, uint32_t block, uint64_t epoch,
-        uint64_t min, uint64_t max)
+void SQLiteLogIndex::load_cache()
 {
-    sql_check(sqlite3_reset(insert_stmt_));
+    sqlite3_stmt* stmt;
+    sql_check(sqlite3_prepare_v2(db_, LoadCacheQuery, -1, &stmt, 0));
 
-    sql_check(sqlite3_bind_int(insert_stmt_, 1, epoch));
-    sql_check(sqlite3_bind_int(insert_stmt_, 2, epoch));
-    sql_check(sqlite3_bind_int(insert_stmt_, 3, file));
-    sql_check(sqlite3_bind_int(insert_stmt_, 4, block));
-    sql_check(sqlite3_bind_int(insert_stmt_, 5, min));
-    sql_check(sqlite3_bind_int(insert_stmt_, 6, max));
+    int rc;
+    BloomFilter filter;
+    while ((rc = step(stmt)) == SQLITE_ROW) {
+        bool has_filter = sqlite3_column_bytes(stmt, 5) == sizeof(BloomFilter);
+        if (has_filter) {
+            ::memcpy(&filter, sqlite3_column_blob(stmt, 5), sizeof(BloomFilter));
+        }
+        cache_->insert_block(sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1),
+                sqlite3_column_int64(stmt, 2), sqlite3_column_int64(stmt, 3),
+                sqlite3_column_int64(stmt, 4), has_filter ? &filter : nullptr);
+    }
+    sqlite3_finalize(stmt);
+    sql_check(rc, SQLITE_DONE);
+}
 
-    int rc = SQLITE_BUSY;
+int SQLiteLogIndex::step(sqlite3_stmt* stmt)
+{
+    // Busy timeout already waits for locks; this only backs off if it expires
+    auto backoff = std::chrono::microseconds{100};
+    int rc = sqlite3_step(stmt);
     while (rc == SQLITE_BUSY) {
-        rc = sqlite3_step(insert_stmt_);
+        std::this_thread::sleep_for(backoff);
+        backoff = std::min(2 * backoff, std::chrono::microseconds{10000});
+        rc = sqlite3_step(stmt);
     }
-    sql_check(rc, SQLITE_DONE);
+    return rc;
+}
+
+void SQLiteLogIndex::insert_block(uint32_t file, uint32_t block, uint64_t epoch,
+        uint64_t min, uint64_t max, const BloomFilter* filter)
+{
+    // Cache is updated right away, so that fetches do not have to wait for the writer
+    if (cache_) { cache_->insert_block(file, block, epoch, min, max, filter); }
+
+    PendingBlock b {file, block, epoch, min, max, nullptr};
+    if (filter) { b.filter = std::make_shared<BloomFilter>(*filter); }
+    if (!writer_) {
+        write_blocks({b});
+        return;
+    }
+
+    std::unique_lock<std::mutex> lck {pending_mutex_};
+    if (writer_error_) { std::rethrow_exception(writer_error_); }
+    pending_.push_back(b);
+    inserted_count_++;
+}
+
+void SQLiteLogIndex::write_blocks(const std::vector<PendingBlock>& blocks)
+{
+    std::unique_lock<std::mutex> lck {write_mutex_};
+
+    sql_check(sqlite3_exec(writer_db_, "begin", 0, 0, 0));
+    try {
+        // Level 0 blocks are inserted in epoch order, so the last one is the highest covered
+        bool level0 = false;
+        uint64_t covered = 0;
+        for (auto& b : blocks) {
+            sql_check(sqlite3_reset(insert_stmt_));
+            sql_check(sqlite3_bind_int64(insert_stmt_, 1, b.epoch));
+            sql_check(sqlite3_bind_int64(insert_stmt_, 2, b.epoch));
+            sql_check(sqlite3_bind_int(insert_stmt_, 3, MemoryLogIndex::level_of(b.file)));
+            sql_check(sqlite3_bind_int(insert_stmt_, 4, b.file));
+            sql_check(sqlite3_bind_int(insert_stmt_, 5, b.block));
+            sql_check(sqlite3_bind_int64(insert_stmt_, 6, b.min));
+            sql_check(sqlite3_bind_int64(insert_stmt_, 7, b.max));
+            if (b.filter) {
+                sql_check(sqlite3_bind_blob(insert_stmt_, 8, b.filter->data(),
+                            sizeof(BloomFilter), SQLITE_STATIC));
+            }
+            else {
+                sql_check(sqlite3_bind_null(insert_stmt_, 8));
+            }
+            sql_check(step(insert_stmt_), SQLITE_DONE);
+
+            if (MemoryLogIndex::level_of(b.file) == 0) {
+                level0 = true;
+                covered = b.epoch;
+            }
+        }
+
+        if (level0) {
+            sql_check(sqlite3_reset(marker_stmt_));
+            sql_check(sqlite3_bind_int64(marker_stmt_, 1, covered));
+            sql_check(step(marker_stmt_), SQLITE_DONE);
+        }
+
+        sql_check(sqlite3_exec(writer_db_, "commit", 0, 0, 0));
+    }
+    catch (...) {
+        sqlite3_exec(writer_db_, "rollback", 0, 0, 0);
+        throw;
+    }
+}
+
+void SQLiteLogIndex::writer_loop()
+{
+    std::vector<PendingBlock> batch;
+    std::unique_lock<std::mutex> lck {pending_mutex_};
+    while (true) {
+        pending_cond_.wait_for(lck, batch_interval_, [this] {
+            return shutdown_ || flush_requested_ > committed_count_;
+        });
+        if (pending_.empty()) {
+            if (shutdown_) { return; }
+            continue;
+        }
+
+        batch.clear();
+        std::swap(batch, pending_);
+        uint64_t count = inserted_count_;
+        lck.unlock();
+
+        std::exception_ptr error;
+        try { write_blocks(batch); }
+        catch (...) { error = std::current_exception(); }
+
+        lck.lock();
+        if (error) {
+            writer_error_ = error;
+            committed_cond_.notify_all();
+            return;
+        }
+        committed_count_ = count;
+        committed_cond_.notify_all();
+    }
+}
+
+void SQLiteLogIndex::flush()
+{
+    if (!writer_) { return; }
+
+    std::unique_lock<std::mutex> lck {pending_mutex_};
+    uint64_t count = inserted_count_;
+    if (committed_count_ >= count || writer_error_) {
+        if (writer_error_) { std::rethrow_exception(writer_error_); }
+        return;
+    }
+    flush_requested_ = std::max(flush_requested_, count);
+    pending_cond_.notify_one();
+    committed_cond_.wait(lck, [this, count] {
+        return committed_count_ >= count || writer_error_;
+    });
+    if (writer_error_) { std::rethrow_exception(writer_error_); }
+}
+
+void SQLiteLogIndex::delete_file(uint32_t file)
+{
+    if (cache_) { cache_->delete_file(file); }
+    flush();
+    std::unique_lock<std::mutex> lck {write_mutex_};
+
+    sql_check(sqlite3_reset(delete_stmt_));
+    sql_check(sqlite3_bind_int(delete_stmt_, 1, file));
+    sql_check(step(delete_stmt_), SQLITE_DONE);
+}
+
+bool SQLiteLogIndex::get_last_block(uint32_t level, uint32_t& file, uint32_t& block,
+        uint64_t& epoch)
+{
+    flush();
+
+    sqlite3_stmt* stmt;
+    if (level == 0) {
+        sql_check(sqlite3_prepare_v2(db_, FetchLastBlockQuery, -1, &stmt, 0));
+    }
+    else {
+        sql_check(sqlite3_prepare_v2(db_, FetchLastMergedBlockQuery, -1, &stmt, 0));
+        sql_check(sqlite3_bind_int(stmt, 1, level));
+    }
+    int rc = step(stmt);
+    bool found = rc == SQLITE_ROW;
+    if (found) {
+        file = sqlite3_column_int(stmt, 0);
+        block = sqlite3_column_int(stmt, 1);
+        epoch = sqlite3_column_int64(stmt, 2);
+    }
+    sqlite3_finalize(stmt);
+    if (!found) { sql_check(rc, SQLITE_DONE); }
+    return found;
 }
 
 std::unique_ptr<SQLiteLogIndex::FetchBlockIterator> SQLiteLogIndex::fetch_blocks(bool forward)
 {
+    if (cache_) {
+        return std::unique_ptr<FetchBlockIterator> {
+            new FetchBlockIterator {cache_->fetch_blocks(forward)} };
+    }
+    flush();
     return std::unique_ptr<FetchBlockIterator> { new FetchBlockIterator {this, forward} };
 }
 
 std::unique_ptr<SQLiteLogIndex::FetchBlockIterator> SQLiteLogIndex::fetch_blocks(uint64_t key,
         bool forward)
 {
+    if (cache_) {
+        return std::unique_ptr<FetchBlockIterator> {
+            new FetchBlockIterator {cache_->fetch_blocks(key, forward)} };
+    }
+    flush();
     return std::unique_ptr<FetchBlockIterator> { new FetchBlockIterator {this, key, forward} };
 }
 
+std::unique_ptr<SQLiteLogIndex::FetchBlockIterator> SQLiteLogIndex::fetch_blocks(uint64_t key,
+        bool forward, uint32_t level)
+{
+    if (cache_) {
+        return std::unique_ptr<FetchBlockIterator> {
+            new FetchBlockIterator {cache_->fetch_blocks(key, forward, level)} };
+    }
+    flush();
+    return std::unique_ptr<FetchBlockIterator> {
+        new FetchBlockIterator {this, key, forward, level} };
+}
+
+std::unique_ptr<SQLiteLogIndex::FetchBlockIterator> SQLiteLogIndex::fetch_blocks(
+        std::shared_ptr<const std::vector<uint64_t>> keys, bool forward)
+{
+    if (cache_) {
+        return std::unique_ptr<FetchBlockIterator> {
+            new FetchBlockIterator {cache_->fetch_blocks(keys, forward)} };
+    }
+    flush();
+    return std::unique_ptr<FetchBlockIterator> { new FetchBlockIterator {this, keys, forward} };
+}
+
+std::unique_ptr<SQLiteLogIndex::FetchBlockIterator> SQLiteLogIndex::fetch_blocks(
+        MemoryLogIndex::KeyRange range, bool forward)
+{
+    if (cache_) {
+        return std::unique_ptr<FetchBlockIterator> {
+            new FetchBlockIterator {cache_->fetch_blocks(range, forward)} };
+    }
+    flush();
+    return std::unique_ptr<FetchBlockIterator> { new FetchBlockIterator {this, range, forward} };
+}
+
+std::unique_ptr<SQLiteLogIndex::FetchBlockIterator> SQLiteLogIndex::fetch_epochs(
+        uint64_t epoch_from, uint64_t epoch_to)
+{
+    if (cache_) {
+        return std::unique_ptr<FetchBlockIterator> {
+            new FetchBlockIterator {cache_->fetch_epochs(epoch_from, epoch_to)} };
+    }
+    flush();
+    return std::unique_ptr<FetchBlockIterator> {
+        new FetchBlockIterator {this, MemoryLogIndex::EpochRange{epoch_from, epoch_to}} };
+}
+
 SQLiteLogIndex::FetchBlockIterator::FetchBlockIterator(SQLiteLogIndex* owner, bool forward)
 {
     owner_ = owner;
     done_ = false;
     auto& query = forward ? FetchAllBlocksForward : FetchAllBlocksBackward;
     owner_->sql_check(sqlite3_prepare_v2(owner_->db_, query, -1, &stmt_, 0));
-    // TODO: here's where we iterate over levels to fetch from merged partitions
-    owner_->sql_check(sqlite3_bind_int(stmt_, 1, 0));
 }
 
 SQLiteLogIndex::FetchBlockIterator::FetchBlockIterator(SQLiteLogIndex* owner, uint64_t key,
         bool forward)
+    : FetchBlockIterator(owner, std::make_shared<std::vector<uint64_t>>(1, key), forward)
+{
+}
+
+SQLiteLogIndex::FetchBlockIterator::FetchBlockIterator(SQLiteLogIndex* owner,
+        std::shared_ptr<const std::vector<uint64_t>> keys, bool forward)
+{
+    owner_ = owner;
+    done_ = keys->empty();
+    keys_ = keys;
+    auto& query = forward ? FetchForwardHistoryByLevelQuery : FetchBackwardHistoryByLevelQuery;
+    owner_->sql_check(sqlite3_prepare_v2(owner_->db_, query, -1, &stmt_, 0));
+    if (done_) { return; }
+    owner_->sql_check(sqlite3_bind_int64(stmt_, 1, keys->back()));
+    owner_->sql_check(sqlite3_bind_int64(stmt_, 2, keys->front()));
+}
+
+SQLiteLogIndex::FetchBlockIterator::FetchBlockIterator(SQLiteLogIndex* owner, uint64_t key,
+        bool forward, uint32_t level)
 {
     owner_ = owner;
     done_ = false;
+    keys_ = std::make_shared<std::vector<uint64_t>>(1, key);
+    auto& query = forward ? FetchForwardHistoryOfLevelQuery : FetchBackwardHistoryOfLevelQuery;
+    owner_->sql_check(sqlite3_prepare_v2(owner_->db_, query, -1, &stmt_, 0));
+    owner_->sql_check(sqlite3_bind_int64(stmt_, 1, key));
+    owner_->sql_check(sqlite3_bind_int64(stmt_, 2, key));
+    owner_->sql_check(sqlite3_bind_int(stmt_, 3, level));
+}
+
+// Blocks are not filtered, since Bloom filters cannot rule out a range of keys
+SQLiteLogIndex::FetchBlockIterator::FetchBlockIterator(SQLiteLogIndex* owner,
+        MemoryLogIndex::KeyRange range, bool forward)
+{
+    owner_ = owner;
+    done_ = range.lo > range.hi;
     auto& query = forward ? FetchForwardHistoryByLevelQuery : FetchBackwardHistoryByLevelQuery;
     owner_->sql_check(sqlite3_prepare_v2(owner_->db_, query, -1, &stmt_, 0));
-    // TODO: here's where we iterate over levels to fetch from merged partitions
-    owner_->sql_check(sqlite3_bind_int(stmt_, 1, 0));
-    owner_->sql_check(sqlite3_bind_int(stmt_, 2, key));
-    owner_->sql_check(sqlite3_bind_int(stmt_, 3, key));
+    if (done_) { return; }
+    // SQLite integers are signed
+    constexpr uint64_t max_key = std::numeric_limits<int64_t>::max();
+    owner_->sql_check(sqlite3_bind_int64(stmt_, 1, std::min(range.hi, max_key)));
+    owner_->sql_check(sqlite3_bind_int64(stmt_, 2, std::min(range.lo, max_key)));
+}
+
+SQLiteLogIndex::FetchBlockIterator::FetchBlockIterator(SQLiteLogIndex* owner,
+        MemoryLogIndex::EpochRange range)
+{
+    owner_ = owner;
+    done_ = false;
+    owner_->sql_check(sqlite3_prepare_v2(owner_->db_, FetchEpochRangeQuery, -1, &stmt_, 0));
+    // SQLite integers are signed
+    constexpr uint64_t max_epoch = std::numeric_limits<int64_t>::max();
+    owner_->sql_check(sqlite3_bind_int64(stmt_, 1, std::min(range.from, max_epoch)));
+    owner_->sql_check(sqlite3_bind_int64(stmt_, 2, std::min(range.to, max_epoch)));
+}
+
+SQLiteLogIndex::FetchBlockIterator::FetchBlockIterator(
+        std::unique_ptr<MemoryLogIndex::FetchBlockIterator>&& cached)
+    : owner_(nullptr), stmt_(nullptr), done_(false), cached_(std::move(cached))
+{
 }
 
 SQLiteLogIndex::FetchBlockIterator::~FetchBlockIterator()
 {
-    owner_->sql_check(sqlite3_finalize(stmt_));
+    sqlite3_finalize(stmt_);
 }
 
 bool SQLiteLogIndex::FetchBlockIterator::next(uint32_t& file, uint32_t& block)
 {
+    if (cached_) { return cached_->next(file, block); }
     if (done_) { return false; }
 
-    int rc = SQLITE_BUSY;
-    while (rc == SQLITE_BUSY) {
-        rc = sqlite3_step(stmt_);
-    }
-    if (rc == SQLITE_DONE) {
-        done_ = true;
-        return false;
-    }
-    else if (rc == SQLITE_ROW) {
+    while (true) {
+        int rc = owner_->step(stmt_);
+        if (rc == SQLITE_DONE) {
+            done_ = true;
+            return false;
+        }
+        else if (rc != SQLITE_ROW) {
+            owner_->sql_check(rc);
+            return false;
+        }
+
+        // Blocks without a filter (i.e., a NULL column) may always contain the keys
+        if (keys_) {
+            BloomFilter filter;
+            bool has_filter = sqlite3_column_bytes(stmt_, 2) == sizeof(BloomFilter);
+            if (has_filter) {
+                ::memcpy(&filter, sqlite3_column_blob(stmt_, 2), sizeof(BloomFilter));
+            }
+            if (!MemoryLogIndex::may_contain_any(*keys_, sqlite3_column_int64(stmt_, 3),
+                        sqlite3_column_int64(stmt_, 4), has_filter ? &filter : nullptr))
+            {
+                continue;
+            }
+        }
+
         file = sqlite3_column_int(stmt_, 0);
         block = sqlite3_column_int(stmt_, 1);
+        return true;
     }
-    else {
-        owner_->sql_check(rc);
-        return false;
-    }
-    return true;
 }
 
 } // namespace legacy
@@ -23,9 +23,17 @@
 #define FINELINE_LEGACY_LOG_INDEX_SQLITE_H
 
 #include <memory>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <exception>
 
 #include "assertions.h"
 #include "log_storage.h"
+#include "bloom_filter.h"
+#include "log_index_memory.h"
 
 struct sqlite3;
 struct sqlite3_stmt;
@@ -38,6 +46,30 @@ namespace legacy {
 
 using foster::assert;
 
+/*
+ * The database is opened in WAL mode with synchronous=NORMAL, so that commits do not fsync.
+ * Block insertions are buffered and written by a separate writer thread in one transaction
+ * every log_index_batch_interval milliseconds, so that the log flusher never waits for SQLite.
+ * Each transaction also records the epoch of the last block it inserted, i.e., the epoch up to
+ * which the index covers the log, which tells recovery where to resume indexing the log files
+ * (see get_last_block). With an interval of zero, blocks are inserted synchronously.
+ *
+ * Queries and deletions first wait for buffered blocks to be committed, so they always observe
+ * every block inserted before them.
+ *
+ * Unless log_index_cache is disabled, the metadata of all blocks is also kept in a
+ * MemoryLogIndex, which is loaded from the database when the index is opened and updated as
+ * blocks are inserted and deleted. Fetches are then answered from memory, without preparing
+ * any statement or waiting for buffered blocks, and SQLite only serves to persist the index.
+ *
+ * Bloom filters of blocks are stored in the bloom_filter column. Fetches of a key read the
+ * filter of each block in the key's range and skip the blocks whose filter rules the key out.
+ * Fetches of several keys query the blocks that overlap the range of all keys, and then skip
+ * those which do not overlap or whose filter rules out each key.
+ *
+ * The level column holds the merge level of the block's file, and blocks are ordered by level
+ * and then by position, deepest level first for forward fetches (see MemoryLogIndex).
+ */
 class SQLiteLogIndex
 {
 public:
@@ -51,27 +83,57 @@ public:
             uint32_t block,
             uint64_t epoch,
             uint64_t min,
-            uint64_t max
+            uint64_t max,
+            const BloomFilter* filter = nullptr
     );
 
+    /// Removes all blocks of the given file from the index
+    void delete_file(uint32_t file);
+
+    /// Waits until all blocks inserted so far are committed
+    void flush();
+
+    /// Returns the last block of the given merge level covered by the index; false if none
+    bool get_last_block(uint32_t level, uint32_t& file, uint32_t& block, uint64_t& epoch);
+
     class FetchBlockIterator
     {
     public:
         FetchBlockIterator(SQLiteLogIndex* owner, bool forward);
         FetchBlockIterator(SQLiteLogIndex* owner, uint64_t key, bool forward);
+        FetchBlockIterator(SQLiteLogIndex* owner, uint64_t key, bool forward, uint32_t level);
+        FetchBlockIterator(SQLiteLogIndex* owner,
+                std::shared_ptr<const std::vector<uint64_t>> keys, bool forward);
+        FetchBlockIterator(SQLiteLogIndex* owner, MemoryLogIndex::KeyRange range, bool forward);
+        FetchBlockIterator(SQLiteLogIndex* owner, MemoryLogIndex::EpochRange range);
+        FetchBlockIterator(std::unique_ptr<MemoryLogIndex::FetchBlockIterator>&& cached);
         ~FetchBlockIterator();
         bool next(uint32_t& file, uint32_t& block);
     private:
         SQLiteLogIndex* owner_;
         sqlite3_stmt* stmt_;
         bool done_;
+        // Keys whose blocks are fetched, if any, sorted
+        std::shared_ptr<const std::vector<uint64_t>> keys_;
+        // Iterator over the in-memory cache, if used instead of a query
+        std::unique_ptr<MemoryLogIndex::FetchBlockIterator> cached_;
     };
 
     std::unique_ptr<FetchBlockIterator> fetch_blocks(bool forward);
     std::unique_ptr<FetchBlockIterator> fetch_blocks(uint64_t key, bool forward);
+    /// Blocks of the given merge level only
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(uint64_t key, bool forward, uint32_t level);
+    /// Blocks that may contain any of the given keys, which must be sorted
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(
+            std::shared_ptr<const std::vector<uint64_t>> keys, bool forward);
+    /// Blocks that may contain any key of the given range
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(MemoryLogIndex::KeyRange range,
+            bool forward);
+    /// Blocks with epochs in [epoch_from, epoch_to), in epoch order
+    std::unique_ptr<FetchBlockIterator> fetch_epochs(uint64_t epoch_from, uint64_t epoch_to);
 
     // Used for tests
-    sqlite3* get_db() { return db_; }
+    sqlite3* get_db() { flush(); return db_; }
 
 protected:
 
@@ -82,11 +144,49 @@ protected:
     void init();
     void finalize();
 
+    struct PendingBlock
+    {
+        uint32_t file;
+        uint32_t block;
+        uint64_t epoch;
+        uint64_t min;
+        uint64_t max;
+        std::shared_ptr<const BloomFilter> filter;
+    };
+
+    void writer_loop();
+    void write_blocks(const std::vector<PendingBlock>& blocks);
+    int step(sqlite3_stmt* stmt);
+    void load_cache();
+
 private:
     sqlite3* db_;
+    // Connection used for writes, which may happen in the writer thread
+    sqlite3* writer_db_;
     sqlite3_stmt* insert_stmt_;
+    sqlite3_stmt* delete_stmt_;
+    sqlite3_stmt* marker_stmt_;
     std::string db_path_;
-    unsigned max_level_;
+
+    std::chrono::milliseconds batch_interval_;
+    // Serializes transactions on the writer connection
+    std::mutex write_mutex_;
+
+    // Buffered blocks, protected by pending_mutex_
+    std::mutex pending_mutex_;
+    std::condition_variable pending_cond_;
+    std::condition_variable committed_cond_;
+    std::vector<PendingBlock> pending_;
+    uint64_t inserted_count_;
+    uint64_t committed_count_;
+    // Count up to which some thread is waiting in flush()
+    uint64_t flush_requested_;
+    bool shutdown_;
+    std::exception_ptr writer_error_;
+    std::unique_ptr<std::thread> writer_;
+
+    // Null if log_index_cache is disabled
+    std::unique_ptr<MemoryLogIndex> cache_;
 };
 
 } // namespace legacy
@@ -27,11 +27,16 @@
 #include <cstdio>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
 #include <atomic>
 #include <thread>
 #include <chrono>
 
 #include "log_storage.h"
+#include "crc32c.h"
 
 namespace fineline {
 namespace legacy {
@@ -52,39 +57,64 @@ public:
 
     ~file_recycler_t()
     {
-        retire = true;
-        if (_thread.get()) {
-            wakeup();
-            _thread->join();
+        shutdown();
+    }
+
+    void shutdown()
+    {
+        std::unique_ptr<std::thread> thread;
+        {
+            std::unique_lock<std::mutex> lck(_mutex);
+            retire = true;
+            thread = std::move(_thread);
+            _cond.notify_one();
         }
+        if (thread) { thread->join(); }
     }
 
+    /*
+     * Readers do not signal when they release a file, so files whose deletion was deferred
+     * are also retried periodically.
+     */
     void run()
     {
+        std::unique_lock<std::mutex> lck(_mutex);
         while (!retire) {
-            std::unique_lock<std::mutex> lck(_mutex);
-            _cond.wait(lck);
-            if (retire.load()) { break; }
-            storage->delete_old_files();
+            _cond.wait_for(lck, RetryInterval, [this] { return retire || pending; });
+            if (retire) { break; }
+            pending = false;
+            lck.unlock();
+            try { storage->recycle_files(); }
+            catch (...) {} // retried later; files remain marked for deletion
+            lck.lock();
         }
     }
 
     void wakeup()
     {
         std::unique_lock<std::mutex> lck(_mutex);
+        if (retire) { return; }
         if (!_thread.get()) {
             _thread.reset(new std::thread {&file_recycler_t::run, this});
         }
+        pending = true;
         _cond.notify_one();
     }
 
+    static constexpr std::chrono::milliseconds RetryInterval {100};
+
     LogStorage* storage;
-    std::atomic<bool> retire;
+    bool retire;
+    // Whether recycle_files was requested since the last call; protected by _mutex
+    bool pending = false;
     std::condition_variable _cond;
     std::mutex _mutex;
     std::unique_ptr<std::thread> _thread;
 };
 
+template <class LogStorage>
+constexpr std::chrono::milliseconds file_recycler_t<LogStorage>::RetryInterval;
+
 /*
  * Opens log files in logdir and initializes partitions as well as the
  * given LSN's. The buffer given in prime_buf is primed with the contents
@@ -95,6 +125,38 @@ template <size_t P>
 log_storage<P>::log_storage(const Options& options)
     : _recycler(this)
 {
+    _volatile = options.get<bool>("log_volatile");
+    _file_size = options.get<unsigned>("log_file_size");
+    // option given in MB -> convert to B
+    _file_size *= 1024 * 1024;
+    /*
+     * Round down to a multiple of the block size, but keep at least one block: blocks of 1MB
+     * pages are slightly larger than 1MB, and a volatile file of size 0 would not be allocated
+     * in memory at all.
+     */
+    auto round_size = [] (size_t size) { return std::max<size_t>(size / P, 1) * P; };
+    _file_size = round_size(_file_size);
+    for (auto& size : split_list(options.get<string>("log_level_file_sizes"))) {
+        _level_file_sizes.push_back(round_size(std::stoul(size) * 1024 * 1024));
+    }
+
+    _max_files = options.get<unsigned>("log_max_files");
+    _delete_old_files = options.get<bool>("log_recycle");
+    _device = LogDeviceEmulator::create(options);
+    _fd_cache = std::make_shared<log_fd_cache>(options.get<unsigned>("log_max_open_files"));
+
+    /*
+     * A volatile log keeps all files in memory and never touches the log directory. Its memory
+     * is bounded by log_max_files * log_file_size: appends fail once that many files exist,
+     * unless files can be deleted because they were recycled or merged (see FileBasedLog).
+     */
+    if (_volatile) {
+        if (_max_files == 0) {
+            throw std::runtime_error("ERROR: log_max_files must be set for a volatile log.");
+        }
+        return;
+    }
+
     string logpath = options.get<string>("logpath");
     if (logpath.empty()) {
         throw std::runtime_error("ERROR: logpath must be set to enable logging.");
@@ -103,33 +165,100 @@ log_storage<P>::log_storage(const Options& options)
     _index_file_name = options.get<string>("log_index_path");
 
     bool reformat = options.get<bool>("format");
-    if (!fs::exists(_logpath)) {
+    // Index is rebuilt from the log files by FileBasedLog (see recover_index)
+    bool drop_index = reformat || options.get<bool>("log_index_rebuild");
+    for (auto& path : split_list(options.get<string>("log_level_paths"))) {
+        _level_paths.push_back(path.empty() ? _logpath : fs::path{path});
+    }
+    std::vector<fs::path> dirs {_logpath};
+    dirs.insert(dirs.end(), _level_paths.begin(), _level_paths.end());
+    for (auto& dir : dirs) {
+        if (fs::exists(dir)) { continue; }
         if (reformat) {
-            fs::create_directories(_logpath);
+            fs::create_directories(dir);
         } else {
-            auto what = "Error: could not open the log directory " + logpath;
+            auto what = "Error: could not open the log directory " + dir.string();
             throw std::runtime_error(what);
         }
     }
 
-    _file_size = options.get<unsigned>("log_file_size");
-    // option given in MB -> convert to B
-    _file_size *= 1024 * 1024;
-    // round to next multiple of the page size
-    _file_size = (_file_size / P) * P;
+    /*
+     * The manifest lists all log files, so that the directory does not have to be scanned.
+     * Files are only opened once they are accessed. The directory is scanned only if the
+     * manifest is missing or invalid, or if files other than log files must be removed, and
+     * in that case a new manifest is written.
+     */
+    bool from_manifest = !drop_index && read_manifest();
+    if (!from_manifest) { scan_directory(reformat, drop_index); }
+
+    /*
+     * Last file of level 0 is the current one, unless it was retired. Files of merged levels
+     * are never appended to once a merge commits them.
+     */
+    std::shared_ptr<LogFile> last;
+    for (auto& elem : _files) {
+        if (elem.first.hi() == 0 && !_retired.count(elem.first)) { last = elem.second; }
+    }
+    if (last) {
+        last->open_for_append();
+        _current[0] = last;
+    }
 
-    _max_files = options.get<unsigned>("log_max_files");
-    _delete_old_files = options.get<bool>("log_recycle");
+    if (!from_manifest) { write_manifest(); }
+}
+
+template <size_t P>
+std::vector<string> log_storage<P>::split_list(const string& list)
+{
+    std::vector<string> items;
+    if (list.empty()) { return items; }
+    std::stringstream ss {list};
+    string item;
+    while (std::getline(ss, item, ',')) { items.push_back(item); }
+    return items;
+}
+
+template <size_t P>
+fs::path log_storage<P>::level_path(FileHighNumber level) const
+{
+    if (level == 0 || _level_paths.empty()) { return _logpath; }
+    return _level_paths[std::min<size_t>(level, _level_paths.size()) - 1];
+}
 
-    std::map<FileHighNumber, FileLowNumber> last_files;
-    fs::directory_iterator it(_logpath), eod;
+template <size_t P>
+size_t log_storage<P>::get_file_size(FileHighNumber level) const
+{
+    if (level == 0 || _level_file_sizes.empty()) { return _file_size; }
+    return _level_file_sizes[std::min<size_t>(level, _level_file_sizes.size()) - 1];
+}
+
+/*
+ * Directories of the merged levels may be nested in logpath, and several levels may share a
+ * directory, so each directory is scanned once and subdirectories are skipped. Each log file
+ * must be in the directory of its level.
+ */
+template <size_t P>
+void log_storage<P>::scan_directory(bool reformat, bool drop_index)
+{
+    std::set<fs::path> dirs {fs::canonical(_logpath)};
+    for (auto& dir : _level_paths) { dirs.insert(fs::canonical(dir)); }
+    for (auto& dir : dirs) { scan_directory(dir, reformat, drop_index); }
+}
+
+template <size_t P>
+void log_storage<P>::scan_directory(const fs::path& dir, bool reformat, bool drop_index)
+{
+    fs::directory_iterator it(dir), eod;
     boost::regex log_rx(log_regex, boost::regex::basic);
+    string manifest {manifest_name};
+    bool is_logpath = fs::equivalent(dir, _logpath);
 
     for (; it != eod; it++) {
         fs::path fpath = it->path();
         string fname = fpath.filename().string();
 
-        if (boost::regex_match(fname, log_rx)) {
+        if (fs::is_directory(fpath)) { continue; }
+        else if (boost::regex_match(fname, log_rx)) {
             if (reformat) {
                 fs::remove(fpath);
                 continue;
@@ -138,43 +267,180 @@ log_storage<P>::log_storage(const Options& options)
             std::stringstream ss {fname.substr(string{log_prefix}.length())};
             FileNumber fnum;
             ss >> fnum;
-
-            _files[fnum] = std::make_shared<LogFile>(_logpath, fnum);
-            if (last_files.find(fnum.hi()) == last_files.end()
-                    || fnum >= last_files[fnum.hi()])
-            {
-                last_files[fnum.hi()] = fnum.lo();
+            if (!fs::equivalent(dir, level_path(fnum.hi()))) {
+                auto what = "log_storage: file " + fpath.string()
+                    + " is not in the directory of its level";
+                throw std::runtime_error(what);
             }
+
+            _files[fnum] = std::make_shared<LogFile>(dir, fnum, _device, 0, _fd_cache);
+        }
+        else if (!is_logpath && fname.substr(0, string{merge_prefix}.length()) != merge_prefix) {
+            // Directories of merged levels may be shared with other data
+            continue;
         }
         else if (fname.substr(0, _index_file_name.length()) == _index_file_name) {
-            if (reformat) {
+            if (drop_index) {
                 fs::remove(fpath);
                 continue;
             }
             // ignore
         }
+        else if (fname == manifest || fname == manifest + ".tmp") {
+            // Rewritten once the scan is done
+            fs::remove(fpath);
+        }
+        else if (fname.substr(0, string{merge_prefix}.length()) == merge_prefix) {
+            // Left behind by an interrupted merge
+            fs::remove(fpath);
+        }
         else {
             auto what = "log_storage: cannot parse filename " + fname;
             throw std::runtime_error(what);
         }
     }
+}
 
-    for (auto elem : last_files) {
-        auto fnum = FileNumber {elem.first, elem.second};
-        auto p = get_file(fnum);
-        if (!p) {
-            create_file(fnum);
-            p = get_file(fnum);
-            assert<0>(p.get());
+template <size_t P>
+bool log_storage<P>::read_manifest()
+{
+    string path = (_logpath / string{manifest_name}).string();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) { return false; }
+
+    struct stat st;
+    std::vector<char> contents;
+    bool ok = ::fstat(fd, &st) == 0;
+    if (ok) {
+        contents.resize(st.st_size);
+        ok = ::pread(fd, contents.data(), contents.size(), 0)
+            == static_cast<ssize_t>(contents.size());
+    }
+    ::close(fd);
+    if (!ok || contents.size() < sizeof(ManifestHeader)) { return false; }
+
+    ManifestHeader hdr;
+    ::memcpy(&hdr, contents.data(), sizeof(hdr));
+    size_t body_length = contents.size() - sizeof(hdr);
+    if (hdr.magic != ManifestMagic || body_length != hdr.count * sizeof(ManifestEntry)
+            || hdr.checksum != crc32c::compute(0, contents.data() + sizeof(hdr), body_length))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < hdr.count; i++) {
+        ManifestEntry entry;
+        ::memcpy(&entry, contents.data() + sizeof(hdr) + i * sizeof(entry), sizeof(entry));
+        FileNumber fnum {static_cast<typename FileNumber::NumType>(entry.file)};
+        auto p = std::make_shared<LogFile>(level_path(fnum.hi()), fnum, _device, 0, _fd_cache);
+        /*
+         * Merge that retired the file was committed, but the file may not have been deleted.
+         * It is deleted once the deletion callback is set, so that the callback removes the
+         * file from the index as well.
+         */
+        if (entry.size == RetiredSize) {
+            _files[fnum] = p;
+            _retired.insert(fnum);
+            _deferred.insert(fnum);
+            continue;
         }
-        p->open_for_append();
-        _current[elem.first] = p;
+        // Merge that wrote the file was committed, but the file may not have been renamed
+        auto temp = level_path(fnum.hi()) / (string{merge_prefix} + fnum.str());
+        if (fs::exists(temp)) { fs::rename(temp, p->make_log_path()); }
+        // Sealed files need not be scanned for a torn tail
+        if (entry.size != UnsealedSize) { p->set_size(entry.size); }
+        _files[fnum] = p;
+    }
+
+    // Remaining temporary files were left behind by merges that did not commit
+    std::set<fs::path> dirs {_logpath};
+    dirs.insert(_level_paths.begin(), _level_paths.end());
+    for (auto& dir : dirs) {
+        fs::directory_iterator it(dir), eod;
+        for (; it != eod; it++) {
+            string fname = it->path().filename().string();
+            if (fname.substr(0, string{merge_prefix}.length()) == merge_prefix
+                    && !fs::is_directory(it->path()))
+            {
+                fs::remove(it->path());
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * The manifest is replaced atomically by writing a temporary file and renaming it, and it is
+ * rewritten whenever a file is created, before the new file itself is created. A crash thus
+ * leaves either the old or the new manifest, and a file missing from the directory can only
+ * be the last one, which is created again by open_for_append.
+ */
+template <size_t P>
+void log_storage<P>::write_manifest()
+{
+    if (_volatile) { return; }
+    std::unique_lock<std::mutex> lck(_manifest_mutex);
+
+    std::vector<std::pair<std::shared_ptr<LogFile>, uint64_t>> files;
+    {
+        SharedLatchContext cs(&_file_map_latch);
+        for (auto& elem : _files) {
+            auto curr = _current.find(elem.first.hi());
+            bool sealed = curr == _current.end() || curr->second != elem.second;
+            uint64_t size = sealed ? 0 : UnsealedSize;
+            if (_retired.count(elem.first)) { size = RetiredSize; }
+            files.emplace_back(elem.second, size);
+        }
+    }
+
+    std::vector<char> contents(sizeof(ManifestHeader) + files.size() * sizeof(ManifestEntry));
+    for (size_t i = 0; i < files.size(); i++) {
+        auto& p = files[i].first;
+        ManifestEntry entry {p->num().data(), files[i].second};
+        if (entry.size == 0) { entry.size = p->get_size(); }
+        ::memcpy(&contents[sizeof(ManifestHeader) + i * sizeof(entry)], &entry, sizeof(entry));
+    }
+    ManifestHeader hdr {ManifestMagic, 0, files.size()};
+    hdr.checksum = crc32c::compute(0, contents.data() + sizeof(hdr),
+            contents.size() - sizeof(hdr));
+    ::memcpy(contents.data(), &hdr, sizeof(hdr));
+
+    string path = (_logpath / string{manifest_name}).string();
+    string tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0
+        && ::write(fd, contents.data(), contents.size()) == static_cast<ssize_t>(contents.size())
+        && ::fsync(fd) == 0;
+    if (fd >= 0) { ::close(fd); }
+    ok = ok && ::rename(tmp_path.c_str(), path.c_str()) == 0;
+
+    if (!ok) {
+        throw std::runtime_error("Error writing log manifest " + path + ": "
+                + ::strerror(errno));
+    }
+    // Rename is only durable once the directory is synced
+    sync_directory(_logpath);
+}
+
+template <size_t P>
+void log_storage<P>::sync_directory(const fs::path& dir)
+{
+    int dir_fd = ::open(dir.string().c_str(), O_RDONLY | O_DIRECTORY);
+    bool ok = dir_fd >= 0 && ::fsync(dir_fd) == 0;
+    if (dir_fd >= 0) { ::close(dir_fd); }
+    if (!ok) {
+        throw std::runtime_error("Error syncing log directory " + dir.string() + ": "
+                + ::strerror(errno));
     }
 }
 
 template <size_t P>
 log_storage<P>::~log_storage()
 {
+    _recycler.shutdown();
+    // Files released since the last pass of the recycler thread
+    try { delete_old_files(); }
+    catch (...) {} // deleted when the log is opened again
     ExclusiveLatchContext cs(&_file_map_latch);
 
     for (auto elem : _files) {
@@ -193,7 +459,7 @@ std::shared_ptr<log_file<PageSize>> log_storage<PageSize>::get_file_for_flush(Fi
         p = create_file(FileNumber{level,1});
         p->open_for_append();
     }
-    else if (p->get_size() + PageSize > _file_size) {
+    else if (p->get_size() + PageSize > get_file_size(level)) {
         auto n = p->num();
         p->close_for_append();
         p = create_file(n.advance());
@@ -212,6 +478,164 @@ std::shared_ptr<log_file<P>> log_storage<P>::get_file(FileNumber n) const
     return it->second;
 }
 
+template <size_t P>
+std::vector<typename log_storage<P>::FileNumber> log_storage<P>::list_files(
+        FileHighNumber level) const
+{
+    SharedLatchContext cs(&_file_map_latch);
+    std::vector<FileNumber> files;
+    for (auto& elem : _files) {
+        if (elem.first.hi() == level && !_retired.count(elem.first)) {
+            files.push_back(elem.first);
+        }
+    }
+    return files;
+}
+
+template <size_t P>
+std::vector<typename log_storage<P>::FileHighNumber> log_storage<P>::list_levels() const
+{
+    SharedLatchContext cs(&_file_map_latch);
+    std::vector<FileHighNumber> levels;
+    for (auto& elem : _files) {
+        // Map is ordered by file number, i.e., by level first
+        if (levels.empty() || levels.back() != elem.first.hi()) {
+            levels.push_back(elem.first.hi());
+        }
+    }
+    return levels;
+}
+
+template <size_t P>
+std::shared_ptr<log_file<P>> log_storage<P>::create_merge_file(FileHighNumber level)
+{
+    FileNumber fnum {level, 1};
+    {
+        ExclusiveLatchContext cs(&_file_map_latch);
+        // Number follows the last file of the level and the merge files created before
+        for (auto& elem : _files) {
+            if (elem.first.hi() == level && elem.first >= fnum) {
+                fnum = elem.first;
+                fnum.advance();
+            }
+        }
+        auto next = _merge_next.find(level);
+        if (next != _merge_next.end() && next->second > fnum) { fnum = next->second; }
+        _merge_next[level] = fnum;
+        _merge_next[level].advance();
+    }
+
+    auto p = std::make_shared<LogFile>(level_path(level), fnum, _device,
+            _volatile ? get_file_size(level) : 0, _fd_cache);
+    p->set_temporary();
+    p->set_size(0);
+    if (!_volatile) {
+        fs::remove(p->make_log_path());
+        p->open_for_append();
+    }
+    return p;
+}
+
+/*
+ * The manifest is the commit point of the merge, so it is written before the outputs are
+ * renamed: a crash before it leaves only temporary files, which are deleted when the log is
+ * opened, and a crash after it leaves outputs that the manifest lists under their permanent
+ * names, which are renamed when the log is opened (see read_manifest). The outputs and their
+ * directory entries must thus be durable before the manifest is written.
+ */
+template <size_t P>
+void log_storage<P>::commit_merge(const std::vector<std::shared_ptr<LogFile>>& outputs,
+        const std::vector<FileNumber>& inputs)
+{
+    std::set<fs::path> dirs;
+    if (!_volatile) {
+        for (auto& p : outputs) {
+            p->sync();
+            dirs.insert(level_path(p->num().hi()));
+        }
+    }
+    for (auto& dir : dirs) { sync_directory(dir); }
+    {
+        ExclusiveLatchContext cs(&_file_map_latch);
+        for (auto& p : outputs) { _files[p->num()] = p; }
+        for (auto n : inputs) { _retired.insert(n); }
+    }
+    write_manifest();
+
+    for (auto& p : outputs) { p->make_permanent(); }
+    // Directory scans (see scan_directory) delete temporary files, so renames must be durable
+    // before the merged files can be deleted
+    for (auto& dir : dirs) { sync_directory(dir); }
+}
+
+template <size_t P>
+void log_storage<P>::retire_files(const std::vector<FileNumber>& files)
+{
+    commit_merge({}, files);
+}
+
+/*
+ * Files given here were retired before, i.e., the manifest already marks them for deletion, so
+ * a crash before the recycler thread deletes them cannot leave them half-deleted.
+ */
+template <size_t P>
+void log_storage<P>::delete_files(const std::vector<FileNumber>& files)
+{
+    {
+        ExclusiveLatchContext cs(&_file_map_latch);
+        for (auto n : files) {
+            if (_files.count(n)) { _deferred.insert(n); }
+        }
+    }
+    // Deletions are due regardless of log_recycle
+    _recycler.wakeup();
+}
+
+template <size_t P>
+void log_storage<P>::recycle_files()
+{
+    if (_on_recycle) { _on_recycle(); }
+    delete_old_files();
+}
+
+/*
+ * Deletes the files given to delete_files() that no reader uses anymore. Readers hold a
+ * reference to each file they read, so a file can be deleted once the file map holds the only
+ * reference. It is then removed from the map under the latch, so that no reader can get it
+ * anymore, and from the index in the same step. Files still referenced remain marked for
+ * deletion in the manifest and are retried periodically by the recycler thread, or else when
+ * the log is opened again.
+ */
+template <size_t P>
+unsigned log_storage<P>::delete_old_files()
+{
+    std::vector<std::shared_ptr<LogFile>> victims;
+    {
+        ExclusiveLatchContext cs(&_file_map_latch);
+        for (auto it = _deferred.begin(); it != _deferred.end(); ) {
+            auto f = _files.find(*it);
+            if (f != _files.end() && f->second.use_count() > 1) {
+                it++;
+                continue;
+            }
+            if (f != _files.end()) {
+                victims.push_back(f->second);
+                _files.erase(f);
+            }
+            _retired.erase(*it);
+            it = _deferred.erase(it);
+        }
+    }
+
+    for (auto& p : victims) {
+        if (_on_delete) { _on_delete(p->num()); }
+        p->destroy();
+    }
+    if (!victims.empty()) { write_manifest(); }
+
+    return victims.size();
+}
+
 template <size_t P>
 std::shared_ptr<log_file<P>> log_storage<P>::create_file(FileNumber fnum)
 {
@@ -221,7 +645,11 @@ std::shared_ptr<log_file<P>> log_storage<P>::create_file(FileNumber fnum)
         throw std::runtime_error(what);
     }
 
-    p = std::make_shared<LogFile>(_logpath, fnum);
+    // Memory of a volatile log is only allocated if files were recycled or merged to make room
+    if (_volatile && _files.size() >= _max_files) { try_delete(); }
+
+    p = std::make_shared<LogFile>(level_path(fnum.hi()), fnum, _device,
+            _volatile ? get_file_size(fnum.hi()) : 0, _fd_cache);
     p->set_size(0);
 
     {
@@ -232,6 +660,10 @@ std::shared_ptr<log_file<P>> log_storage<P>::create_file(FileNumber fnum)
         _files[fnum] = p;
     }
 
+    if (_volatile) { return p; }
+
+    write_manifest();
+
     wakeup_recycler();
 
     // The check below does not require the mutex
@@ -250,55 +682,6 @@ void log_storage<P>::wakeup_recycler()
     _recycler.wakeup();
 }
 
-template <size_t P>
-unsigned log_storage<P>::delete_old_files()
-{
-    if (!_delete_old_files) { return 0; }
-    return 0;
-    // TODO implement!
-
-    // if (older_than == 0 && smlevel_0::chkpt) {
-    //     lsn_t min_lsn = smlevel_0::chkpt->get_min_active_lsn();
-    //     older_than = min_lsn.is_null() ? smlevel_0::log->durable_lsn().hi() : min_lsn.hi();
-    //     if (smlevel_0::logArchiver) {
-    //         lsn_t lastArchivedLSN = smlevel_0::logArchiver->getDirectory()->getLastLSN();
-    //         if (older_than > lastArchivedLSN.hi()) {
-    //             older_than = lastArchivedLSN.hi();
-    //         }
-    //     }
-    // }
-
-    // list<std::shared_ptr<LogFile>> to_be_deleted;
-
-    // {
-    //     ExclusiveLatchContext cs(&_file_map_latch);
-
-    //     partition_map_t::iterator it = _files.begin();
-    //     while (it != _files.end()) {
-    //         if (it->first < older_than) {
-    //             to_be_deleted.push_front(it->second);
-    //             it = _files.erase(it);
-    //         }
-    //         else { it++; }
-    //     }
-    // }
-
-    // // Waint until the partitions to be deleted are not referenced anymore
-    // while (to_be_deleted.size() > 0) {
-    //     auto p = to_be_deleted.front();
-    //     to_be_deleted.pop_front();
-    //     while (!p.unique()) {
-    //         std::this_thread::sleep_for(chrono::milliseconds(1));
-    //     }
-    //     // Now this partition is owned exclusively by me.  Other threads cannot
-    //     // increment reference counters because objects were removed from map,
-    //     // and the critical section above guarantees visibility.
-    //     p->destroy();
-    // }
-
-    // return to_be_deleted.size();
-}
-
 template <size_t P>
 std::shared_ptr<log_file<P>> log_storage<P>::curr_file(FileHighNumber level) const
 {
@@ -308,14 +691,22 @@ std::shared_ptr<log_file<P>> log_storage<P>::curr_file(FileHighNumber level) con
     return it->second;
 }
 
+/*
+ * Files only become deletable once the log recycles or merges them (see FileBasedLog), so the
+ * log is wedged if none is, even after waiting for their readers to drain for a while.
+ */
 template <size_t P>
 void log_storage<P>::try_delete()
 {
-    // TODO implement!
-    unsigned deleted = delete_old_files();
-    if (deleted == 0) {
-        throw std::runtime_error("Log wedged! Cannot recycle partitions");
+    for (int i = 0; i < 10; i++) {
+        if (delete_old_files() > 0) { return; }
+        {
+            SharedLatchContext cs(&_file_map_latch);
+            if (_deferred.empty()) { break; }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
+    throw std::runtime_error("Log wedged! Cannot recycle partitions");
 }
 
 } // namespace legacy
@@ -79,10 +79,13 @@ Rome Research Laboratory Contract No. F30602-97-2-0247.
 #define FINELINE_LEGACY_LOG_STORAGE_H
 
 #include <map>
+#include <set>
 #include <vector>
 #include <memory>
 #include <mutex>
 #include <condition_variable>
+#include <functional>
+#include <limits>
 
 #include "options.h"
 #include "log_file.h"
@@ -112,10 +115,62 @@ public:
     std::shared_ptr<LogFile> get_file_for_flush(FileHighNumber);
     std::shared_ptr<LogFile> curr_file(FileHighNumber) const;
     std::shared_ptr<LogFile> get_file(FileNumber n) const;
-    size_t get_file_size() const { return _file_size; }
-
-protected:
+    /// Numbers of the files in the given level, from oldest to newest
+    std::vector<FileNumber> list_files(FileHighNumber level) const;
+    /// Levels that contain files, in increasing order
+    std::vector<FileHighNumber> list_levels() const;
+    /// Maximum size of the files of the given level (see log_level_file_sizes)
+    size_t get_file_size(FileHighNumber level = 0) const;
+    /// Directory of the files of the given level (see log_level_paths)
+    fs::path level_path(FileHighNumber level) const;
+    bool is_volatile() const { return _volatile; }
+
+    /*
+     * Function called whenever a log file is deleted, e.g., to remove it from the log index.
+     * Files still marked for deletion when the log was opened are deleted once it is set.
+     */
+    void set_deletion_callback(std::function<void(FileNumber)> f)
+    {
+        _on_delete = f;
+        delete_old_files();
+    }
+
+    /*
+     * Function called by the recycler thread before it deletes files, e.g., to recycle the
+     * files that are no longer needed. The thread runs whenever a file is created or
+     * wakeup_recycler() is called, and periodically while deletions are pending.
+     */
+    void set_recycle_callback(std::function<void()> f) { _on_recycle = f; }
+    /// Wakes up the recycler thread, unless log_recycle is off
     void wakeup_recycler();
+    /// Stops the recycler thread; files released afterwards are deleted by the destructor
+    void stop_recycler() { _recycler.shutdown(); }
+
+    /*
+     * Merges write their output into temporary files of the given level, which are not listed
+     * until commit_merge() makes them permanent. The merged files are retired by the commit:
+     * they are no longer listed and the manifest marks them for deletion, but they remain
+     * readable until delete_files() is called, e.g., once no reader uses them anymore. Files
+     * still marked for deletion when the log is opened are deleted then.
+     *
+     * Files are retired without a merge when the log recycles them, i.e., once their records
+     * are no longer needed. delete_files() only hands files over to the recycler thread, which
+     * deletes them once no reader holds them anymore (see delete_old_files), so that readers
+     * releasing the last reference to a file never unlink it or rewrite the manifest.
+     */
+    std::shared_ptr<LogFile> create_merge_file(FileHighNumber level);
+    void commit_merge(const std::vector<std::shared_ptr<LogFile>>& outputs,
+            const std::vector<FileNumber>& inputs);
+    void retire_files(const std::vector<FileNumber>& files);
+    void delete_files(const std::vector<FileNumber>& files);
+protected:
+    void scan_directory(bool reformat, bool drop_index);
+    void scan_directory(const fs::path& dir, bool reformat, bool drop_index);
+    bool read_manifest();
+    void write_manifest();
+    void sync_directory(const fs::path& dir);
+    static std::vector<string> split_list(const string& list);
+    void recycle_files();
     unsigned delete_old_files();
     void try_delete();
     std::shared_ptr<LogFile> create_file(FileNumber pnum);
@@ -123,16 +178,56 @@ protected:
 private:
     fs::path _logpath;
     size_t _file_size;
+    // Directories and file sizes of merged levels 1, 2, ...; the last applies to deeper levels
+    std::vector<fs::path> _level_paths;
+    std::vector<size_t> _level_file_sizes;
     unsigned _max_files;
     bool _delete_old_files;
     string _index_file_name;
+    // Null unless an emulated log device is selected
+    std::shared_ptr<LogDeviceEmulator> _device;
+    // Read descriptors of all log files
+    std::shared_ptr<log_fd_cache> _fd_cache;
+    bool _volatile;
+    std::function<void(FileNumber)> _on_delete;
+    std::function<void()> _on_recycle;
 
     FileMap _files;
     CurrentFileMap _current;
+    // Files retired by a merge or recycled and not deleted yet
+    std::set<FileNumber> _retired;
+    // Retired files given to delete_files() but still held by readers
+    std::set<FileNumber> _deferred;
+    // Lowest number available for the next merge file of each level
+    std::map<FileHighNumber, FileNumber> _merge_next;
     file_recycler_t<log_storage<PageSize>> _recycler;
 
     // Latch to protect access to partition map
     mutable foster::MutexLatch _file_map_latch;
+    // Serializes manifest rewrites
+    std::mutex _manifest_mutex;
+
+    /*
+     * The manifest consists of a ManifestHeader followed by one ManifestEntry per file, and
+     * the checksum covers everything after it. Files still open for appends have no sealed
+     * size, since they may end with a torn block, and retired files are marked for deletion.
+     */
+    struct ManifestHeader
+    {
+        uint32_t magic;
+        uint32_t checksum;
+        uint64_t count;
+    };
+
+    struct ManifestEntry
+    {
+        uint64_t file;
+        uint64_t size;
+    };
+
+    static constexpr uint32_t ManifestMagic = 0x464e4d46; // "FMNF"
+    static constexpr uint64_t UnsealedSize = std::numeric_limits<uint64_t>::max();
+    static constexpr uint64_t RetiredSize = std::numeric_limits<uint64_t>::max() - 1;
 
     // forbid copy
     log_storage<PageSize>(const log_storage<PageSize>&);
@@ -140,7 +235,9 @@ private:
 
 public:
     static constexpr auto log_prefix = "log.";
+    static constexpr auto merge_prefix = "merge.";
     static constexpr auto log_regex = "log\\.[0-9][0-9]*\\.[1-9][0-9]*";
+    static constexpr auto manifest_name = "manifest";
 };
 
 } // namespace legacy
@@ -0,0 +1,157 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FINELINE_LOG_DEVICE_H
+#define FINELINE_LOG_DEVICE_H
+
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <random>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+
+#include "options.h"
+
+namespace fineline {
+
+/**
+ * \brief Emulates the latency and bandwidth of a log device.
+ *
+ * Used to study group commit under devices with different characteristics, e.g., fast NVMe,
+ * SATA SSDs or network-attached disks, independently of the device on which log files actually
+ * reside. Log files call write() after writing a block and sync() after flushing it, and these
+ * calls block the caller until the emulated device would have completed the operation.
+ *
+ * The device is modelled as a single queue: a write of N bytes occupies the device for
+ * N / bandwidth, and waits for previous writes to finish first. On top of that, each write and
+ * each sync adds a fixed latency, which may be perturbed by a uniformly distributed jitter.
+ * Short waits are implemented by spinning, because sleeping is too coarse for microsecond-scale
+ * latencies.
+ *
+ * The device is selected with the log_device option: "native" disables emulation, "nvme",
+ * "sata", and "netdisk" are presets, and "emulated" takes the latencies and bandwidth from the
+ * log_device_* options. In emulated devices, the actual fsync on log files is skipped unless
+ * log_device_fsync is set, so that the emulated sync latency is the only one observed.
+ */
+class LogDeviceEmulator
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    LogDeviceEmulator(unsigned write_latency_us, unsigned sync_latency_us,
+            unsigned bandwidth_mbps, unsigned jitter_pct, bool real_sync)
+        : write_latency_(std::chrono::microseconds{write_latency_us}),
+        sync_latency_(std::chrono::microseconds{sync_latency_us}),
+        bytes_per_us_(bandwidth_mbps * 1024.0 * 1024.0 / 1e6),
+        jitter_(std::min(jitter_pct, 100u) / 100.0),
+        real_sync_(real_sync),
+        busy_until_(Clock::now())
+    {}
+
+    /// Returns the emulator selected in the given options, or nullptr for the native device
+    static std::shared_ptr<LogDeviceEmulator> create(const Options& options)
+    {
+        auto device = options.get<std::string>("log_device");
+        bool real_sync = options.get<bool>("log_device_fsync");
+        unsigned jitter = options.get<unsigned>("log_device_jitter");
+
+        // Presets: write latency (us), sync latency (us), bandwidth (MB/s)
+        unsigned write_latency, sync_latency, bandwidth;
+        if (device == "native") { return nullptr; }
+        else if (device == "nvme") { write_latency = 0; sync_latency = 20; bandwidth = 2000; }
+        else if (device == "sata") { write_latency = 0; sync_latency = 200; bandwidth = 500; }
+        else if (device == "netdisk") { write_latency = 0; sync_latency = 5000; bandwidth = 200; }
+        else if (device == "emulated") {
+            write_latency = options.get<unsigned>("log_device_write_latency");
+            sync_latency = options.get<unsigned>("log_device_sync_latency");
+            bandwidth = options.get<unsigned>("log_device_bandwidth");
+        }
+        else { throw std::runtime_error("Unknown log device: " + device); }
+
+        auto emu = new LogDeviceEmulator {write_latency, sync_latency, bandwidth, jitter, real_sync};
+        return std::shared_ptr<LogDeviceEmulator>{emu};
+    }
+
+    /// Blocks the caller until the emulated device completes a write of the given size
+    void write(size_t bytes)
+    {
+        Clock::time_point done;
+        {
+            std::unique_lock<std::mutex> lck {mutex_};
+            auto transfer = bytes_per_us_ > 0
+                ? std::chrono::microseconds{static_cast<long>(bytes / bytes_per_us_)}
+                : std::chrono::microseconds{0};
+            busy_until_ = std::max(busy_until_, Clock::now()) + transfer;
+            done = busy_until_ + perturb(write_latency_);
+        }
+        wait_until(done);
+    }
+
+    /// Blocks the caller until the emulated device completes a sync
+    void sync()
+    {
+        Clock::time_point done;
+        {
+            std::unique_lock<std::mutex> lck {mutex_};
+            done = std::max(busy_until_, Clock::now()) + perturb(sync_latency_);
+        }
+        wait_until(done);
+    }
+
+    /// Whether log files should still issue an fsync to the underlying device
+    bool real_sync() const { return real_sync_; }
+
+private:
+    // Must be called with the mutex held
+    Clock::duration perturb(Clock::duration latency)
+    {
+        if (jitter_ == 0.0 || latency == Clock::duration::zero()) { return latency; }
+        std::uniform_real_distribution<double> distr {1.0 - jitter_, 1.0 + jitter_};
+        return std::chrono::duration_cast<Clock::duration>(latency * distr(gen_));
+    }
+
+    static void wait_until(Clock::time_point t)
+    {
+        // Spin below this threshold; sleep above it, then spin for the remainder
+        const auto spin_threshold = std::chrono::microseconds{100};
+        if (t - Clock::now() > spin_threshold) {
+            std::this_thread::sleep_until(t - spin_threshold);
+        }
+        while (Clock::now() < t) {}
+    }
+
+    const Clock::duration write_latency_;
+    const Clock::duration sync_latency_;
+    const double bytes_per_us_;
+    const double jitter_;
+    const bool real_sync_;
+
+    std::mutex mutex_;
+    Clock::time_point busy_until_;
+    std::mt19937 gen_;
+};
+
+} // namespace fineline
+
+#endif
@@ -23,9 +23,25 @@
 #define FINELINE_LOG_FS_H
 
 #include <memory>
+#include <stdexcept>
+#include <vector>
+#include <deque>
+#include <map>
+#include <future>
+#include <functional>
+#include <mutex>
+#include <algorithm>
+#include <limits>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
 #include "assertions.h"
 #include "options.h"
+#include "logblock.h"
+#include "logcodec.h"
+#include "bloom_filter.h"
+#include "log_merge.h"
+#include "log_index_memory.h"
 
 namespace fineline {
 
@@ -41,17 +57,67 @@ class FileBasedLog
 public:
     static constexpr unsigned FirstLevelFile = 0;
     static constexpr size_t PageSize = sizeof(LogPage);
+    // Each page is stored in a block of at most BlockSize bytes, prefixed by a checksummed header
+    static constexpr size_t BlockSize = sizeof(LogBlockHeader) + PageSize;
 
     using LogKey = typename LogPage::Key;
     using ThisType = FileBasedLog<LogPage, LogIndex, LogFileSystem>;
+    using FileNumber = typename LogFileSystem<BlockSize>::FileNumber;
+    using LogFile = typename LogFileSystem<BlockSize>::LogFile;
+    using KeyRange = MemoryLogIndex::KeyRange;
 
     FileBasedLog(const Options& options)
+        : merge_limiter_(options.get<unsigned>("log_merge_bandwidth")), merge_cancel_(false)
     {
         // FS should be initialized first, because index path may be relative to it
-        fs_.reset(new LogFileSystem<PageSize>{options});
+        fs_.reset(new LogFileSystem<BlockSize>{options});
         index_.reset(new LogIndex{options});
+        // Files may be deleted by the FS itself (e.g., those retired before the log was opened)
+        fs_->set_deletion_callback([this] (FileNumber n) {
+            index_->delete_file(n.data());
+            std::unique_lock<std::mutex> lck {run_headers_mutex_};
+            run_headers_.erase(n);
+        });
+        verify_checksums_ = options.get<bool>("log_verify_checksums");
+        mmap_reads_ = options.get<bool>("log_read_mmap");
+        if (options.get<bool>("log_bloom_filters")) { filter_.reset(new BloomFilter); }
+        rebuild_threads_ = std::max(1u, options.get<unsigned>("log_index_rebuild_threads"));
+        codec_ = parse_block_codec(options.get<std::string>("log_compression"));
+        fence_interval_ = options.get<unsigned>("log_fence_interval");
+        encoder_.reset(new BlockEncoder{codec_, fence_interval_});
+        merge_fan_in_ = std::max(2u, options.get<unsigned>("log_merge_fan_in"));
+        merge_partitions_ = std::max(1u, options.get<unsigned>("log_merge_partitions"));
+        recover_index();
+        // Recycler thread may run as soon as files are created
+        if (options.get<bool>("log_recycle")) {
+            fs_->set_recycle_callback([this] { recycle_images(); });
+        }
+
+        flush_file_ = 0;
+        if (options.get<std::string>("log_merge_strategy") != "none") {
+            scheduler_.reset(new LogMergeScheduler<ThisType>{this, options});
+            // Files recovered may already call for merges
+            scheduler_->wakeup();
+        }
+    }
+
+    ~FileBasedLog()
+    {
+        // Running merge is abandoned, and its files deleted
+        merge_cancel_ = true;
+        scheduler_.reset();
+        /*
+         * Recycler thread stops before the versions are released, since it recycles the current
+         * one. The files released are then deleted by the file system while the index is alive.
+         */
+        fs_->stop_recycler();
+        std::atomic_store(&version_, std::shared_ptr<LogVersion>{});
+        fs_.reset();
     }
 
+    /// Epoch of the last block in the log, or zero if the log is empty
+    uint64_t last_epoch() const { return last_epoch_; }
+
     template <class EpochNumber>
     void append_page(const LogPage& page, EpochNumber epoch)
     {
@@ -72,20 +138,89 @@ public:
         //     std::cout << hdr << std::endl;
         // }
 
+        LogBlockHeader block_hdr;
+        block_hdr.epoch = epoch;
         auto file = fs_->get_file_for_flush(FirstLevelFile);
-        size_t offset = file->append(&page);
-        index_->insert_block(file->num().data(), offset, epoch, min_key.node_id(), max_key.node_id());
+        // Previous file was sealed, which may call for a merge
+        if (file->num().data() != flush_file_) {
+            flush_file_ = file->num().data();
+            if (scheduler_) { scheduler_->wakeup(); }
+        }
+        size_t offset = write_block(*file, page, block_hdr, *encoder_);
+        index_->insert_block(file->num().data(), offset, epoch, min_key.node_id(), max_key.node_id(),
+                build_filter(page));
+        last_epoch_ = epoch;
     }
 
     using LogPageIterator = typename LogPage::Iterator;
     using FetchBlockIterator = typename LogIndex::FetchBlockIterator;
 
+    /*
+     * Files that iterators may read, as of some merge. A merge installs a new version in which
+     * the files it merged are replaced by its output, which no iterator sees before, and the
+     * merged files are deleted when the previous version is released, i.e., once the iterators
+     * created before the merge are destroyed. Each version references the next one, so that
+     * versions are released, and their files deleted, in the order in which they were installed.
+     * The last iterator may release a version on any thread, so the files are handed over to
+     * the recycler thread of the file system, which deletes them.
+     */
+    struct LogVersion
+    {
+        // Range of visible file numbers of each level; level 0 has no upper bound
+        std::vector<uint32_t> first;
+        std::vector<uint32_t> last;
+        // Files merged into the next version
+        std::vector<FileNumber> retired;
+        ThisType* log = nullptr;
+        std::shared_ptr<LogVersion> next;
+
+        ~LogVersion()
+        {
+            if (retired.empty()) { return; }
+            try { log->fs_->delete_files(retired); }
+            catch (...) {}
+        }
+
+        bool contains(uint32_t file) const
+        {
+            auto level = FileNumber{file}.hi();
+            if (level >= first.size() || file < first[level]) { return false; }
+            return level == FirstLevelFile || file <= last[level];
+        }
+
+        /// Levels with visible files, from the oldest (i.e., deepest) to level 0
+        std::vector<unsigned> levels() const
+        {
+            std::vector<unsigned> result;
+            for (size_t level = last.size() - 1; level > FirstLevelFile; level--) {
+                if (last[level] > 0 && last[level] >= first[level]) { result.push_back(level); }
+            }
+            result.push_back(FirstLevelFile);
+            return result;
+        }
+    };
+
+    /*
+     * Iterators read the blocks given by the index in index order. Fetches of a single key in a
+     * log with several levels instead read each level with its own iterator, and merge the
+     * records of all levels by key with a heap (see LogRecordMerger), so that they come in
+     * sequence number order regardless of how the levels are ordered in the index. Records
+     * with equal keys come from the oldest level first, or last if going backward.
+     *
+     * Iterators may stop early, i.e., after the first record that satisfies a given predicate
+     * (see fetch), without reading any further blocks. The iterators of each level only read
+     * their first block on the first call to next(), which then reads the first block of every
+     * level, since the merge needs the first record of each level to pick the next one.
+     */
     class LogFileIterator
     {
     public:
+        using StopPredicate = std::function<bool(const LogKey&, const char*)>;
+
         template <class Filter>
         LogFileIterator(ThisType* log, Filter filter, bool forward = true)
-            : log_(log), filter_(filter), forward_(forward),
+            : log_(log), filter_(filter), forward_(forward), scan_(true), key_(0),
+            version_(log->current_version()),
             block_index_iter_ {std::move(log->index_->fetch_blocks(forward))}
         {
             next_block();
@@ -93,14 +228,64 @@ public:
 
         template <class Filter>
         LogFileIterator(ThisType* log, Filter filter, uint64_t key, bool forward = true)
-            : log_(log), /*queried_key_(key),*/ filter_(filter), forward_(forward),
-            block_index_iter_ {std::move(log->index_->fetch_blocks(key, forward))}
+            : log_(log), filter_(filter), forward_(forward), scan_(false), key_(key),
+            version_(log->current_version())
+        {
+            auto levels = version_->levels();
+            if (levels.size() == 1) {
+                block_index_iter_ = std::move(log->index_->fetch_blocks(key, forward));
+                next_block();
+                return;
+            }
+
+            // Levels are added from the oldest, which goes first on ties
+            merger_.reset(new LogRecordMerger<LogKey, LogFileIterator>{forward});
+            for (auto level : levels) {
+                merger_->add(std::unique_ptr<LogFileIterator>{
+                        new LogFileIterator{log, filter_, key, forward, version_, level}});
+            }
+        }
+
+        /// Reads the blocks of the given level only, starting on the first call to next()
+        LogFileIterator(ThisType* log, std::function<bool(const LogKey&)> filter, uint64_t key,
+                bool forward, std::shared_ptr<const LogVersion> version, unsigned level)
+            : log_(log), filter_(filter), forward_(forward), scan_(false), key_(key),
+            version_(std::move(version)), started_(false),
+            block_index_iter_ {std::move(log->index_->fetch_blocks(key, forward, level))}
+        {
+        }
+
+        /*
+         * Reads the given blocks whole, in the order of the index iterator. The version must be
+         * taken before the index iterator is created (see current_version).
+         */
+        template <class Filter>
+        LogFileIterator(ThisType* log, Filter filter, std::shared_ptr<const LogVersion> version,
+                std::unique_ptr<FetchBlockIterator>&& blocks, bool forward = true)
+            : log_(log), filter_(filter), forward_(forward), scan_(true), key_(0),
+            version_(std::move(version)), block_index_iter_ {std::move(blocks)}
         {
             next_block();
         }
 
+        /// Iteration ends after the first record for which the given predicate holds
+        void stop_after(StopPredicate pred) { stop_ = pred; }
+
         bool next(LogKey& key, const char*& payload)
         {
+            if (stopped_) { return false; }
+            bool found = merger_ ? merger_->next(key, payload) : next_record(key, payload);
+            if (found && stop_ && stop_(key, payload)) { stopped_ = true; }
+            return found;
+        }
+
+    protected:
+        bool next_record(LogKey& key, const char*& payload)
+        {
+            if (!started_) {
+                started_ = true;
+                next_block();
+            }
             bool has_more = true;
             while (has_more) {
                 if (!page_iter_.get()) { return false; }
@@ -117,52 +302,1155 @@ public:
             return has_more;
         }
 
-    protected:
         bool next_block()
         {
             uint32_t file;
             uint32_t block;
-            bool has_more = block_index_iter_->next(file, block);
-            if (!has_more) { return false; }
+            decltype(log_->fs_->get_file(file)) f;
+            // Skip blocks of files deleted after the index iterator was created and of files that
+            // are not part of this iterator's version, i.e., merged or not yet committed
+            while (!f) {
+                bool has_more = block_index_iter_->next(file, block);
+                if (!has_more) { return false; }
+                if (!version_->contains(file)) { continue; }
+                f = log_->fs_->get_file(file);
+            }
+
+            // Block header tells how much to read and whether the page must be decoded
+            if (log_->mmap_reads_) {
+                // Mapping extends past the end of the file, where reads fault
+                size_t size = f->get_size();
+                if (block + sizeof(LogBlockHeader) > size) { throw_corrupt(file, block); }
+                mapping_ = f->map_for_read(block + BlockSize);
+                ::memcpy(&block_hdr_, mapping_.get() + block, sizeof(LogBlockHeader));
+                check_header(file, block, size);
+            }
+            else {
+                f->read(block, &block_hdr_, sizeof(LogBlockHeader));
+                check_header(file, block);
+            }
+            size_t body_offset = block + sizeof(LogBlockHeader);
 
-            auto f = log_->fs_->get_file(file);
-            // TODO: eventually we'll get "too many fles open"
-            // Some kind of ref-counted handler should be used for log files
-            f->open_for_read();
-            f->read(block, &page_);
-            page_iter_ = std::move(page_.iterate(forward_));
+            // Fetches only read the segments of fenced blocks that hold the queried key
+            if (block_hdr_.codec == BlockCodec::Fenced && !scan_) {
+                if (!read_segments(*f, body_offset)) { throw_corrupt(file, block); }
+                page_iter_ = std::move(get_page_buffer()->iterate(forward_));
+                return true;
+            }
+
+            char* dest = block_hdr_.codec == BlockCodec::None
+                ? reinterpret_cast<char*>(get_page_buffer()) : get_compressed_buffer();
+            const char* body = read_bytes(*f, body_offset, block_hdr_.length, dest);
+
+            if (log_->verify_checksums_ && !block_hdr_.is_valid(body, PageSize)) {
+                throw_corrupt(file, block);
+            }
+
+            const LogPage* page = get_page_buffer();
+            bool valid = true;
+            switch (block_hdr_.codec) {
+                case BlockCodec::None:
+                    // Page is used in place, i.e., in the read buffer or in the file mapping
+                    page = reinterpret_cast<const LogPage*>(body);
+                    break;
+                case BlockCodec::LZ:
+                    if (!decoder_) { decoder_.reset(new LogPageCodec<LogPage>); }
+                    valid = decoder_->decode(body, block_hdr_.length, *get_page_buffer());
+                    break;
+                case BlockCodec::Fenced:
+                    valid = get_fence_codec()->decode(body, block_hdr_.length, *get_page_buffer());
+                    break;
+                default:
+                    valid = false;
+            }
+            if (!valid) { throw_corrupt(file, block); }
+            page_iter_ = std::move(page->iterate(forward_));
 
             return true;
         }
 
+        /*
+         * Returns the given byte range of the file, which is either read into dest or, with
+         * mapped reads, accessed in place.
+         */
+        template <class File>
+        const char* read_bytes(File& f, size_t offset, size_t length, char* dest)
+        {
+            if (log_->mmap_reads_) {
+                const char* addr = mapping_.get() + offset;
+                advise(addr, length);
+                return addr;
+            }
+            f.read(offset, dest, length);
+            return dest;
+        }
+
+        /*
+         * Reads the fence directory of the current block, and then the segments that may
+         * contain records of the queried key, which are decoded into the page buffer. The
+         * directory and the segments are both kept in the compressed buffer, which fits the
+         * whole block body.
+         */
+        template <class File>
+        bool read_segments(File& f, size_t body_offset)
+        {
+            using Codec = FencedPageCodec<LogPage>;
+
+            FenceDirectory dir;
+            char* buffer = get_compressed_buffer();
+            if (block_hdr_.length < sizeof(FenceDirectory)) { return false; }
+            ::memcpy(&dir, read_bytes(f, body_offset, sizeof(FenceDirectory), buffer),
+                    sizeof(FenceDirectory));
+
+            size_t dir_length = Codec::directory_length(dir);
+            if (dir_length > block_hdr_.length) { return false; }
+            size_t entries_length = dir_length - sizeof(FenceDirectory);
+            const char* entries = read_bytes(f, body_offset + sizeof(FenceDirectory),
+                    entries_length, buffer);
+            if (!Codec::check_directory(dir, entries, block_hdr_.length)) { return false; }
+
+            size_t first, last, begin, end;
+            Codec::find_segments(dir, entries, key_, first, last);
+            Codec::segment_range(dir, entries, first, last, begin, end);
+            if (end > dir.records_length) { return false; }
+            const char* records = read_bytes(f, body_offset + dir_length + begin, end - begin,
+                    buffer + entries_length);
+
+            get_page_buffer()->clear();
+            return get_fence_codec()->decode_segments(dir, entries, first, last, records,
+                    *get_page_buffer());
+        }
+
+        void check_header(uint32_t file, uint32_t block, size_t file_size = 0)
+        {
+            bool valid = block_hdr_.magic == LogBlockHeader::Magic
+                && block_hdr_.length <= PageSize;
+            // Mapped reads must not go past the end of the file
+            if (file_size > 0 && block + sizeof(LogBlockHeader) + block_hdr_.length > file_size) {
+                valid = false;
+            }
+            if (!valid) { throw_corrupt(file, block); }
+        }
+
+        /*
+         * Scans read all blocks in file order, so aggressive readahead pays off. Fetches read
+         * blocks scattered across files, so the mapping is left in random mode (see
+         * log_file::map_for_read) and only the block itself is read ahead.
+         */
+        void advise(const char* addr, size_t length)
+        {
+            constexpr uintptr_t os_page = 4096;
+            uintptr_t begin = reinterpret_cast<uintptr_t>(addr) / os_page * os_page;
+            uintptr_t end = reinterpret_cast<uintptr_t>(addr) + length;
+            void* p = reinterpret_cast<void*>(begin);
+            if (scan_) { ::madvise(p, end - begin, MADV_SEQUENTIAL); }
+            ::madvise(p, end - begin, MADV_WILLNEED);
+        }
+
+        FencedPageCodec<LogPage>* get_fence_codec()
+        {
+            if (!fence_codec_) { fence_codec_.reset(new FencedPageCodec<LogPage>{0}); }
+            return fence_codec_.get();
+        }
+
+        LogPage* get_page_buffer()
+        {
+            if (!page_) { page_.reset(new LogPage); }
+            return page_.get();
+        }
+
+        char* get_compressed_buffer()
+        {
+            if (!compressed_) { compressed_.reset(new char[PageSize]); }
+            return compressed_.get();
+        }
+
     private:
-        LogPage page_;
+        LogBlockHeader block_hdr_;
         ThisType* log_;
-        // uint64_t queried_key_;
         std::function<bool(const LogKey&)> filter_;
         bool forward_;
+        // Whether all blocks are read, rather than those of a single key
+        bool scan_;
+        uint64_t key_;
+        // Keeps the files this iterator may read from being deleted by merges
+        std::shared_ptr<const LogVersion> version_;
+        // Whether the first block was read; the iterators of each level wait for next()
+        bool started_ = true;
+        // Iterators of each level, if records of several levels are merged
+        std::unique_ptr<LogRecordMerger<LogKey, LogFileIterator>> merger_;
+        StopPredicate stop_;
+        bool stopped_ = false;
         std::unique_ptr<LogPageIterator> page_iter_;
         std::unique_ptr<FetchBlockIterator> block_index_iter_;
+        // Buffers for pages that cannot be used in place; allocated on demand
+        std::unique_ptr<LogPage> page_;
+        std::unique_ptr<char[]> compressed_;
+        std::unique_ptr<LogPageCodec<LogPage>> decoder_;
+        std::unique_ptr<FencedPageCodec<LogPage>> fence_codec_;
+        // Keeps mapped file region referenced by page_iter_ alive
+        std::shared_ptr<const char> mapping_;
     };
 
+    /**
+     * Merges the oldest sealed files of the given level, i.e., all of them but the one still
+     * appended to, into new files of the next level, which hold the records of the merged files
+     * sorted by node ID and sequence number. The records of each node then take up a few
+     * contiguous blocks instead of being scattered across the blocks of the log. At most
+     * max_files files are merged, unless it is zero. Returns the number of files merged.
+     *
+     * Each block of level 0 is a sorted run, as is each file of the other levels. Runs are
+     * merged at most log_merge_fan_in at a time, so that more of them are merged in several
+     * passes, which write intermediate runs to temporary files. The output of the last pass is
+     * indexed and then committed to the manifest, after which new iterators read it instead of
+     * the merged files. Those are deleted once the iterators created before the merge are gone.
+     *
+     * With next_level set, the files of the next level are merged as well, and replaced by the
+     * output, so that the next level remains a single sorted run (see LogMergeScheduler).
+     *
+     * The output is split into log_merge_partitions ranges of node IDs, each of about the same
+     * size and written to its own files, so that fetches of a range only read the files of the
+     * range (see fetch_range). Ranges end where the output reaches each share of the size of
+     * the inputs, at the next change of node ID, so that each node is in a single range. The
+     * first block of each range is flagged as such, which key_partitions() reports.
+     *
+     * Merges run concurrently with appends and iterators, but not with each other. They read
+     * and write at most log_merge_bandwidth MB/s.
+     */
+    size_t merge_level(unsigned level, size_t max_files = 0, bool next_level = false)
+    {
+        std::unique_lock<std::mutex> lck {merge_mutex_};
+
+        auto inputs = fs_->list_files(level);
+        auto current = fs_->curr_file(level);
+        if (current && !inputs.empty() && inputs.back() == current->num()) { inputs.pop_back(); }
+        if (max_files > 0 && inputs.size() > max_files) { inputs.resize(max_files); }
+        if (inputs.empty()) { return 0; }
+
+        // Output blocks take the epoch of the last input block, and files of the next level
+        // hold older records than those of this level, so their runs go first
+        std::vector<Run> runs;
+        uint64_t epoch = 0;
+        std::vector<FileNumber> next_inputs;
+        if (next_level) { next_inputs = fs_->list_files(level + 1); }
+        for (auto n : next_inputs) { add_runs(n, level + 1, runs, epoch); }
+        for (auto n : inputs) { add_runs(n, level, runs, epoch); }
+        size_t input_bytes = 0;
+        for (auto& run : runs) {
+            for (auto& segment : run) { input_bytes += segment.end - segment.begin; }
+        }
+
+        std::vector<std::shared_ptr<LogFile>> temporary;
+        std::vector<std::shared_ptr<LogFile>> outputs;
+        std::vector<LogBlockHeader> headers;
+        size_t destroyed = 0;
+        auto destroy_temporary = [&temporary, &destroyed] (size_t end) {
+            for (; destroyed < end; destroyed++) { temporary[destroyed]->destroy(); }
+        };
+        try {
+            // Intermediate runs are neither compressed nor indexed
+            BlockEncoder plain {BlockCodec::None, 0};
+            while (runs.size() > merge_fan_in_) {
+                size_t pass_inputs = temporary.size();
+                std::vector<Run> merged;
+                for (size_t i = 0; i < runs.size(); i += merge_fan_in_) {
+                    RunWriter writer {this, level + 1, epoch, plain, false, temporary};
+                    merge_runs(runs, i, std::min(i + merge_fan_in_, runs.size()), writer);
+                    merged.push_back(writer.finish());
+                }
+                runs = std::move(merged);
+                destroy_temporary(pass_inputs);
+            }
+
+            BlockEncoder encoder {codec_, fence_interval_};
+            RunWriter writer {this, level + 1, epoch, encoder, true, outputs};
+            writer.split(input_bytes, merge_partitions_);
+            merge_runs(runs, 0, runs.size(), writer);
+            writer.finish();
+            headers = writer.first_headers();
+            runs.clear();
+            destroy_temporary(temporary.size());
+
+            auto retired = next_inputs;
+            retired.insert(retired.end(), inputs.begin(), inputs.end());
+            fs_->commit_merge(outputs, retired);
+        }
+        catch (...) {
+            destroy_temporary(temporary.size());
+            for (auto& f : outputs) {
+                index_->delete_file(f->num().data());
+                f->destroy();
+            }
+            throw;
+        }
+
+        {
+            std::unique_lock<std::mutex> lck {run_headers_mutex_};
+            for (size_t i = 0; i < outputs.size(); i++) {
+                run_headers_[outputs[i]->num()] = headers[i];
+            }
+        }
+        install_version(level, inputs, next_inputs, outputs);
+        return inputs.size();
+    }
+
+    /**
+     * Recycles the log files whose records all precede the given horizon, which must not be
+     * later than the newest image (see NodeImage) of any node, i.e., it is the oldest of the
+     * epochs of the newest images of all nodes. Recovery replays each node from its newest image
+     * on, so it needs no record before the horizon. After a checkpoint that logged images of all
+     * nodes, the horizon is the epoch in which the checkpoint began, since the files that hold
+     * the images themselves must be kept. Level-0 files are covered by the next level once
+     * merged, so recycling is what bounds the size of the deepest levels. Only the oldest files
+     * of each level are recycled, and never the one still appended to.
+     *
+     * Recycled files are retired like merged ones: new iterators no longer read them, and they
+     * are deleted once the iterators created before are gone. Returns the number of files
+     * recycled. With log_recycle, the recycler thread calls this in the background with the
+     * horizon given to set_image_epoch.
+     */
+    size_t recycle(uint64_t horizon)
+    {
+        std::unique_lock<std::mutex> lck {merge_mutex_};
+
+        // Log is being closed
+        auto old = std::atomic_load(&version_);
+        if (!old) { return 0; }
+        auto version = std::make_shared<LogVersion>();
+        version->first = old->first;
+        version->last = old->last;
+
+        std::vector<FileNumber> recycled;
+        for (auto level : fs_->list_levels()) {
+            auto files = fs_->list_files(level);
+            auto current = fs_->curr_file(level);
+            if (current && !files.empty() && files.back() == current->num()) { files.pop_back(); }
+            size_t count = 0;
+            while (count < files.size() && last_file_epoch(files[count], level) < horizon) {
+                recycled.push_back(files[count++]);
+            }
+            if (count == 0) { continue; }
+            if (version->first.size() <= level) {
+                version->first.resize(level + 1, 0);
+                version->last.resize(level + 1, 0);
+            }
+            version->first[level] = files[count - 1].data() + 1;
+        }
+        if (recycled.empty()) { return 0; }
+
+        // Manifest is the commit point, after which the files are deleted on recovery
+        fs_->retire_files(recycled);
+        old->retired = recycled;
+        old->log = this;
+        old->next = version;
+        std::atomic_store(&version_, version);
+        return recycled.size();
+    }
+
+    /**
+     * Sets the recycle horizon to the oldest of the epochs of the newest images of all nodes,
+     * e.g., to the epoch in which a checkpoint that logged images of all nodes began, so that
+     * the files whose records all precede it are recycled in the background (see recycle). The
+     * epoch in which the checkpoint completed is too late, since the files that hold the images
+     * logged before it would be recycled as well. Has no effect unless log_recycle is set.
+     */
+    void set_image_epoch(uint64_t oldest_image_epoch)
+    {
+        uint64_t old = image_epoch_;
+        while (old < oldest_image_epoch
+                && !image_epoch_.compare_exchange_weak(old, oldest_image_epoch)) {}
+        fs_->wakeup_recycler();
+    }
+
+    /// Contents of each level, which the merge scheduler uses to pick levels to merge
+    std::vector<LogLevelInfo> get_levels()
+    {
+        auto levels = fs_->list_levels();
+        if (levels.empty() || levels.front() != FirstLevelFile) {
+            levels.insert(levels.begin(), FirstLevelFile);
+        }
+
+        std::vector<LogLevelInfo> result;
+        for (auto level : levels) {
+            auto files = fs_->list_files(level);
+            auto current = fs_->curr_file(level);
+            if (current && !files.empty() && files.back() == current->num()) { files.pop_back(); }
+
+            LogLevelInfo info {level, files.size(), 0, 0};
+            std::vector<uint64_t> epochs;
+            for (auto n : files) {
+                auto f = fs_->get_file(n);
+                if (!f) { continue; }
+                size_t size = f->get_size();
+                info.bytes += size;
+                if (level != FirstLevelFile && size > 0) {
+                    // Blocks of a merged run all have the epoch of the run
+                    epochs.push_back(run_header(n, *f).epoch);
+                }
+            }
+            std::sort(epochs.begin(), epochs.end());
+            info.runs = level == FirstLevelFile ? files.size()
+                : std::unique(epochs.begin(), epochs.end()) - epochs.begin();
+            result.push_back(info);
+        }
+        return result;
+    }
+
+    /**
+     * Installs a reducer that drops redundant records from the output of merges, or removes
+     * it if null. Takes effect from the next merge on.
+     */
+    void set_merge_reducer(std::shared_ptr<MergeReducer<LogKey>> reducer)
+    {
+        std::unique_lock<std::mutex> lck {merge_mutex_};
+        reducer_ = std::move(reducer);
+    }
+
+    /// Merges pending in the background; empty if log_merge_strategy is none
+    MergeBacklog merge_backlog() const
+    {
+        return scheduler_ ? scheduler_->backlog() : MergeBacklog{};
+    }
+
     std::unique_ptr<LogFileIterator> fetch(uint64_t key, bool forward = true)
     {
         auto pred = [key](const LogKey& hdr) { return hdr.node_id() == key; };
         return std::unique_ptr<LogFileIterator>{new LogFileIterator{this, pred, key, forward}};
     }
 
+    /**
+     * Fetches the records of a node up to, and including, the first one for which stop returns
+     * true, e.g., reading backward until the latest record from which the node can be rebuilt.
+     * No blocks are read past that record within its level. Other levels read no more than the
+     * first block that may hold records of the node, which is needed to order their records.
+     */
+    template <class Stop>
+    std::unique_ptr<LogFileIterator> fetch(uint64_t key, bool forward, Stop stop)
+    {
+        auto iter = fetch(key, forward);
+        iter->stop_after(stop);
+        return iter;
+    }
+
+    /**
+     * Fetches the records of all the given nodes in a single pass over the log, i.e., each
+     * block holding records of any of the nodes is read once. Node IDs must be sorted. Records
+     * of different nodes are interleaved in block order, so callers demultiplex them by node
+     * ID; the records of each node come in the same order as with fetch().
+     */
+    std::unique_ptr<LogFileIterator> fetch_many(std::vector<uint64_t> keys, bool forward = true)
+    {
+        assert<1>(std::is_sorted(keys.begin(), keys.end()));
+        auto shared = std::make_shared<const std::vector<uint64_t>>(std::move(keys));
+        auto pred = [shared](const LogKey& hdr) {
+            return std::binary_search(shared->begin(), shared->end(), hdr.node_id());
+        };
+        auto version = current_version();
+        return std::unique_ptr<LogFileIterator>{new LogFileIterator{this, pred, version,
+            index_->fetch_blocks(shared, forward), forward}};
+    }
+
+    /**
+     * Fetches the records of all nodes in the given range [lo, hi], reading only the blocks
+     * whose keys overlap it, i.e., in merged levels, the files of the range (see merge_level).
+     * Records of different nodes are interleaved as with fetch_many(). Ranges given by
+     * key_partitions() can be fetched by separate threads, e.g., to recover all nodes in
+     * parallel, without any two threads reading the same merged file.
+     */
+    std::unique_ptr<LogFileIterator> fetch_range(uint64_t lo, uint64_t hi, bool forward = true)
+    {
+        auto pred = [lo, hi](const LogKey& hdr) {
+            return hdr.node_id() >= lo && hdr.node_id() <= hi;
+        };
+        auto version = current_version();
+        return std::unique_ptr<LogFileIterator>{new LogFileIterator{this, pred, version,
+            index_->fetch_blocks(KeyRange{lo, hi}, forward), forward}};
+    }
+
+    /**
+     * Splits the node IDs into consecutive ranges at the first key of each of the key ranges
+     * into which merges split their output (see merge_level), so that no node is in two ranges.
+     * Files that merely continue a range once the previous file reached its maximum size do
+     * not start a new one. The first block of each range is flagged, so ranges are kept when
+     * the log is opened again. They cover all node IDs, in increasing order, and there is only
+     * one if no level was merged or the merges were not split.
+     */
+    std::vector<KeyRange> key_partitions()
+    {
+        auto version = current_version();
+        std::vector<uint64_t> bounds;
+        for (auto level : fs_->list_levels()) {
+            if (level == FirstLevelFile) { continue; }
+            for (auto n : fs_->list_files(level)) {
+                if (!version->contains(n.data())) { continue; }
+                auto f = fs_->get_file(n);
+                if (!f || f->get_size() == 0) { continue; }
+                auto hdr = run_header(n, *f);
+                if (hdr.flags & LogBlockHeader::PartitionStart) { bounds.push_back(hdr.min_key); }
+            }
+        }
+        std::sort(bounds.begin(), bounds.end());
+
+        // Only ranges after the first are flagged, so the first one starts at zero
+        std::vector<KeyRange> result;
+        uint64_t lo = 0;
+        for (size_t i = 0; i < bounds.size(); i++) {
+            if (bounds[i] <= lo) { continue; }
+            result.push_back(KeyRange{lo, bounds[i] - 1});
+            lo = bounds[i];
+        }
+        result.push_back(KeyRange{lo, std::numeric_limits<uint64_t>::max()});
+        return result;
+    }
+
     template <class Filter>
     std::unique_ptr<LogFileIterator> scan(Filter filter, bool forward = true)
     {
         return std::unique_ptr<LogFileIterator>{new LogFileIterator{this, filter, forward}};
     }
 
+    /// Scans the blocks with epochs in [epoch_from, epoch_to), in epoch order
+    template <class Filter>
+    std::unique_ptr<LogFileIterator> scan_epochs(uint64_t epoch_from, uint64_t epoch_to,
+            Filter filter)
+    {
+        auto version = current_version();
+        return std::unique_ptr<LogFileIterator>{new LogFileIterator{this, filter, version,
+            index_->fetch_epochs(epoch_from, epoch_to)}};
+    }
+
+    std::unique_ptr<LogFileIterator> scan_epochs(uint64_t epoch_from, uint64_t epoch_to)
+    {
+        return scan_epochs(epoch_from, epoch_to, [] (const LogKey&) { return true; });
+    }
+
 private:
 
-    std::unique_ptr<LogFileSystem<PageSize>> fs_;
+    /*
+     * Iterators must take the current version before they create their index iterator, so
+     * that the index shows them the output of every merge committed in their version.
+     */
+    std::shared_ptr<const LogVersion> current_version() const
+    {
+        return std::atomic_load(&version_);
+    }
+
+    /*
+     * Publishes a version in which the given files of the level, and possibly all files of the
+     * next level, are replaced by the outputs
+     */
+    void install_version(unsigned level, const std::vector<FileNumber>& inputs,
+            const std::vector<FileNumber>& next_inputs,
+            const std::vector<std::shared_ptr<LogFile>>& outputs)
+    {
+        auto old = std::atomic_load(&version_);
+        auto version = std::make_shared<LogVersion>();
+        version->first = old->first;
+        version->last = old->last;
+        if (version->first.size() < level + 2) {
+            version->first.resize(level + 2, 0);
+            version->last.resize(level + 2, 0);
+        }
+        // Inputs are the oldest files of their level, and outputs the newest of theirs
+        version->first[level] = inputs.back().data() + 1;
+        if (!outputs.empty()) {
+            if (!next_inputs.empty()) { version->first[level + 1] = outputs.front()->num().data(); }
+            version->last[level + 1] = outputs.back()->num().data();
+        }
+
+        old->retired = next_inputs;
+        old->retired.insert(old->retired.end(), inputs.begin(), inputs.end());
+        old->log = this;
+        old->next = version;
+        std::atomic_store(&version_, version);
+    }
+
+    /*
+     * Encodes pages into block bodies with the given codec. Encoders keep buffers across pages,
+     * so each thread that writes blocks, i.e., the flusher and merges, uses its own.
+     */
+    class BlockEncoder
+    {
+    public:
+        BlockEncoder(BlockCodec codec, unsigned fence_interval)
+            : codec_(codec)
+        {
+            // Fences are not used in compressed blocks
+            if (codec_ == BlockCodec::None && fence_interval > 0) {
+                codec_ = BlockCodec::Fenced;
+                fence_encoder_.reset(new FencedPageCodec<LogPage>{fence_interval});
+            }
+            if (codec_ == BlockCodec::LZ) {
+                encoder_.reset(new LogPageCodec<LogPage>);
+            }
+            if (codec_ != BlockCodec::None) {
+                buffer_.reset(new char[PageSize]);
+            }
+        }
+
+        /// Returns the body of the block that holds the given page, and its length and codec
+        const void* encode(const LogPage& page, size_t& length, BlockCodec& codec)
+        {
+            length = PageSize;
+            codec = BlockCodec::None;
+            if (codec_ == BlockCodec::None) { return &page; }
+
+            // Encoded body is only used if it is actually smaller than the page
+            size_t encoded = codec_ == BlockCodec::LZ
+                ? encoder_->encode(page, buffer_.get(), PageSize)
+                : fence_encoder_->encode(page, buffer_.get(), PageSize);
+            if (encoded == 0) { return &page; }
+            length = encoded;
+            codec = codec_;
+            return buffer_.get();
+        }
+
+    private:
+        BlockCodec codec_;
+        std::unique_ptr<LogPageCodec<LogPage>> encoder_;
+        std::unique_ptr<FencedPageCodec<LogPage>> fence_encoder_;
+        std::unique_ptr<char[]> buffer_;
+    };
+
+    /*
+     * Appends the page to the file as a block and returns its offset. The header must have its
+     * epoch set; the other fields are filled in here.
+     */
+    template <class File>
+    static size_t write_block(File& file, const LogPage& page, LogBlockHeader& hdr,
+            BlockEncoder& encoder, bool sync = true)
+    {
+        size_t length;
+        BlockCodec codec;
+        const void* body = encoder.encode(page, length, codec);
+        hdr.min_key = page.get_slot(0).key.node_id();
+        hdr.max_key = page.get_slot(page.slot_count() - 1).key.node_id();
+        hdr.seal(body, length, codec);
+        iovec iov[] = {
+            { &hdr, sizeof(LogBlockHeader) },
+            { const_cast<void*>(body), length }
+        };
+        return file.append(iov, 2, sync);
+    }
+
+    // Range [begin, end) of a file holding consecutive blocks of a sorted run
+    struct RunSegment
+    {
+        std::shared_ptr<LogFile> file;
+        size_t begin;
+        size_t end;
+    };
+
+    using Run = std::vector<RunSegment>;
+
+    /// Reads the records of a sorted run, one block at a time
+    class RunCursor
+    {
+    public:
+        RunCursor(ThisType* log, Run run)
+            : log_(log), run_(std::move(run)), segment_(0),
+            offset_(run_.empty() ? 0 : run_[0].begin),
+            page_(new LogPage), buffer_(new char[PageSize])
+        {}
+
+        bool next(LogKey& key, const char*& payload)
+        {
+            while (!iter_ || !iter_->next(key, payload)) {
+                if (!next_block()) { return false; }
+            }
+            return true;
+        }
+
+    private:
+        bool next_block()
+        {
+            while (segment_ < run_.size() && offset_ >= run_[segment_].end) {
+                if (++segment_ < run_.size()) { offset_ = run_[segment_].begin; }
+            }
+            if (segment_ == run_.size()) { return false; }
+
+            auto& f = *run_[segment_].file;
+            LogBlockHeader hdr;
+            f.read(offset_, &hdr, sizeof(LogBlockHeader));
+            if (hdr.magic != LogBlockHeader::Magic || hdr.length > PageSize) {
+                throw_corrupt(f.num().data(), offset_);
+            }
+            f.read(offset_ + sizeof(LogBlockHeader), buffer_.get(), hdr.length);
+            if (!hdr.is_valid(buffer_.get(), PageSize)
+                    || !decode_block(hdr, buffer_.get(), *page_))
+            {
+                throw_corrupt(f.num().data(), offset_);
+            }
+            iter_ = std::move(page_->iterate());
+            offset_ += aligned_block_size(hdr.length);
+            log_->merge_limiter_.consume(sizeof(LogBlockHeader) + hdr.length);
+            return true;
+        }
+
+        ThisType* log_;
+        Run run_;
+        size_t segment_;
+        size_t offset_;
+        std::unique_ptr<LogPage> page_;
+        std::unique_ptr<char[]> buffer_;
+        std::unique_ptr<LogPageIterator> iter_;
+    };
+
+    /*
+     * Writes a sorted run into new merge files of the given level, which are appended to the
+     * given vector. Blocks of the final output of a merge are indexed as they are written,
+     * which is harmless since no iterator reads the files before the merge commits, and the
+     * files are synced when the run is finished.
+     */
+    class RunWriter
+    {
+    public:
+        RunWriter(ThisType* log, unsigned level, uint64_t epoch, BlockEncoder& encoder,
+                bool output, std::vector<std::shared_ptr<LogFile>>& files)
+            : log_(log), level_(level), epoch_(epoch), encoder_(encoder), output_(output),
+            files_(files), page_(new LogPage)
+        {
+            page_->clear();
+            if (output_ && log_->filter_) { filter_.reset(new BloomFilter); }
+        }
+
+        /*
+         * Splits a run of about the given size into the given number of parts, each started
+         * in a new file at the first change of node ID after the previous part's share of bytes
+         */
+        void split(size_t bytes, size_t parts)
+        {
+            split_bytes_ = bytes / parts;
+            split_end_ = split_bytes_;
+            splits_left_ = split_bytes_ > 0 ? parts - 1 : 0;
+        }
+
+        void add(const LogKey& key, const char* payload)
+        {
+            if (splits_left_ > 0 && written_ >= split_end_ && key.node_id() != last_node_) {
+                write_page();
+                new_file_ = true;
+                split_end_ += split_bytes_;
+                splits_left_--;
+            }
+            last_node_ = key.node_id();
+            if (page_->try_insert_raw(key, payload)) { return; }
+            write_page();
+            bool inserted = page_->try_insert_raw(key, payload);
+            assert<1>(inserted);
+        }
+
+        /// Header of the first block of each file written, in the order of the files
+        const std::vector<LogBlockHeader>& first_headers() const { return first_headers_; }
+
+        /// Writes the last page and returns the run
+        Run finish()
+        {
+            write_page();
+            if (output_) {
+                for (auto& segment : run_) { segment.file->sync(); }
+            }
+            return std::move(run_);
+        }
+
+    private:
+        void write_page()
+        {
+            if (page_->slot_count() == 0) { return; }
+
+            auto fs = log_->fs_.get();
+            LogBlockHeader hdr;
+            hdr.epoch = epoch_;
+            bool first_block = false;
+            if (run_.empty() || new_file_
+                    || run_.back().end + BlockSize > fs->get_file_size(level_))
+            {
+                if (new_file_) { hdr.flags = LogBlockHeader::PartitionStart; }
+                first_block = true;
+                new_file_ = false;
+                auto f = fs->create_merge_file(level_);
+                files_.push_back(f);
+                // Number may have been used by a merge that did not commit
+                if (output_) { log_->index_->delete_file(f->num().data()); }
+                run_.push_back(RunSegment{f, 0, 0});
+            }
+
+            auto& segment = run_.back();
+            size_t offset = write_block(*segment.file, *page_, hdr, encoder_, false);
+            if (first_block) { first_headers_.push_back(hdr); }
+            segment.end = offset + aligned_block_size(hdr.length);
+            written_ += aligned_block_size(hdr.length);
+            log_->merge_limiter_.consume(sizeof(LogBlockHeader) + hdr.length);
+            if (output_) {
+                const BloomFilter* filter = nullptr;
+                if (filter_) {
+                    fill_filter(*page_, *filter_);
+                    filter = filter_.get();
+                }
+                log_->index_->insert_block(segment.file->num().data(), offset, epoch_,
+                        hdr.min_key, hdr.max_key, filter);
+            }
+            page_->clear();
+        }
+
+        ThisType* log_;
+        unsigned level_;
+        uint64_t epoch_;
+        BlockEncoder& encoder_;
+        // Whether this is the final output of a merge, rather than an intermediate run
+        bool output_;
+        std::vector<std::shared_ptr<LogFile>>& files_;
+        std::unique_ptr<LogPage> page_;
+        std::unique_ptr<BloomFilter> filter_;
+        Run run_;
+        std::vector<LogBlockHeader> first_headers_;
+        // Bytes written so far, and those after which the next part is started (see split)
+        size_t written_ = 0;
+        size_t split_bytes_ = 0;
+        size_t split_end_ = 0;
+        size_t splits_left_ = 0;
+        uint64_t last_node_ = 0;
+        bool new_file_ = false;
+    };
+
+    /*
+     * Adds the sorted runs of the given file to a merge, i.e., each of its blocks if it is a
+     * level-0 file, or else the whole file, and raises the epoch to that of its blocks.
+     */
+    void add_runs(FileNumber n, unsigned level, std::vector<Run>& runs, uint64_t& epoch)
+    {
+        auto f = fs_->get_file(n);
+        size_t size = f->get_size();
+        // Blocks of merged files all have the same epoch
+        size_t end = level == FirstLevelFile ? size : std::min<size_t>(size, 1);
+        size_t offset = 0;
+        while (offset < end) {
+            LogBlockHeader hdr;
+            f->read(offset, &hdr, sizeof(LogBlockHeader));
+            if (hdr.magic != LogBlockHeader::Magic || hdr.length > PageSize) {
+                throw_corrupt(n.data(), offset);
+            }
+            epoch = std::max(epoch, hdr.epoch);
+            size_t next = offset + aligned_block_size(hdr.length);
+            if (level == FirstLevelFile) { runs.push_back(Run{RunSegment{f, offset, next}}); }
+            offset = next;
+        }
+        if (level != FirstLevelFile) { runs.push_back(Run{RunSegment{f, 0, size}}); }
+    }
+
+    // Epoch of the last block of a file; blocks of merged files all have the same epoch
+    uint64_t last_file_epoch(FileNumber n, unsigned level)
+    {
+        auto f = fs_->get_file(n);
+        size_t size = f ? f->get_size() : 0;
+        uint64_t epoch = 0;
+        size_t offset = 0;
+        while (offset < size) {
+            LogBlockHeader hdr;
+            f->read(offset, &hdr, sizeof(LogBlockHeader));
+            if (hdr.magic != LogBlockHeader::Magic || hdr.length > PageSize) {
+                throw_corrupt(n.data(), offset);
+            }
+            epoch = std::max(epoch, hdr.epoch);
+            if (level != FirstLevelFile) { break; }
+            offset += aligned_block_size(hdr.length);
+        }
+        return epoch;
+    }
+
+    /*
+     * Called by the recycler thread. More files can only be recycled once the image epoch
+     * advances or a new level-0 file is started, since the file appended to is never recycled.
+     */
+    void recycle_images()
+    {
+        uint64_t epoch = image_epoch_;
+        auto current = fs_->curr_file(FirstLevelFile);
+        uint32_t file = current ? current->num().data() : 0;
+        if (epoch == 0 || (epoch == recycled_epoch_ && file == recycled_file_)) { return; }
+        recycle(epoch);
+        recycled_epoch_ = epoch;
+        recycled_file_ = file;
+    }
+
+    /*
+     * Merges runs [begin, end) into the writer; records of earlier runs go first on ties, and
+     * records rejected by the reducer, if any, are left out
+     */
+    void merge_runs(const std::vector<Run>& runs, size_t begin, size_t end, RunWriter& writer)
+    {
+        LogRecordMerger<LogKey, RunCursor> merger;
+        for (size_t i = begin; i < end; i++) {
+            merger.add(std::unique_ptr<RunCursor>{new RunCursor{this, runs[i]}});
+        }
+        if (reducer_) { reducer_->reset(); }
+        LogKey key;
+        const char* payload;
+        while (merger.next(key, payload)) {
+            if (merge_cancel_.load(std::memory_order_relaxed)) {
+                throw std::runtime_error("Log merge cancelled");
+            }
+            if (reducer_ && !reducer_->keep(key, payload)) { continue; }
+            writer.add(key, payload);
+        }
+    }
+
+    // Metadata of a block found by scan_file
+    struct RecoveredBlock
+    {
+        uint32_t block;
+        uint64_t epoch;
+        uint64_t min;
+        uint64_t max;
+        std::unique_ptr<BloomFilter> filter;
+    };
+
+    /*
+     * Indexes may lag behind the log files after a crash, since they are maintained
+     * asynchronously (e.g., the SQLite index commits in batches and the native index does not
+     * sync its file), and they may be lost altogether (see the log_index_rebuild option).
+     * Blocks appended after the last block covered by the index are therefore read from the
+     * log files and inserted again. This is done for each level separately, since merges
+     * append to the files of the other levels independently of the flusher.
+     *
+     * Files are scanned by up to log_index_rebuild_threads threads in parallel, while this
+     * thread inserts their blocks into the index in file order, which is the epoch order in
+     * which the flusher appended them. Scans run at most that many files ahead of the
+     * insertions, which bounds the memory used for recovered metadata.
+     */
+    void recover_index()
+    {
+        auto levels = fs_->list_levels();
+        if (levels.empty() || levels.front() != FirstLevelFile) {
+            levels.insert(levels.begin(), FirstLevelFile);
+        }
+
+        // All files listed are visible, since retired files are deleted once the callback is set
+        auto version = std::make_shared<LogVersion>();
+        version->first.assign(levels.back() + 1, 0);
+        version->last.assign(levels.back() + 1, 0);
+        last_epoch_ = 0;
+        for (auto level : levels) {
+            auto files = fs_->list_files(level);
+            if (!files.empty()) { version->last[level] = files.back().data(); }
+            recover_level(level, files);
+        }
+        std::atomic_store(&version_, version);
+    }
+
+    void recover_level(unsigned level, const std::vector<FileNumber>& level_files)
+    {
+        uint32_t last_file = 0;
+        uint32_t last_block = 0;
+        uint64_t epoch = 0;
+        bool indexed = index_->get_last_block(level, last_file, last_block, epoch);
+
+        // Files to scan, each with the offset of its first block that is not indexed
+        std::vector<std::pair<FileNumber, size_t>> files;
+        for (auto n : level_files) {
+            if (indexed && n.data() < last_file) { continue; }
+            size_t offset = 0;
+            if (indexed && n.data() == last_file) {
+                auto f = fs_->get_file(n);
+                if (!f) { continue; }
+                /*
+                 * Last indexed blocks may have been trimmed as a torn write, and the next append
+                 * reuses their offsets, so the file is indexed again from scratch
+                 */
+                if (last_block >= f->get_size()) {
+                    index_->delete_file(n.data());
+                    indexed = false;
+                } else {
+                    LogBlockHeader hdr;
+                    f->read(last_block, &hdr, sizeof(LogBlockHeader));
+                    offset = last_block + aligned_block_size(hdr.length);
+                }
+            }
+            files.emplace_back(n, offset);
+        }
+        if (indexed) { last_epoch_ = std::max(last_epoch_, epoch); }
+
+        std::deque<std::future<std::vector<RecoveredBlock>>> scans;
+        size_t next = 0;
+        for (auto& file : files) {
+            while (next < files.size() && scans.size() < rebuild_threads_) {
+                scans.push_back(std::async(std::launch::async, &ThisType::scan_file, this,
+                            files[next].first, files[next].second));
+                next++;
+            }
+            auto blocks = scans.front().get();
+            scans.pop_front();
+
+            for (auto& b : blocks) {
+                // Blocks that do not record their epoch were flushed one per epoch
+                uint64_t block_epoch = b.epoch > 0 || level != FirstLevelFile
+                    ? b.epoch : last_epoch_ + 1;
+                index_->insert_block(file.first.data(), b.block, block_epoch, b.min, b.max,
+                        b.filter.get());
+                last_epoch_ = std::max(last_epoch_, block_epoch);
+            }
+        }
+    }
+
+    /*
+     * Returns the metadata of all blocks of the given file, starting at the given offset.
+     * Only block headers are read, unless a header does not describe its block (i.e., the
+     * block was written before headers recorded epochs and key ranges), in which case the page
+     * is read and parsed. Other recovered blocks therefore have no Bloom filter, which fetches
+     * treat as a block that may contain any key of its range. Filters are built again lazily,
+     * when merges rewrite the recovered blocks into the next level.
+     */
+    std::vector<RecoveredBlock> scan_file(FileNumber n, size_t offset)
+    {
+        std::vector<RecoveredBlock> blocks;
+        auto f = fs_->get_file(n);
+        if (!f) { return blocks; }
+
+        std::unique_ptr<LogPage> page;
+        std::unique_ptr<char[]> buffer;
+        LogBlockHeader hdr;
+        size_t size = f->get_size();
+        while (offset < size) {
+            f->read(offset, &hdr, sizeof(LogBlockHeader));
+            if (hdr.magic != LogBlockHeader::Magic || hdr.length > PageSize) {
+                throw_corrupt(n.data(), offset);
+            }
+            RecoveredBlock b {static_cast<uint32_t>(offset), hdr.epoch, hdr.min_key,
+                hdr.max_key, nullptr};
+
+            if (hdr.epoch == 0) {
+                if (!page) {
+                    page.reset(new LogPage);
+                    buffer.reset(new char[PageSize]);
+                }
+                f->read(offset + sizeof(LogBlockHeader), buffer.get(), hdr.length);
+                if (!hdr.is_valid(buffer.get(), PageSize)
+                        || !decode_block(hdr, buffer.get(), *page))
+                {
+                    throw_corrupt(n.data(), offset);
+                }
+                b.min = page->get_slot(0).key.node_id();
+                b.max = page->get_slot(page->slot_count() - 1).key.node_id();
+                // The page is parsed anyway, so its filter comes at no extra read
+                if (filter_) {
+                    b.filter.reset(new BloomFilter);
+                    fill_filter(*page, *b.filter);
+                }
+            }
+
+            blocks.push_back(std::move(b));
+            offset += aligned_block_size(hdr.length);
+        }
+        return blocks;
+    }
+
+    /// Fills in the Bloom filter with the node IDs of the given page; null if filters are off
+    const BloomFilter* build_filter(const LogPage& page)
+    {
+        if (!filter_) { return nullptr; }
+        fill_filter(page, *filter_);
+        return filter_.get();
+    }
+
+    static void fill_filter(const LogPage& page, BloomFilter& filter)
+    {
+        filter.clear();
+        uint64_t last = 0;
+        auto count = page.slot_count();
+        for (decltype(count) i = 0; i < count; i++) {
+            // Slots are sorted, so repeated node IDs are adjacent
+            uint64_t id = page.get_slot(i).key.node_id();
+            if (i == 0 || id != last) { filter.add(id); }
+            last = id;
+        }
+    }
+
+    static bool decode_block(const LogBlockHeader& hdr, const char* body, LogPage& page)
+    {
+        switch (hdr.codec) {
+            case BlockCodec::None:
+                if (hdr.length != PageSize) { return false; }
+                ::memcpy(&page, body, PageSize);
+                return true;
+            case BlockCodec::LZ:
+                return LogPageCodec<LogPage>{}.decode(body, hdr.length, page);
+            case BlockCodec::Fenced:
+                return FencedPageCodec<LogPage>{0}.decode(body, hdr.length, page);
+            default:
+                return false;
+        }
+    }
+
+    /*
+     * Header of the first block of a merged file, which holds the epoch of its run and its
+     * first key, and whether it starts a key range. merge_level caches it when it commits the
+     * file, so only files merged before the log was opened have it read, once.
+     */
+    LogBlockHeader run_header(FileNumber n, LogFile& file)
+    {
+        {
+            std::unique_lock<std::mutex> lck {run_headers_mutex_};
+            auto it = run_headers_.find(n);
+            if (it != run_headers_.end()) { return it->second; }
+        }
+        LogBlockHeader hdr;
+        file.read(0, &hdr, sizeof(LogBlockHeader));
+        if (hdr.magic != LogBlockHeader::Magic) { throw_corrupt(n.data(), 0); }
+        std::unique_lock<std::mutex> lck {run_headers_mutex_};
+        run_headers_[n] = hdr;
+        return hdr;
+    }
+
+    static void throw_corrupt(uint32_t file, uint32_t block)
+    {
+        throw std::runtime_error("Corrupt log block " + std::to_string(block)
+                + " in file " + std::to_string(file));
+    }
+
+    std::unique_ptr<LogFileSystem<BlockSize>> fs_;
     std::unique_ptr<LogIndex> index_;
+    bool verify_checksums_;
+    bool mmap_reads_;
+    BlockCodec codec_;
+    unsigned fence_interval_;
+    // Used by the flusher thread only
+    std::unique_ptr<BlockEncoder> encoder_;
+    // Bloom filter of the last page appended; used by the flusher thread only
+    std::unique_ptr<BloomFilter> filter_;
+    // Maximum number of files scanned in parallel by recover_index
+    size_t rebuild_threads_;
+    // Epoch of the last block appended or recovered
+    uint64_t last_epoch_;
+    // Maximum number of runs merged in one pass
+    size_t merge_fan_in_;
+    // Number of key ranges into which the output of a merge is split
+    size_t merge_partitions_;
+    // Serializes merges
+    std::mutex merge_mutex_;
+    // Null if records are not reduced; protected by merge_mutex_
+    std::shared_ptr<MergeReducer<LogKey>> reducer_;
+    // First block header of each file of the merged levels (see run_header)
+    std::map<FileNumber, LogBlockHeader> run_headers_;
+    std::mutex run_headers_mutex_;
+    // Accessed atomically; released before the file system, since it may delete files
+    std::shared_ptr<LogVersion> version_;
+    MergeRateLimiter merge_limiter_;
+    std::atomic<bool> merge_cancel_;
+    // Number of the level-0 file last appended to; used by the flusher thread only
+    uint32_t flush_file_;
+    // Oldest epoch of the newest images of all nodes (see set_image_epoch)
+    std::atomic<uint64_t> image_epoch_ {0};
+    // Image epoch and current level-0 file as of the last recycle; used by the recycler only
+    uint64_t recycled_epoch_ = 0;
+    uint32_t recycled_file_ = 0;
+    // Null if log_merge_strategy is none
+    std::unique_ptr<LogMergeScheduler<ThisType>> scheduler_;
 };
 
+// Definition for ODR-uses, e.g., when passed by reference
+template <class LogPage, class LogIndex, template <size_t> class LogFileSystem>
+constexpr unsigned FileBasedLog<LogPage, LogIndex, LogFileSystem>::FirstLevelFile;
+
 } // namespace fineline
 
 #endif
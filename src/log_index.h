@@ -0,0 +1,226 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FINELINE_LOG_INDEX_H
+#define FINELINE_LOG_INDEX_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "options.h"
+#include "log_index_memory.h"
+#include "log_index_native.h"
+#include "legacy/log_index_sqlite.h"
+
+namespace fineline {
+
+/**
+ * \brief Log index whose implementation is chosen at runtime with the log_index option.
+ *
+ * FileBasedLog takes the log index as a template parameter, which fixes the index type at
+ * compile time. This class allows the same binary to use different indexes (e.g., the native
+ * index for a durable log and MemoryLogIndex for a volatile one) by forwarding calls to the
+ * selected implementation through a virtual interface. The overhead is one virtual call per
+ * block.
+ *
+ * Accepted values of log_index are "native", "sqlite", "memory", and "auto", which is the
+ * default and selects "memory" for volatile logs (see log_volatile option) and "native"
+ * otherwise.
+ */
+class SelectableLogIndex
+{
+public:
+    class FetchBlockIterator
+    {
+    public:
+        virtual ~FetchBlockIterator() {}
+        virtual bool next(uint32_t& file, uint32_t& block) = 0;
+    };
+
+    SelectableLogIndex(const Options& options)
+    {
+        auto name = options.get<std::string>("log_index");
+        if (name == "auto") {
+            name = options.get<bool>("log_volatile") ? "memory" : "native";
+        }
+
+        if (name == "native") { impl_.reset(new IndexImpl<NativeLogIndex>{options}); }
+        else if (name == "sqlite") { impl_.reset(new IndexImpl<legacy::SQLiteLogIndex>{options}); }
+        else if (name == "memory") { impl_.reset(new IndexImpl<MemoryLogIndex>{options}); }
+        else { throw std::runtime_error("Unknown log index: " + name); }
+    }
+
+    void insert_block(uint32_t file, uint32_t block, uint64_t epoch, uint64_t min, uint64_t max,
+            const BloomFilter* filter = nullptr)
+    {
+        impl_->insert_block(file, block, epoch, min, max, filter);
+    }
+
+    void delete_file(uint32_t file)
+    {
+        impl_->delete_file(file);
+    }
+
+    /// Returns the last block of the given merge level; false if there is none
+    bool get_last_block(uint32_t level, uint32_t& file, uint32_t& block, uint64_t& epoch)
+    {
+        return impl_->get_last_block(level, file, block, epoch);
+    }
+
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(bool forward)
+    {
+        return impl_->fetch_blocks(forward);
+    }
+
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(uint64_t key, bool forward)
+    {
+        return impl_->fetch_blocks(key, forward);
+    }
+
+    /// Blocks of the given merge level only
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(uint64_t key, bool forward, uint32_t level)
+    {
+        return impl_->fetch_blocks(key, forward, level);
+    }
+
+    /// Blocks that may contain any of the given keys, which must be sorted
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(
+            std::shared_ptr<const std::vector<uint64_t>> keys, bool forward)
+    {
+        return impl_->fetch_blocks(keys, forward);
+    }
+
+    /// Blocks that may contain any key of the given range
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(MemoryLogIndex::KeyRange range, bool forward)
+    {
+        return impl_->fetch_blocks(range, forward);
+    }
+
+    std::unique_ptr<FetchBlockIterator> fetch_epochs(uint64_t epoch_from, uint64_t epoch_to)
+    {
+        return impl_->fetch_epochs(epoch_from, epoch_to);
+    }
+
+private:
+    struct Index
+    {
+        virtual ~Index() {}
+        virtual void insert_block(uint32_t, uint32_t, uint64_t, uint64_t, uint64_t,
+                const BloomFilter*) = 0;
+        virtual void delete_file(uint32_t) = 0;
+        virtual bool get_last_block(uint32_t, uint32_t&, uint32_t&, uint64_t&) = 0;
+        virtual std::unique_ptr<FetchBlockIterator> fetch_blocks(bool) = 0;
+        virtual std::unique_ptr<FetchBlockIterator> fetch_blocks(uint64_t, bool) = 0;
+        virtual std::unique_ptr<FetchBlockIterator> fetch_blocks(uint64_t, bool, uint32_t) = 0;
+        virtual std::unique_ptr<FetchBlockIterator> fetch_blocks(
+                std::shared_ptr<const std::vector<uint64_t>>, bool) = 0;
+        virtual std::unique_ptr<FetchBlockIterator> fetch_blocks(MemoryLogIndex::KeyRange,
+                bool) = 0;
+        virtual std::unique_ptr<FetchBlockIterator> fetch_epochs(uint64_t, uint64_t) = 0;
+    };
+
+    template <class Iter>
+    struct IteratorImpl : public FetchBlockIterator
+    {
+        IteratorImpl(std::unique_ptr<Iter>&& iter) : iter_(std::move(iter)) {}
+
+        bool next(uint32_t& file, uint32_t& block) override
+        {
+            return iter_->next(file, block);
+        }
+
+        std::unique_ptr<Iter> iter_;
+    };
+
+    template <class Impl>
+    struct IndexImpl : public Index
+    {
+        using Iter = IteratorImpl<typename Impl::FetchBlockIterator>;
+
+        IndexImpl(const Options& options) : index_(options) {}
+
+        void insert_block(uint32_t file, uint32_t block, uint64_t epoch, uint64_t min,
+                uint64_t max, const BloomFilter* filter) override
+        {
+            index_.insert_block(file, block, epoch, min, max, filter);
+        }
+
+        void delete_file(uint32_t file) override
+        {
+            index_.delete_file(file);
+        }
+
+        bool get_last_block(uint32_t level, uint32_t& file, uint32_t& block,
+                uint64_t& epoch) override
+        {
+            return index_.get_last_block(level, file, block, epoch);
+        }
+
+        std::unique_ptr<FetchBlockIterator> fetch_blocks(bool forward) override
+        {
+            return std::unique_ptr<FetchBlockIterator>{new Iter{index_.fetch_blocks(forward)}};
+        }
+
+        std::unique_ptr<FetchBlockIterator> fetch_blocks(uint64_t key, bool forward) override
+        {
+            return std::unique_ptr<FetchBlockIterator>{
+                new Iter{index_.fetch_blocks(key, forward)}};
+        }
+
+        std::unique_ptr<FetchBlockIterator> fetch_blocks(uint64_t key, bool forward,
+                uint32_t level) override
+        {
+            return std::unique_ptr<FetchBlockIterator>{
+                new Iter{index_.fetch_blocks(key, forward, level)}};
+        }
+
+        std::unique_ptr<FetchBlockIterator> fetch_blocks(
+                std::shared_ptr<const std::vector<uint64_t>> keys, bool forward) override
+        {
+            return std::unique_ptr<FetchBlockIterator>{
+                new Iter{index_.fetch_blocks(keys, forward)}};
+        }
+
+        std::unique_ptr<FetchBlockIterator> fetch_blocks(MemoryLogIndex::KeyRange range,
+                bool forward) override
+        {
+            return std::unique_ptr<FetchBlockIterator>{
+                new Iter{index_.fetch_blocks(range, forward)}};
+        }
+
+        std::unique_ptr<FetchBlockIterator> fetch_epochs(uint64_t epoch_from,
+                uint64_t epoch_to) override
+        {
+            return std::unique_ptr<FetchBlockIterator>{
+                new Iter{index_.fetch_epochs(epoch_from, epoch_to)}};
+        }
+
+        Impl index_;
+    };
+
+    std::unique_ptr<Index> impl_;
+};
+
+} // namespace fineline
+
+#endif
@@ -0,0 +1,522 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FINELINE_LOG_INDEX_MEMORY_H
+#define FINELINE_LOG_INDEX_MEMORY_H
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <limits>
+#include <stdexcept>
+
+#include "options.h"
+#include "bloom_filter.h"
+
+namespace fineline {
+
+/**
+ * \brief Log index kept entirely in main memory.
+ *
+ * Blocks are recorded in the order in which they are inserted, which is the epoch order in which
+ * the flusher appends them, so that forward and backward fetches are simply forward and
+ * backward scans. Entries are stored in chunks of ChunkSize blocks, with the fields of each
+ * block in separate arrays (i.e., a structure of arrays), and each chunk keeps the smallest and
+ * largest key of its blocks. Fetching the blocks of a key then only looks at the chunks whose
+ * key range includes it, and within a chunk only at the min/max arrays.
+ *
+ * There is a single writer at a time (inserts and deletions are serialized by a mutex), and
+ * readers do not take any locks: a block becomes visible to readers once the end position is
+ * advanced, and iterators only see the blocks that were visible when they were created.
+ * Deleting a file invalidates its entries, and a chunk whose entries were all deleted is
+ * released once no iterator references it, which bounds memory when old files are discarded.
+ *
+ * Since epochs increase with the position of the blocks, the blocks of a range of epochs are
+ * found by binary search, first over the epochs of the first block of each chunk and then
+ * within a chunk, so that fetching an epoch range only costs as much as the blocks returned.
+ *
+ * Blocks may come with a Bloom filter of their node IDs, which fetches check after the min/max
+ * range, so that blocks which cover a key's range without containing it are never read.
+ * Filters are only allocated for the blocks that have one.
+ *
+ * Blocks of merged log files (i.e., of files whose number carries a merge level in its high bits)
+ * are kept in a separate sequence per level, with the same structure. Merges always move the
+ * oldest blocks of a level into the next one, so the blocks of a deeper level are older than
+ * those of any level above it. Iterators over more than one level therefore visit the deepest
+ * level first when going forward and level 0 first when going backward, which returns blocks in
+ * the order in which their records were logged. Epoch ranges only cover level 0, since the
+ * blocks of merged levels mix the records of many epochs.
+ *
+ * Fetches of a range of keys return the blocks whose min/max range overlaps it. Merges may split
+ * their output into files that each hold a range of keys (see log_merge_partitions), in which
+ * case the min/max ranges of their blocks confine such fetches to the files of the ranges
+ * queried.
+ */
+class MemoryLogIndex
+{
+public:
+    static constexpr size_t ChunkSize = 1024;
+    static constexpr size_t MaxChunks = 16384;
+    // File number 0 is never used by log files, so it marks deleted entries
+    static constexpr uint32_t DeletedFile = 0;
+    // High bits of a file number are its merge level (see legacy::log_file)
+    static constexpr unsigned LevelShift = 24;
+    static constexpr size_t MaxLevels = 256;
+
+    static uint32_t level_of(uint32_t file) { return file >> LevelShift; }
+
+private:
+    struct Chunk
+    {
+        explicit Chunk(size_t b)
+            : base(b), live(0), min_key(std::numeric_limits<uint64_t>::max()), max_key(0)
+        {}
+
+        // Position of the first entry
+        const size_t base;
+        // Number of entries not deleted; only accessed by the writer
+        size_t live;
+        std::atomic<uint64_t> min_key;
+        std::atomic<uint64_t> max_key;
+
+        std::atomic<uint64_t> min[ChunkSize];
+        std::atomic<uint64_t> max[ChunkSize];
+        std::atomic<uint64_t> epoch[ChunkSize];
+        std::atomic<uint32_t> file[ChunkSize];
+        std::atomic<uint32_t> block[ChunkSize];
+        // Written before the entry becomes visible, so readers need no synchronization
+        std::unique_ptr<BloomFilter> filter[ChunkSize];
+    };
+
+    // Blocks of one level, in insertion order
+    struct Level
+    {
+        Level() : dir(MaxChunks), chunk_epoch(MaxChunks), begin(0), end(0) {}
+
+        // Position of the first block in [from, to) with the given epoch or a later one
+        size_t find_epoch(uint64_t epoch, size_t from, size_t to) const
+        {
+            // First chunk whose first block has a later epoch
+            size_t lo = from / ChunkSize;
+            size_t hi = (to + ChunkSize - 1) / ChunkSize;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (chunk_epoch[mid % MaxChunks].load(std::memory_order_relaxed) <= epoch) {
+                    lo = mid + 1;
+                }
+                else { hi = mid; }
+            }
+            if (lo == from / ChunkSize) { return from; }
+
+            // Blocks are in the preceding chunk, unless it was released
+            size_t base = (lo - 1) * ChunkSize;
+            auto chunk = std::atomic_load(&dir[slot(base)]);
+            if (!chunk || chunk->base != base) { return std::min(to, lo * ChunkSize); }
+            size_t first = 0;
+            size_t last = std::min(to - base, size_t{ChunkSize});
+            while (first < last) {
+                size_t mid = first + (last - first) / 2;
+                if (chunk->epoch[mid].load(std::memory_order_relaxed) < epoch) { first = mid + 1; }
+                else { last = mid; }
+            }
+            return base + first;
+        }
+
+        // Chunk directory used as a ring buffer, indexed by slot()
+        std::vector<std::shared_ptr<Chunk>> dir;
+        // Epoch of the first block of each chunk, which remains after the chunk is released
+        std::vector<std::atomic<uint64_t>> chunk_epoch;
+        std::atomic<size_t> begin;
+        std::atomic<size_t> end;
+    };
+
+public:
+
+    /// Range of epochs [from, to) to be fetched
+    struct EpochRange
+    {
+        uint64_t from;
+        uint64_t to;
+    };
+
+    /// Range of keys [lo, hi] to be fetched
+    struct KeyRange
+    {
+        uint64_t lo;
+        uint64_t hi;
+    };
+
+    /// Whether a block with the given range and filter may contain any of the sorted keys
+    static bool may_contain_any(const std::vector<uint64_t>& keys, uint64_t min, uint64_t max,
+            const BloomFilter* filter)
+    {
+        auto it = std::lower_bound(keys.begin(), keys.end(), min);
+        for (; it != keys.end() && *it <= max; it++) {
+            if (!filter || filter->may_contain(*it)) { return true; }
+        }
+        return false;
+    }
+
+    MemoryLogIndex(const Options& = Options{})
+        : levels_(MaxLevels), level_count_(1)
+    {
+        levels_[0].reset(new Level);
+    }
+
+    void insert_block(uint32_t file, uint32_t block, uint64_t epoch, uint64_t min, uint64_t max,
+            const BloomFilter* filter = nullptr)
+    {
+        std::unique_lock<std::mutex> lck {write_mutex_};
+
+        // Levels are allocated up to the deepest one used, and published once allocated
+        size_t count = level_count_.load(std::memory_order_relaxed);
+        if (level_of(file) >= count) {
+            for (size_t l = count; l <= level_of(file); l++) { levels_[l].reset(new Level); }
+            level_count_.store(level_of(file) + 1, std::memory_order_release);
+        }
+        auto& level = *levels_[level_of(file)];
+
+        size_t pos = level.end.load(std::memory_order_relaxed);
+        if (pos - level.begin.load(std::memory_order_relaxed) >= (MaxChunks - 1) * ChunkSize) {
+            throw std::runtime_error("Memory log index is full");
+        }
+
+        size_t offset = pos % ChunkSize;
+        std::shared_ptr<Chunk> chunk;
+        if (offset == 0) {
+            chunk = std::make_shared<Chunk>(pos);
+            std::atomic_store(&level.dir[slot(pos)], chunk);
+            level.chunk_epoch[slot(pos)].store(epoch, std::memory_order_relaxed);
+        }
+        else {
+            chunk = std::atomic_load(&level.dir[slot(pos)]);
+        }
+
+        chunk->file[offset].store(file, std::memory_order_relaxed);
+        chunk->block[offset].store(block, std::memory_order_relaxed);
+        chunk->epoch[offset].store(epoch, std::memory_order_relaxed);
+        chunk->min[offset].store(min, std::memory_order_relaxed);
+        chunk->max[offset].store(max, std::memory_order_relaxed);
+        if (filter) { chunk->filter[offset].reset(new BloomFilter{*filter}); }
+        chunk->live++;
+        if (min < chunk->min_key.load(std::memory_order_relaxed)) {
+            chunk->min_key.store(min, std::memory_order_relaxed);
+        }
+        if (max > chunk->max_key.load(std::memory_order_relaxed)) {
+            chunk->max_key.store(max, std::memory_order_relaxed);
+        }
+
+        level.end.store(pos + 1, std::memory_order_release);
+    }
+
+    /// Removes all blocks of the given file
+    void delete_file(uint32_t file)
+    {
+        std::unique_lock<std::mutex> lck {write_mutex_};
+        if (level_of(file) >= level_count_.load(std::memory_order_relaxed)) { return; }
+        auto& level = *levels_[level_of(file)];
+
+        size_t end = level.end.load(std::memory_order_relaxed);
+        for (size_t base = level.begin; base < end; base += ChunkSize) {
+            auto chunk = std::atomic_load(&level.dir[slot(base)]);
+            if (!chunk) { continue; }
+
+            size_t count = std::min(size_t{ChunkSize}, end - base);
+            for (size_t i = 0; i < count; i++) {
+                if (chunk->file[i].load(std::memory_order_relaxed) == file) {
+                    chunk->file[i].store(DeletedFile, std::memory_order_relaxed);
+                    chunk->live--;
+                }
+            }
+
+            // Release full chunks without live entries
+            if (chunk->live == 0 && count == ChunkSize) {
+                std::atomic_store(&level.dir[slot(base)], std::shared_ptr<Chunk>{});
+            }
+        }
+
+        // Advance begin past released chunks
+        size_t begin = level.begin;
+        while (begin + ChunkSize <= end && !std::atomic_load(&level.dir[slot(begin)])) {
+            begin += ChunkSize;
+        }
+        level.begin.store(begin, std::memory_order_release);
+    }
+
+    /// Returns the last block of the given level inserted and not deleted; false if none
+    bool get_last_block(uint32_t level_number, uint32_t& file, uint32_t& block,
+            uint64_t& epoch)
+    {
+        std::unique_lock<std::mutex> lck {write_mutex_};
+        if (level_number >= level_count_.load(std::memory_order_relaxed)) { return false; }
+        auto& level = *levels_[level_number];
+
+        size_t begin = level.begin.load(std::memory_order_relaxed);
+        for (size_t pos = level.end.load(std::memory_order_relaxed); pos > begin; pos--) {
+            auto& chunk = level.dir[slot(pos - 1)];
+            if (!chunk || chunk->base != pos - 1 - (pos - 1) % ChunkSize) { continue; }
+            size_t i = (pos - 1) % ChunkSize;
+            uint32_t f = chunk->file[i].load(std::memory_order_relaxed);
+            if (f == DeletedFile) { continue; }
+            file = f;
+            block = chunk->block[i].load(std::memory_order_relaxed);
+            epoch = chunk->epoch[i].load(std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    /// Calls f(file, block, epoch, min, max, filter) for each block, level by level, in
+    /// insertion order
+    template <class F>
+    void for_each_block(F f)
+    {
+        std::unique_lock<std::mutex> lck {write_mutex_};
+
+        size_t count = level_count_.load(std::memory_order_relaxed);
+        for (size_t l = 0; l < count; l++) {
+            auto& level = *levels_[l];
+            size_t end = level.end.load(std::memory_order_relaxed);
+            for (size_t pos = level.begin; pos < end; pos++) {
+                auto& chunk = level.dir[slot(pos)];
+                if (!chunk || chunk->base != pos - pos % ChunkSize) { continue; }
+                size_t i = pos % ChunkSize;
+                uint32_t file = chunk->file[i].load(std::memory_order_relaxed);
+                if (file == DeletedFile) { continue; }
+                f(file, chunk->block[i].load(std::memory_order_relaxed),
+                        chunk->epoch[i].load(std::memory_order_relaxed),
+                        chunk->min[i].load(std::memory_order_relaxed),
+                        chunk->max[i].load(std::memory_order_relaxed),
+                        chunk->filter[i].get());
+            }
+        }
+    }
+
+    class FetchBlockIterator
+    {
+    public:
+        FetchBlockIterator(const MemoryLogIndex* owner, bool forward)
+            : FetchBlockIterator(owner, 0, forward)
+        {
+            all_ = true;
+        }
+
+        FetchBlockIterator(const MemoryLogIndex* owner, uint64_t key, bool forward)
+            : owner_(owner), key_(key), all_(false), forward_(forward),
+            epoch_to_(std::numeric_limits<uint64_t>::max())
+        {
+            // Snapshot of visible blocks of each level
+            size_t count = owner_->level_count_.load(std::memory_order_acquire);
+            for (size_t l = 0; l < count; l++) {
+                auto& level = *owner_->levels_[l];
+                size_t end = level.end.load(std::memory_order_acquire);
+                size_t begin = level.begin.load(std::memory_order_acquire);
+                ranges_.emplace_back(std::min(begin, end), end);
+            }
+            start_level(forward_ ? count - 1 : 0);
+        }
+
+        /// Blocks that may contain any of the given keys, which must be sorted
+        FetchBlockIterator(const MemoryLogIndex* owner,
+                std::shared_ptr<const std::vector<uint64_t>> keys, bool forward)
+            : FetchBlockIterator(owner, 0, forward)
+        {
+            keys_ = keys;
+        }
+
+        FetchBlockIterator(const MemoryLogIndex* owner, KeyRange range, bool forward)
+            : FetchBlockIterator(owner, 0, forward)
+        {
+            key_range_.reset(new KeyRange(range));
+        }
+
+        /// Blocks of the given level only
+        FetchBlockIterator(const MemoryLogIndex* owner, uint64_t key, bool forward,
+                uint32_t level)
+            : FetchBlockIterator(owner, key, forward)
+        {
+            single_level_ = true;
+            // Level not allocated yet, i.e., without blocks
+            if (level >= ranges_.size()) {
+                ranges_.assign(1, {0, 0});
+                level = 0;
+            }
+            start_level(level);
+        }
+
+        FetchBlockIterator(const MemoryLogIndex* owner, EpochRange range)
+            : FetchBlockIterator(owner, 0, true)
+        {
+            all_ = true;
+            epoch_to_ = range.to;
+            ranges_.resize(1);
+            start_level(0);
+            pos_ = level_->find_epoch(range.from, begin_, end_);
+        }
+
+        bool next(uint32_t& file, uint32_t& block)
+        {
+            while (true) {
+                if (forward_ ? pos_ >= end_ : pos_ <= begin_) {
+                    if (single_level_) { return false; }
+                    // Deeper levels hold older blocks
+                    if (forward_ ? level_number_ == 0 : level_number_ + 1 >= ranges_.size()) {
+                        return false;
+                    }
+                    start_level(forward_ ? level_number_ - 1 : level_number_ + 1);
+                    continue;
+                }
+
+                size_t pos = forward_ ? pos_ : pos_ - 1;
+                size_t base = pos - pos % ChunkSize;
+
+                if (!chunk_ || chunk_->base != base) {
+                    chunk_ = std::atomic_load(&level_->dir[owner_->slot(pos)]);
+                    if (!chunk_ || chunk_->base != base || !chunk_may_contain_key()) {
+                        // Skip whole chunk
+                        chunk_.reset();
+                        pos_ = forward_ ? base + ChunkSize : std::max(base, begin_);
+                        continue;
+                    }
+                }
+
+                size_t i = pos % ChunkSize;
+                if (chunk_->epoch[i].load(std::memory_order_relaxed) >= epoch_to_) {
+                    // Only forward iterators over level 0 have an upper epoch bound
+                    pos_ = end_;
+                    return false;
+                }
+                pos_ = forward_ ? pos_ + 1 : pos_ - 1;
+                uint32_t f = chunk_->file[i].load(std::memory_order_relaxed);
+                if (f == DeletedFile) { continue; }
+                if (block_may_contain_key(i)) {
+                    file = f;
+                    block = chunk_->block[i].load(std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+
+    private:
+        void start_level(size_t number)
+        {
+            level_number_ = number;
+            level_ = owner_->levels_[number].get();
+            begin_ = ranges_[number].first;
+            end_ = ranges_[number].second;
+            // Next position is pos_ when going forward and pos_ - 1 when going backward
+            pos_ = forward_ ? begin_ : end_;
+            chunk_.reset();
+        }
+
+        bool chunk_may_contain_key() const
+        {
+            if (all_) { return true; }
+            uint64_t min = chunk_->min_key.load(std::memory_order_relaxed);
+            uint64_t max = chunk_->max_key.load(std::memory_order_relaxed);
+            if (keys_) { return may_contain_any(*keys_, min, max, nullptr); }
+            if (key_range_) { return key_range_->lo <= max && key_range_->hi >= min; }
+            return key_ >= min && key_ <= max;
+        }
+
+        bool block_may_contain_key(size_t i) const
+        {
+            if (all_) { return true; }
+            uint64_t min = chunk_->min[i].load(std::memory_order_relaxed);
+            uint64_t max = chunk_->max[i].load(std::memory_order_relaxed);
+            const BloomFilter* filter = chunk_->filter[i].get();
+            if (keys_) { return may_contain_any(*keys_, min, max, filter); }
+            if (key_range_) { return key_range_->lo <= max && key_range_->hi >= min; }
+            return key_ >= min && key_ <= max && (!filter || filter->may_contain(key_));
+        }
+
+        const MemoryLogIndex* owner_;
+        uint64_t key_;
+        // Used instead of key_ when fetching several keys
+        std::shared_ptr<const std::vector<uint64_t>> keys_;
+        // Used instead of key_ when fetching a range of keys
+        std::unique_ptr<KeyRange> key_range_;
+        bool all_;
+        bool forward_;
+        // Whether the blocks of other levels are skipped
+        bool single_level_ = false;
+        uint64_t epoch_to_;
+        // Positions [begin, end) of the visible blocks of each level
+        std::vector<std::pair<size_t, size_t>> ranges_;
+        size_t level_number_;
+        const Level* level_;
+        size_t begin_;
+        size_t end_;
+        size_t pos_;
+        std::shared_ptr<Chunk> chunk_;
+    };
+
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(bool forward)
+    {
+        return std::unique_ptr<FetchBlockIterator>{new FetchBlockIterator{this, forward}};
+    }
+
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(uint64_t key, bool forward)
+    {
+        return std::unique_ptr<FetchBlockIterator>{new FetchBlockIterator{this, key, forward}};
+    }
+
+    /// Blocks of the given level that may contain the given key
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(uint64_t key, bool forward, uint32_t level)
+    {
+        return std::unique_ptr<FetchBlockIterator>{
+            new FetchBlockIterator{this, key, forward, level}};
+    }
+
+    /// Blocks that may contain any of the given keys, which must be sorted
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(
+            std::shared_ptr<const std::vector<uint64_t>> keys, bool forward)
+    {
+        return std::unique_ptr<FetchBlockIterator>{new FetchBlockIterator{this, keys, forward}};
+    }
+
+    /// Blocks that may contain any key of the given range
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(KeyRange range, bool forward)
+    {
+        return std::unique_ptr<FetchBlockIterator>{new FetchBlockIterator{this, range, forward}};
+    }
+
+    /// Blocks of level 0 with epochs in [epoch_from, epoch_to), in epoch order
+    std::unique_ptr<FetchBlockIterator> fetch_epochs(uint64_t epoch_from, uint64_t epoch_to)
+    {
+        return std::unique_ptr<FetchBlockIterator>{
+            new FetchBlockIterator{this, EpochRange{epoch_from, epoch_to}}};
+    }
+
+private:
+    static size_t slot(size_t pos) { return (pos / ChunkSize) % MaxChunks; }
+
+    // Allocated up to the deepest level used so far, which is published in level_count_
+    std::vector<std::unique_ptr<Level>> levels_;
+    std::atomic<size_t> level_count_;
+    std::mutex write_mutex_;
+};
+
+} // namespace fineline
+
+#endif
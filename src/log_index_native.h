@@ -0,0 +1,308 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef FINELINE_LOG_INDEX_NATIVE_H
+#define FINELINE_LOG_INDEX_NATIVE_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define BOOST_FILESYSTEM_NO_DEPRECATED
+#include <boost/filesystem.hpp>
+
+#include "options.h"
+#include "crc32c.h"
+#include "log_index_memory.h"
+
+namespace fineline {
+
+/**
+ * \brief Record of the block metadata file of NativeLogIndex.
+ *
+ * Records of type InsertFilteredBlock are followed by the Bloom filter of the block, which is
+ * covered by the record checksum.
+ */
+struct NativeIndexRecord
+{
+    enum Type : uint32_t
+    {
+        InsertBlock = 1,
+        DeleteFile = 2,
+        InsertFilteredBlock = 3
+    };
+
+    uint32_t type;
+    uint32_t checksum;
+    uint32_t file;
+    uint32_t block;
+    uint64_t epoch;
+    uint64_t min;
+    uint64_t max;
+
+    /// Size of the filter that follows the record
+    size_t payload_length() const
+    {
+        return type == InsertFilteredBlock ? sizeof(BloomFilter) : 0;
+    }
+
+    void seal(const BloomFilter* filter = nullptr)
+    {
+        checksum = 0;
+        checksum = crc32c::compute(0, this, sizeof(NativeIndexRecord));
+        if (filter) { checksum = crc32c::compute(checksum, filter, sizeof(BloomFilter)); }
+    }
+
+    bool is_valid(const BloomFilter* filter = nullptr) const
+    {
+        NativeIndexRecord copy = *this;
+        copy.seal(filter);
+        return copy.checksum == checksum
+            && (type == InsertBlock || type == DeleteFile || type == InsertFilteredBlock);
+    }
+};
+
+static_assert(sizeof(NativeIndexRecord) == 40, "Unexpected padding in NativeIndexRecord");
+
+/**
+ * \brief Log index kept in memory and persisted in an append-only block metadata file.
+ *
+ * Queries are answered by a MemoryLogIndex, which is loaded from the metadata file when the
+ * index is opened. Each insertion and deletion appends a fixed-size, checksummed record to the
+ * file. Appends are plain writes without fsync: the log files are the source of truth, so the
+ * index only has to be as durable as the operating system's write-back makes it. A crash may
+ * leave a torn record at the end of the file, which is truncated when the index is opened.
+ * Blocks with a Bloom filter are logged with the filter appended to their record.
+ *
+ * Deletions are logged as tombstone records. When the file is opened with more tombstoned than
+ * live blocks, it is rewritten with the live blocks only, using a temporary file that is then
+ * renamed into place.
+ *
+ * The metadata file is named after the log_index_path option with a ".blocks" suffix, so that
+ * log_storage recognizes it as an index file.
+ */
+class NativeLogIndex
+{
+public:
+    using FetchBlockIterator = MemoryLogIndex::FetchBlockIterator;
+
+    NativeLogIndex(const Options& options)
+        : fd_(-1)
+    {
+        namespace fs = boost::filesystem;
+        path_ = options.get<std::string>("log_index_path") + ".blocks";
+        if (options.get<bool>("log_index_path_relative")) {
+            path_ = (fs::path{options.get<std::string>("logpath")} / path_).string();
+        }
+        load();
+    }
+
+    ~NativeLogIndex()
+    {
+        if (fd_ >= 0) { ::close(fd_); }
+    }
+
+    void insert_block(uint32_t file, uint32_t block, uint64_t epoch, uint64_t min, uint64_t max,
+            const BloomFilter* filter = nullptr)
+    {
+        append(make_insert(file, block, epoch, min, max, filter), filter);
+        mem_.insert_block(file, block, epoch, min, max, filter);
+    }
+
+    void delete_file(uint32_t file)
+    {
+        append(NativeIndexRecord{NativeIndexRecord::DeleteFile, 0, file, 0, 0, 0, 0});
+        mem_.delete_file(file);
+    }
+
+    bool get_last_block(uint32_t level, uint32_t& file, uint32_t& block, uint64_t& epoch)
+    {
+        return mem_.get_last_block(level, file, block, epoch);
+    }
+
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(bool forward)
+    {
+        return mem_.fetch_blocks(forward);
+    }
+
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(uint64_t key, bool forward)
+    {
+        return mem_.fetch_blocks(key, forward);
+    }
+
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(uint64_t key, bool forward, uint32_t level)
+    {
+        return mem_.fetch_blocks(key, forward, level);
+    }
+
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(
+            std::shared_ptr<const std::vector<uint64_t>> keys, bool forward)
+    {
+        return mem_.fetch_blocks(keys, forward);
+    }
+
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(MemoryLogIndex::KeyRange range,
+            bool forward)
+    {
+        return mem_.fetch_blocks(range, forward);
+    }
+
+    std::unique_ptr<FetchBlockIterator> fetch_epochs(uint64_t epoch_from, uint64_t epoch_to)
+    {
+        return mem_.fetch_epochs(epoch_from, epoch_to);
+    }
+
+protected:
+    static NativeIndexRecord make_insert(uint32_t file, uint32_t block, uint64_t epoch,
+            uint64_t min, uint64_t max, const BloomFilter* filter)
+    {
+        auto type = filter ? NativeIndexRecord::InsertFilteredBlock
+            : NativeIndexRecord::InsertBlock;
+        return NativeIndexRecord{type, 0, file, block, epoch, min, max};
+    }
+
+    void append(NativeIndexRecord rec, const BloomFilter* filter = nullptr)
+    {
+        rec.seal(filter);
+        iovec iov[] = {
+            { &rec, sizeof(rec) },
+            { const_cast<BloomFilter*>(filter), filter ? sizeof(BloomFilter) : 0 }
+        };
+        ssize_t length = sizeof(rec) + iov[1].iov_len;
+        check(::writev(fd_, iov, 2) == length);
+    }
+
+    void load()
+    {
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+        check(fd_ >= 0);
+
+        struct stat st;
+        check(::fstat(fd_, &st) == 0);
+        std::vector<char> contents(st.st_size);
+        size_t read = 0;
+        while (read < contents.size()) {
+            auto res = ::pread(fd_, &contents[read], contents.size() - read, read);
+            check(res >= 0);
+            if (res == 0) { break; }
+            read += res;
+        }
+
+        // Records are valid up to the end of the file or to the first torn one
+        std::vector<std::pair<NativeIndexRecord, const BloomFilter*>> records;
+        size_t valid = 0;
+        while (valid + sizeof(NativeIndexRecord) <= read) {
+            NativeIndexRecord r;
+            ::memcpy(&r, &contents[valid], sizeof(r));
+            size_t length = sizeof(r) + r.payload_length();
+            if (valid + length > read) { break; }
+            auto filter = r.payload_length() > 0
+                ? reinterpret_cast<const BloomFilter*>(&contents[valid + sizeof(r)]) : nullptr;
+            if (!r.is_valid(filter)) { break; }
+            records.emplace_back(r, filter);
+            valid += length;
+        }
+        check(::ftruncate(fd_, valid) == 0);
+
+        // Count live and deleted blocks to decide whether to rewrite the file
+        std::unordered_map<uint32_t, size_t> file_blocks;
+        size_t live = 0, deleted = 0;
+        for (auto& elem : records) {
+            auto& r = elem.first;
+            if (r.type != NativeIndexRecord::DeleteFile) {
+                // Filter is copied out of the file contents, which may be unaligned
+                std::unique_ptr<BloomFilter> filter;
+                if (elem.second) {
+                    filter.reset(new BloomFilter);
+                    ::memcpy(filter.get(), elem.second, sizeof(BloomFilter));
+                }
+                mem_.insert_block(r.file, r.block, r.epoch, r.min, r.max, filter.get());
+                file_blocks[r.file]++;
+                live++;
+            }
+            else {
+                mem_.delete_file(r.file);
+                live -= file_blocks[r.file];
+                deleted += file_blocks[r.file];
+                file_blocks.erase(r.file);
+            }
+        }
+
+        if (deleted > live) { rewrite(); }
+        check(::lseek(fd_, 0, SEEK_END) >= 0);
+    }
+
+    // Rewrites the file with the live blocks of the memory index only
+    void rewrite()
+    {
+        std::string tmp_path = path_ + ".tmp";
+        int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        check(fd >= 0);
+
+        std::vector<char> contents;
+        mem_.for_each_block([&contents] (uint32_t file, uint32_t block, uint64_t epoch,
+                    uint64_t min, uint64_t max, const BloomFilter* filter)
+        {
+            auto rec = make_insert(file, block, epoch, min, max, filter);
+            rec.seal(filter);
+            auto p = reinterpret_cast<const char*>(&rec);
+            contents.insert(contents.end(), p, p + sizeof(rec));
+            if (filter) {
+                contents.insert(contents.end(), filter->data(), filter->data() + sizeof(*filter));
+            }
+        });
+        size_t length = contents.size();
+        bool ok = ::write(fd, contents.data(), length) == static_cast<ssize_t>(length)
+            && ::fsync(fd) == 0;
+        ::close(fd);
+        check(ok && ::rename(tmp_path.c_str(), path_.c_str()) == 0);
+
+        ::close(fd_);
+        fd_ = ::open(path_.c_str(), O_RDWR, 0644);
+        check(fd_ >= 0);
+    }
+
+    void check(bool ok)
+    {
+        if (!ok) {
+            throw std::runtime_error("Error accessing log index file " + path_ + ": "
+                    + ::strerror(errno));
+        }
+    }
+
+private:
+    std::string path_;
+    int fd_;
+    MemoryLogIndex mem_;
+};
+
+} // namespace fineline
+
+#endif
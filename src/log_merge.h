@@ -0,0 +1,354 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FINELINE_LOG_MERGE_H
+#define FINELINE_LOG_MERGE_H
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <stdexcept>
+#include <string>
+
+#include "options.h"
+
+namespace fineline {
+
+/**
+ * \brief Merges sorted streams of log records into a single sorted stream.
+ *
+ * Inputs are cursors with a next(key, payload) method, e.g., a log page iterator or a reader of
+ * a sorted run of log blocks, which return records in key order (i.e., by node ID and sequence
+ * number), or in reverse key order if the merger goes backward. The current record of each
+ * input is kept in a binary heap, so each record costs O(log k) comparisons of integer sort
+ * keys for k inputs.
+ *
+ * Records with equal keys are returned in the order in which their inputs were added, or in the
+ * reverse order when going backward. Inputs are thus added from oldest to newest, so that such
+ * records come out in the order in which they were logged.
+ *
+ * The payload returned by next() points into the input it came from, which is only advanced on
+ * the following call, so that it remains valid until then.
+ */
+template <class Key, class Cursor>
+class LogRecordMerger
+{
+public:
+    LogRecordMerger(bool forward = true)
+        : forward_(forward), started_(false), pending_(false)
+    {}
+
+    /// Inputs must be added before the first call to next(), which reads their first records
+    void add(std::unique_ptr<Cursor>&& input)
+    {
+        inputs_.push_back(std::move(input));
+    }
+
+    size_t input_count() const { return inputs_.size(); }
+
+    bool next(Key& key, const char*& payload)
+    {
+        if (!started_) {
+            started_ = true;
+            for (size_t i = 0; i < inputs_.size(); i++) {
+                Entry e;
+                e.input = i;
+                if (inputs_[i]->next(e.key, e.payload)) { push(e); }
+            }
+        }
+        if (pending_) {
+            // Input of the record returned last is advanced now
+            std::pop_heap(heap_.begin(), heap_.end(), Later{forward_});
+            Entry& e = heap_.back();
+            if (inputs_[e.input]->next(e.key, e.payload)) {
+                std::push_heap(heap_.begin(), heap_.end(), Later{forward_});
+            }
+            else { heap_.pop_back(); }
+            pending_ = false;
+        }
+        if (heap_.empty()) { return false; }
+
+        key = heap_.front().key;
+        payload = heap_.front().payload;
+        pending_ = true;
+        return true;
+    }
+
+private:
+    struct Entry
+    {
+        Key key;
+        const char* payload;
+        size_t input;
+    };
+
+    /*
+     * Heap order, i.e., whether a is returned after b. Records of a node are ordered by sequence
+     * number, which thus must keep growing when the node is recovered (see TxnLogger::resume).
+     */
+    struct Later
+    {
+        bool forward;
+
+        bool operator()(const Entry& a, const Entry& b) const
+        {
+            auto ka = a.key.sort_key();
+            auto kb = b.key.sort_key();
+            if (ka != kb) { return forward ? ka > kb : ka < kb; }
+            return forward ? a.input > b.input : a.input < b.input;
+        }
+    };
+
+    void push(const Entry& e)
+    {
+        heap_.push_back(e);
+        std::push_heap(heap_.begin(), heap_.end(), Later{forward_});
+    }
+
+    bool forward_;
+    // Whether the first record of each input was read
+    bool started_;
+    // Whether the record at the top of the heap was returned and its input must be advanced
+    bool pending_;
+    std::vector<std::unique_ptr<Cursor>> inputs_;
+    std::vector<Entry> heap_;
+};
+
+/**
+ * \brief Drops redundant records from the output of log merges.
+ *
+ * The log does not interpret payloads, so records can only be reduced by a reducer supplied by
+ * whoever defines them (see FileBasedLog::set_merge_reducer). keep() is called for each record
+ * of a merge pass in key order, i.e., the records of each node in the order in which they were
+ * logged, and returns whether the record goes into the output. reset() is called before each
+ * pass. A record may only be dropped if replaying the node without it gives the same result,
+ * bearing in mind that other records of the node may be in levels not taking part in the merge.
+ */
+template <class Key>
+class MergeReducer
+{
+public:
+    virtual ~MergeReducer() {}
+    virtual void reset() = 0;
+    virtual bool keep(const Key& key, const char* payload) = 0;
+};
+
+/**
+ * \brief Limits the bandwidth used by log merges.
+ *
+ * Follows the model of LogDeviceEmulator: transferring N bytes occupies the budget for
+ * N / bandwidth, and consume() blocks the caller until its transfer would have completed, so
+ * merges proceed at no more than the given rate on average. Merges are serialized, so the
+ * limiter is not thread-safe. Idle time is not accumulated into bursts.
+ */
+class MergeRateLimiter
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    MergeRateLimiter(unsigned bandwidth_mbps)
+        : bytes_per_us_(bandwidth_mbps * 1024.0 * 1024.0 / 1e6), busy_until_(Clock::now())
+    {}
+
+    void consume(size_t bytes)
+    {
+        if (bytes_per_us_ == 0) { return; }
+        auto transfer = std::chrono::microseconds{static_cast<long>(bytes / bytes_per_us_)};
+        busy_until_ = std::max(busy_until_, Clock::now()) + transfer;
+        std::this_thread::sleep_until(busy_until_);
+    }
+
+private:
+    const double bytes_per_us_;
+    Clock::time_point busy_until_;
+};
+
+/// Contents of a level of a FileBasedLog, in which level 0 only counts its sealed files
+struct LogLevelInfo
+{
+    unsigned level;
+    size_t files;
+    size_t bytes;
+    /// Sorted runs that a fetch may have to read, counting each file of level 0 as one
+    size_t runs;
+};
+
+/// Merge work that LogMergeScheduler has not caught up with
+struct MergeBacklog
+{
+    /// Levels whose score calls for a merge
+    size_t pending_levels = 0;
+    /// Bytes of those levels, i.e., roughly what the pending merges will read
+    size_t pending_bytes = 0;
+    size_t level0_files = 0;
+    /// Sorted runs over all levels, i.e., the runs read by a fetch of a node found in all of them
+    size_t read_amplification = 0;
+    size_t merges_done = 0;
+    size_t merges_failed = 0;
+};
+
+/**
+ * \brief Background thread that decides when and which levels of a log to merge.
+ *
+ * Like the file recycler of log_storage, the thread is started on the first wakeup, and the log
+ * wakes it up whenever the flusher seals a level-0 file. Each level gets a score, and the level
+ * with the highest score is merged (see FileBasedLog::merge_level) for as long as any score is
+ * at least 1. Level 0 scores its number of sealed files over log_merge_level0_files. Other
+ * levels are scored according to log_merge_strategy:
+ *
+ * - "leveled" keeps each merged level as a single sorted run, i.e., level N is merged together
+ *   with level N+1, and it scores its size over a target of log_merge_level0_files files times
+ *   log_merge_level_ratio^N. Fetches read one run per level, but data is rewritten about
+ *   log_merge_level_ratio times per level.
+ * - "tiered" appends a new run to level N+1 with each merge of level N, and level N scores its
+ *   number of runs over log_merge_level_ratio. Data is written once per level, but fetches read
+ *   up to log_merge_level_ratio runs per level.
+ *
+ * Merges transfer at most log_merge_bandwidth MB/s, so that they leave the device to the
+ * flusher. backlog() tells how far merges are behind, e.g., to raise alarms.
+ */
+template <class Log>
+class LogMergeScheduler
+{
+public:
+    LogMergeScheduler(Log* log, const Options& options)
+        : log_(log), retire_(false), wakeup_(false), merges_done_(0), merges_failed_(0)
+    {
+        auto strategy = options.get<std::string>("log_merge_strategy");
+        if (strategy != "leveled" && strategy != "tiered") {
+            throw std::runtime_error("Unknown log merge strategy: " + strategy);
+        }
+        leveled_ = strategy == "leveled";
+        level0_files_ = std::max(1u, options.get<unsigned>("log_merge_level0_files"));
+        ratio_ = std::max(2u, options.get<unsigned>("log_merge_level_ratio"));
+        file_size_ = options.get<unsigned>("log_file_size") * 1024.0 * 1024.0;
+    }
+
+    ~LogMergeScheduler()
+    {
+        retire_ = true;
+        std::unique_lock<std::mutex> lck {mutex_};
+        if (thread_) {
+            cond_.notify_one();
+            lck.unlock();
+            thread_->join();
+        }
+    }
+
+    void wakeup()
+    {
+        std::unique_lock<std::mutex> lck {mutex_};
+        if (!thread_) { thread_.reset(new std::thread {&LogMergeScheduler::run, this}); }
+        wakeup_ = true;
+        cond_.notify_one();
+    }
+
+    bool is_leveled() const { return leveled_; }
+
+    /// Level that should be merged next, or -1 if none
+    int pick_level(const std::vector<LogLevelInfo>& levels) const
+    {
+        int picked = -1;
+        double best = 1.0;
+        for (auto& l : levels) {
+            double s = score(l);
+            if (s >= best) {
+                picked = l.level;
+                best = s;
+            }
+        }
+        return picked;
+    }
+
+    double score(const LogLevelInfo& l) const
+    {
+        if (l.level == 0) { return static_cast<double>(l.files) / level0_files_; }
+        if (!leveled_) { return static_cast<double>(l.runs) / ratio_; }
+        double target = level0_files_ * file_size_ * std::pow(ratio_, l.level);
+        return l.bytes / target;
+    }
+
+    MergeBacklog backlog() const
+    {
+        MergeBacklog b;
+        for (auto& l : log_->get_levels()) {
+            if (score(l) >= 1.0) {
+                b.pending_levels++;
+                b.pending_bytes += l.bytes;
+            }
+            if (l.level == 0) { b.level0_files = l.files; }
+            b.read_amplification += l.runs;
+        }
+        b.merges_done = merges_done_;
+        b.merges_failed = merges_failed_;
+        return b;
+    }
+
+private:
+    void run()
+    {
+        while (!retire_) {
+            {
+                // Wakeups during a merge are not lost
+                std::unique_lock<std::mutex> lck {mutex_};
+                cond_.wait(lck, [this] { return wakeup_ || retire_; });
+                wakeup_ = false;
+            }
+            while (!retire_) {
+                try {
+                    int level = pick_level(log_->get_levels());
+                    if (level < 0) { break; }
+                    log_->merge_level(level, 0, leveled_);
+                    merges_done_++;
+                }
+                catch (std::exception&) {
+                    // Merge is retried on the next wakeup
+                    merges_failed_++;
+                    break;
+                }
+            }
+        }
+    }
+
+    Log* log_;
+    bool leveled_;
+    unsigned level0_files_;
+    unsigned ratio_;
+    double file_size_;
+
+    std::atomic<bool> retire_;
+    bool wakeup_;
+    std::atomic<size_t> merges_done_;
+    std::atomic<size_t> merges_failed_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::unique_ptr<std::thread> thread_;
+};
+
+} // namespace fineline
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FINELINE_LOGBLOCK_H
+#define FINELINE_LOGBLOCK_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include "crc32c.h"
+
+namespace fineline {
+
+/// Encoding of the body of a log block (see logcodec.h)
+enum class BlockCodec : uint32_t
+{
+    None = 0,  ///< Body is the log page image
+    LZ = 1,    ///< Body is a LogPageCodec encoding of the log page
+    Fenced = 2 ///< Body is a FencedPageCodec encoding, which supports partial reads
+};
+
+/**
+ * \brief Header written in front of each log page in a log file.
+ *
+ * The header makes blocks self-validating: its checksum covers the block body (i.e., the log
+ * page) as well as the header fields that follow the checksum, so that a block which was only
+ * partially written when the system crashed (a torn write) can be told apart from a valid one
+ * by looking only at the block itself.
+ *
+ * The header also describes the block contents, i.e., the epoch in which the page was flushed
+ * and the smallest and largest node ID in it, so that the log index can be rebuilt from the
+ * log files alone. Blocks written before these fields existed have them zeroed; since epochs
+ * start at 1, an epoch of zero means that the block does not describe itself.
+ *
+ * The header is padded to a cache line so that the page that follows it keeps its alignment in
+ * memory and on the device. Unused bytes are zeroed and included in the checksum, which leaves
+ * room for future fields without changing the on-disk block size.
+ *
+ * Blocks are variable-length, since a block body may be compressed, but they always start at
+ * an offset that is a multiple of Alignment. This allows finding the last valid block of a log
+ * file by looking for headers at aligned offsets only.
+ */
+struct alignas(64) LogBlockHeader
+{
+    static constexpr uint32_t Magic = 0x4b4c4246; // "FLBK"
+    static constexpr size_t HeaderSize = 64;
+    static constexpr size_t Alignment = 64;
+    /// Flag of the first block of each key range but the first of a merge (see merge_level)
+    static constexpr uint32_t PartitionStart = 1;
+
+    uint32_t magic;
+    uint32_t checksum;
+    /// Length of the block body that follows the header
+    uint32_t length;
+    BlockCodec codec;
+    /// Epoch of the page, or zero if unknown
+    uint64_t epoch;
+    /// Smallest and largest node ID of the page
+    uint64_t min_key;
+    uint64_t max_key;
+    uint32_t flags;
+    char reserved[HeaderSize - 5 * sizeof(uint32_t) - 3 * sizeof(uint64_t)];
+
+    LogBlockHeader()
+    {
+        ::memset(this, 0, sizeof(LogBlockHeader));
+    }
+
+    /// Fills in the header for the given body, which must remain unchanged until it is written.
+    /// Descriptive fields (epoch, min_key, max_key, flags) must be set before.
+    void seal(const void* body, uint32_t len, BlockCodec c = BlockCodec::None)
+    {
+        magic = Magic;
+        length = len;
+        codec = c;
+        checksum = compute_checksum(body);
+    }
+
+    uint32_t compute_checksum(const void* body) const
+    {
+        constexpr size_t covered_offset = offsetof(LogBlockHeader, length);
+        uint32_t crc = crc32c::compute(0, reinterpret_cast<const char*>(this) + covered_offset,
+                HeaderSize - covered_offset);
+        return crc32c::compute(crc, body, length);
+    }
+
+    /// Whether this header and the given body form a complete, uncorrupted block
+    bool is_valid(const void* body, size_t max_length) const
+    {
+        return magic == Magic && length <= max_length && checksum == compute_checksum(body);
+    }
+};
+
+static_assert(sizeof(LogBlockHeader) == LogBlockHeader::HeaderSize,
+        "Unexpected padding in LogBlockHeader");
+
+/// Space taken in a log file by a block with the given body length
+constexpr size_t aligned_block_size(size_t body_length)
+{
+    return (sizeof(LogBlockHeader) + body_length + LogBlockHeader::Alignment - 1)
+        / LogBlockHeader::Alignment * LogBlockHeader::Alignment;
+}
+
+} // namespace fineline
+
+#endif
@@ -0,0 +1,609 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FINELINE_LOGCODEC_H
+#define FINELINE_LOGCODEC_H
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+
+#include "lrtype.h"
+#include "logblock.h"
+
+namespace fineline {
+
+inline BlockCodec parse_block_codec(const std::string& name)
+{
+    if (name == "none") { return BlockCodec::None; }
+    if (name == "lz") { return BlockCodec::LZ; }
+    throw std::runtime_error("Unknown log block codec: " + name);
+}
+
+/*
+ * A byte-oriented LZ77 codec in the style of LZ4: the output is a sequence of (literal run,
+ * match) pairs, each introduced by a token whose 4-bit fields hold the literal length and the
+ * match length, extended with 255-valued bytes when they do not fit. Matches are found with a
+ * single-probe hash table of 4-byte sequences and refer back at most 64KB. The input always ends
+ * with a run of literals, which is how the decoder knows when to stop.
+ *
+ * Compression speed matters more than ratio here, since it runs on the flusher for every page.
+ */
+namespace lz {
+
+constexpr size_t MinMatch = 4;
+constexpr size_t MaxOffset = 65535;
+constexpr unsigned HashBits = 14;
+// No match may start in the last MatchLimit bytes nor extend into the last LastLiterals bytes
+constexpr size_t MatchLimit = 12;
+constexpr size_t LastLiterals = 5;
+
+inline uint32_t read32(const char* p)
+{
+    uint32_t v;
+    ::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - HashBits);
+}
+
+inline bool write_length(char*& op, const char* oend, size_t len)
+{
+    while (len >= 255) {
+        if (op >= oend) { return false; }
+        *op++ = static_cast<char>(255);
+        len -= 255;
+    }
+    if (op >= oend) { return false; }
+    *op++ = static_cast<char>(len);
+    return true;
+}
+
+inline bool read_length(const unsigned char*& ip, const unsigned char* iend, size_t& len)
+{
+    unsigned char b;
+    do {
+        if (ip >= iend) { return false; }
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Emits a literal run followed by a match; match_len = 0 means there is no match
+inline bool write_sequence(char*& op, const char* oend, const char* literals, size_t lit_len,
+        size_t offset, size_t match_len)
+{
+    size_t ml = match_len > 0 ? match_len - MinMatch : 0;
+
+    if (op >= oend) { return false; }
+    *op++ = static_cast<char>((std::min<size_t>(lit_len, 15) << 4) | std::min<size_t>(ml, 15));
+    if (lit_len >= 15 && !write_length(op, oend, lit_len - 15)) { return false; }
+
+    if (static_cast<size_t>(oend - op) < lit_len) { return false; }
+    ::memcpy(op, literals, lit_len);
+    op += lit_len;
+
+    if (match_len > 0) {
+        if (oend - op < 2) { return false; }
+        *op++ = static_cast<char>(offset & 0xff);
+        *op++ = static_cast<char>(offset >> 8);
+        if (ml >= 15 && !write_length(op, oend, ml - 15)) { return false; }
+    }
+    return true;
+}
+
+/// Compresses src into dest, returning the compressed length, or 0 if it exceeds capacity
+inline size_t compress(const char* src, size_t length, char* dest, size_t capacity)
+{
+    char* op = dest;
+    const char* oend = dest + capacity;
+    const char* anchor = src;
+
+    if (length > MatchLimit) {
+        std::vector<uint32_t> table(1 << HashBits, 0);
+        const char* ip = src;
+        const char* ilimit = src + length - MatchLimit;
+        const char* mlimit = src + length - LastLiterals;
+
+        while (ip < ilimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash(seq);
+            const char* ref = src + table[h];
+            table[h] = ip - src;
+
+            if (ref < ip && static_cast<size_t>(ip - ref) <= MaxOffset && read32(ref) == seq) {
+                const char* mp = ip + MinMatch;
+                const char* rp = ref + MinMatch;
+                while (mp < mlimit && *mp == *rp) { mp++; rp++; }
+
+                if (!write_sequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip)) {
+                    return 0;
+                }
+                ip = mp;
+                anchor = ip;
+            }
+            else {
+                // Skip faster over incompressible data
+                ip += 1 + ((ip - anchor) >> 6);
+            }
+        }
+    }
+
+    if (!write_sequence(op, oend, anchor, src + length - anchor, 0, 0)) { return 0; }
+    return op - dest;
+}
+
+/// Decompresses src into dest; returns false if the input is malformed or exceeds capacity
+inline bool decompress(const char* src, size_t length, char* dest, size_t capacity,
+        size_t& out_length)
+{
+    auto ip = reinterpret_cast<const unsigned char*>(src);
+    auto iend = ip + length;
+    char* op = dest;
+    const char* oend = dest + capacity;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !read_length(ip, iend, lit_len)) { return false; }
+        if (static_cast<size_t>(iend - ip) < lit_len || static_cast<size_t>(oend - op) < lit_len) {
+            return false;
+        }
+        ::memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+
+        if (ip == iend) { break; }
+
+        if (iend - ip < 2) { return false; }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > static_cast<size_t>(op - dest)) { return false; }
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !read_length(ip, iend, match_len)) { return false; }
+        match_len += MinMatch;
+        if (static_cast<size_t>(oend - op) < match_len) { return false; }
+
+        const char* ref = op - offset;
+        if (offset >= match_len) {
+            ::memcpy(op, ref, match_len);
+            op += match_len;
+        }
+        else {
+            // Overlapping match, i.e., a repeated pattern
+            for (size_t i = 0; i < match_len; i++) { *op++ = *ref++; }
+        }
+    }
+
+    out_length = op - dest;
+    return true;
+}
+
+} // namespace lz
+
+/**
+ * \brief Compact encoding of a log page, used as the body of compressed log blocks.
+ *
+ * The encoding consists of the number of records, followed by their headers and then by their
+ * payloads, compressed with the LZ codec above. Since the flusher sorts pages before writing
+ * them, consecutive headers mostly share the node ID or differ by a small amount, so headers are
+ * stored as variable-length deltas: the node ID relative to the previous record, the sequence
+ * number relative to the previous record of the same node, and then the payload length and type.
+ *
+ * Decoding rebuilds an equivalent page, i.e., one with the same records in the same order, but
+ * not necessarily a byte-for-byte copy of the original page. A codec object keeps a scratch
+ * buffer and must not be shared between threads.
+ */
+template <class LogPage>
+class LogPageCodec
+{
+public:
+    using Key = typename LogPage::Key;
+    using IdType = typename Key::IdType;
+    using SeqNumType = typename Key::SeqNumType;
+
+    static constexpr size_t PageSize = sizeof(LogPage);
+
+    LogPageCodec()
+        : scratch_{new char[PageSize]}
+    {}
+
+    /// Encodes the page into dest, returning the encoded length, or 0 if it exceeds capacity
+    size_t encode(const LogPage& page, char* dest, size_t capacity)
+    {
+        // Worst-case space taken by the header of a single record
+        constexpr size_t MaxKeyLength = 4 * MaxVarintLength;
+
+        char* op = dest;
+        const char* oend = dest + capacity;
+        if (capacity < MaxVarintLength) { return 0; }
+        put_varint(op, page.slot_count());
+
+        size_t payload_length = 0;
+        uint64_t prev_id = 0, prev_seq = 0;
+        for (size_t i = 0; i < static_cast<size_t>(page.slot_count()); i++) {
+            auto& slot = page.get_slot(i);
+            if (static_cast<size_t>(oend - op) < MaxKeyLength) { return 0; }
+
+            uint64_t id = slot.key.node_id();
+            uint64_t seq = slot.key.seq_num();
+            put_varint(op, zigzag(id - prev_id));
+            put_varint(op, zigzag(id == prev_id ? seq - prev_seq : seq));
+            put_varint(op, slot.key.length());
+            put_varint(op, static_cast<uint64_t>(slot.key.type()));
+            prev_id = id;
+            prev_seq = seq;
+
+            ::memcpy(scratch_.get() + payload_length, page.get_payload(slot.ptr),
+                    slot.key.length());
+            payload_length += slot.key.length();
+        }
+
+        size_t compressed = lz::compress(scratch_.get(), payload_length, op, oend - op);
+        if (compressed == 0) { return 0; }
+        return (op - dest) + compressed;
+    }
+
+    /// Decodes src into the given page; returns false if the encoding is malformed
+    bool decode(const char* src, size_t length, LogPage& page)
+    {
+        const char* end = src + length;
+
+        // First pass over headers only finds where the payloads start and their total length
+        const char* ip = src;
+        prev_id_ = prev_seq_ = 0;
+        uint64_t count;
+        if (!get_varint(ip, end, count)) { return false; }
+        const char* keys_begin = ip;
+
+        size_t payload_length = 0;
+        Key key;
+        for (uint64_t i = 0; i < count; i++) {
+            if (!get_key(ip, end, key)) { return false; }
+            payload_length += key.length();
+        }
+
+        size_t decompressed;
+        if (!lz::decompress(ip, end - ip, scratch_.get(), PageSize, decompressed)
+                || decompressed != payload_length)
+        {
+            return false;
+        }
+
+        // Second pass rebuilds the page
+        page.clear();
+        ip = keys_begin;
+        prev_id_ = prev_seq_ = 0;
+        const char* payload = scratch_.get();
+        for (uint64_t i = 0; i < count; i++) {
+            get_key(ip, end, key);
+            if (!page.try_insert_raw(key, payload)) { return false; }
+            payload += key.length();
+        }
+
+        return true;
+    }
+
+private:
+    static constexpr size_t MaxVarintLength = 10;
+
+    static uint64_t zigzag(uint64_t v)
+    {
+        return (v << 1) ^ -(v >> 63);
+    }
+
+    static uint64_t unzigzag(uint64_t v)
+    {
+        return (v >> 1) ^ -(v & 1);
+    }
+
+    static void put_varint(char*& op, uint64_t v)
+    {
+        while (v >= 0x80) {
+            *op++ = static_cast<char>(v | 0x80);
+            v >>= 7;
+        }
+        *op++ = static_cast<char>(v);
+    }
+
+    static bool get_varint(const char*& ip, const char* end, uint64_t& v)
+    {
+        v = 0;
+        for (unsigned shift = 0; shift < 64 && ip < end; shift += 7) {
+            uint64_t b = static_cast<unsigned char>(*ip++);
+            v |= (b & 0x7f) << shift;
+            if (b < 0x80) { return true; }
+        }
+        return false;
+    }
+
+    bool get_key(const char*& ip, const char* end, Key& key)
+    {
+        uint64_t id_delta, seq, length, type;
+        if (!get_varint(ip, end, id_delta) || !get_varint(ip, end, seq)
+                || !get_varint(ip, end, length) || !get_varint(ip, end, type))
+        {
+            return false;
+        }
+
+        uint64_t id = prev_id_ + unzigzag(id_delta);
+        seq = unzigzag(seq);
+        if (id == prev_id_) { seq += prev_seq_; }
+        prev_id_ = id;
+        prev_seq_ = seq;
+
+        key = Key {static_cast<IdType>(id), static_cast<SeqNumType>(seq),
+            static_cast<foster::LRType>(type)};
+        key.set_length(length);
+        return true;
+    }
+
+    std::unique_ptr<char[]> scratch_;
+    uint64_t prev_id_ = 0;
+    uint64_t prev_seq_ = 0;
+};
+
+/// Fixed-size part of the fence directory at the beginning of a Fenced block body
+struct FenceDirectory
+{
+    uint32_t count;
+    /// Covers records_length and the fence entries
+    uint32_t checksum;
+    uint32_t records_length;
+    uint32_t reserved;
+};
+
+/// Fence entry: the first record of a segment, i.e., of a contiguous range of records
+struct FenceEntry
+{
+    uint64_t node_id;
+    /// Offset of the segment relative to the beginning of the records
+    uint32_t offset;
+    uint32_t checksum;
+};
+
+/**
+ * \brief Encoding of a log page which allows reading the records of a single node.
+ *
+ * The records of the (sorted) page are serialized in order, each as a compact fixed-size
+ * header followed by its payload. Records are grouped into segments of roughly interval bytes,
+ * and the encoding begins with a directory with one fence entry per segment, which holds the
+ * node ID of the first record in the segment, its offset, and its checksum.
+ *
+ * A fetch for a node then only reads the directory and the segments that may contain the
+ * node's records, which are found by binary search on the fences, instead of the whole block.
+ * Since such partial reads do not cover the whole block, the block checksum cannot be verified;
+ * instead, the directory and each segment carry their own checksums.
+ *
+ * Like LogPageCodec, decoding rebuilds an equivalent page with try_insert_raw.
+ */
+template <class LogPage>
+class FencedPageCodec
+{
+public:
+    using Key = typename LogPage::Key;
+    using IdType = typename Key::IdType;
+    using SeqNumType = typename Key::SeqNumType;
+
+    static constexpr size_t RecordHeaderSize =
+        sizeof(IdType) + sizeof(SeqNumType) + sizeof(uint32_t) + sizeof(uint8_t);
+
+    FencedPageCodec(size_t interval)
+        : interval_(interval)
+    {}
+
+    /// Encodes the page into dest, returning the encoded length, or 0 if it exceeds capacity
+    size_t encode(const LogPage& page, char* dest, size_t capacity)
+    {
+        // Place fences first to find out where records begin
+        fences_.clear();
+        size_t offset = 0;
+        for (size_t i = 0; i < static_cast<size_t>(page.slot_count()); i++) {
+            auto& key = page.get_slot(i).key;
+            if (fences_.empty() || offset - fences_.back().offset >= interval_) {
+                fences_.push_back(FenceEntry{key.node_id(), static_cast<uint32_t>(offset), 0});
+            }
+            offset += RecordHeaderSize + key.length();
+        }
+
+        FenceDirectory dir;
+        ::memset(&dir, 0, sizeof(FenceDirectory));
+        dir.count = fences_.size();
+        dir.records_length = offset;
+        size_t records_begin = directory_length(dir);
+        if (records_begin + dir.records_length > capacity) { return 0; }
+
+        char* op = dest + records_begin;
+        for (size_t i = 0; i < static_cast<size_t>(page.slot_count()); i++) {
+            auto& slot = page.get_slot(i);
+            put_key(op, slot.key);
+            ::memcpy(op, page.get_payload(slot.ptr), slot.key.length());
+            op += slot.key.length();
+        }
+
+        for (size_t i = 0; i < fences_.size(); i++) {
+            auto& f = fences_[i];
+            f.checksum = crc32c::compute(0, dest + records_begin + f.offset,
+                    segment_end(dir, fences_.data(), i) - f.offset);
+        }
+        ::memcpy(dest + sizeof(FenceDirectory), fences_.data(), dir.count * sizeof(FenceEntry));
+        dir.checksum = directory_checksum(dir, dest + sizeof(FenceDirectory));
+        ::memcpy(dest, &dir, sizeof(FenceDirectory));
+
+        return records_begin + dir.records_length;
+    }
+
+    /// Decodes the whole encoding into the given page; returns false if it is malformed
+    bool decode(const char* src, size_t length, LogPage& page)
+    {
+        FenceDirectory dir;
+        if (length < sizeof(FenceDirectory)) { return false; }
+        ::memcpy(&dir, src, sizeof(FenceDirectory));
+        if (directory_length(dir) + dir.records_length != length) { return false; }
+
+        page.clear();
+        return decode_records(src + directory_length(dir), dir.records_length, page);
+    }
+
+    /// Number of bytes taken by the directory, i.e., offset of the records in the encoding
+    static size_t directory_length(const FenceDirectory& dir)
+    {
+        return sizeof(FenceDirectory) + dir.count * sizeof(FenceEntry);
+    }
+
+    /// Whether the directory is consistent with the given encoded length and not corrupt
+    static bool check_directory(const FenceDirectory& dir, const char* entries, size_t length)
+    {
+        return length >= sizeof(FenceDirectory)
+            && directory_length(dir) + dir.records_length == length
+            && dir.checksum == directory_checksum(dir, entries);
+    }
+
+    /// Finds the range [first, last) of segments that may contain records of the given node
+    static void find_segments(const FenceDirectory& dir, const char* entries, uint64_t node_id,
+            size_t& first, size_t& last)
+    {
+        // First fence with a larger node ID ends the range
+        size_t lo = 0, hi = dir.count;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (get_entry(entries, mid).node_id > node_id) { hi = mid; }
+            else { lo = mid + 1; }
+        }
+        last = lo;
+
+        // Records of the node may start in the segment of the last fence with a smaller node ID
+        lo = 0; hi = last;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (get_entry(entries, mid).node_id < node_id) { lo = mid + 1; }
+            else { hi = mid; }
+        }
+        first = lo > 0 ? lo - 1 : 0;
+        if (last == 0) { first = 0; }
+    }
+
+    /// Byte range of the given segments, relative to the beginning of the records
+    static void segment_range(const FenceDirectory& dir, const char* entries, size_t first,
+            size_t last, size_t& begin, size_t& end)
+    {
+        begin = first < last ? get_entry(entries, first).offset : 0;
+        end = first < last ? segment_end(dir, entries, last - 1) : 0;
+    }
+
+    /*
+     * Verifies and decodes the given segments into the page, which is not cleared. The records
+     * argument points to the beginning of the first segment.
+     */
+    bool decode_segments(const FenceDirectory& dir, const char* entries, size_t first,
+            size_t last, const char* records, LogPage& page)
+    {
+        size_t base = first < last ? get_entry(entries, first).offset : 0;
+        for (size_t i = first; i < last; i++) {
+            auto entry = get_entry(entries, i);
+            size_t end = segment_end(dir, entries, i);
+            if (entry.offset > end || end > dir.records_length) { return false; }
+            const char* segment = records + (entry.offset - base);
+            if (crc32c::compute(0, segment, end - entry.offset) != entry.checksum) {
+                return false;
+            }
+            if (!decode_records(segment, end - entry.offset, page)) { return false; }
+        }
+        return true;
+    }
+
+private:
+    static FenceEntry get_entry(const char* entries, size_t i)
+    {
+        FenceEntry e;
+        ::memcpy(&e, entries + i * sizeof(FenceEntry), sizeof(FenceEntry));
+        return e;
+    }
+
+    static FenceEntry get_entry(const FenceEntry* entries, size_t i)
+    {
+        return entries[i];
+    }
+
+    template <class Entries>
+    static size_t segment_end(const FenceDirectory& dir, Entries entries, size_t i)
+    {
+        return i + 1 < dir.count ? get_entry(entries, i + 1).offset : dir.records_length;
+    }
+
+    static uint32_t directory_checksum(const FenceDirectory& dir, const char* entries)
+    {
+        uint32_t crc = crc32c::compute(0, &dir.records_length, sizeof(dir.records_length));
+        return crc32c::compute(crc, entries, dir.count * sizeof(FenceEntry));
+    }
+
+    static void put_key(char*& op, const Key& key)
+    {
+        IdType id = key.node_id();
+        SeqNumType seq = key.seq_num();
+        uint32_t length = key.length();
+        uint8_t type = static_cast<uint8_t>(key.type());
+        ::memcpy(op, &id, sizeof(id)); op += sizeof(id);
+        ::memcpy(op, &seq, sizeof(seq)); op += sizeof(seq);
+        ::memcpy(op, &length, sizeof(length)); op += sizeof(length);
+        ::memcpy(op, &type, sizeof(type)); op += sizeof(type);
+    }
+
+    static bool decode_records(const char* ip, size_t length, LogPage& page)
+    {
+        const char* end = ip + length;
+        while (ip < end) {
+            if (static_cast<size_t>(end - ip) < RecordHeaderSize) { return false; }
+            IdType id;
+            SeqNumType seq;
+            uint32_t len;
+            uint8_t type;
+            ::memcpy(&id, ip, sizeof(id)); ip += sizeof(id);
+            ::memcpy(&seq, ip, sizeof(seq)); ip += sizeof(seq);
+            ::memcpy(&len, ip, sizeof(len)); ip += sizeof(len);
+            ::memcpy(&type, ip, sizeof(type)); ip += sizeof(type);
+            if (static_cast<size_t>(end - ip) < len) { return false; }
+
+            Key key {id, seq, static_cast<foster::LRType>(type)};
+            key.set_length(len);
+            if (!page.try_insert_raw(key, ip)) { return false; }
+            ip += len;
+        }
+        return true;
+    }
+
+    const size_t interval_;
+    std::vector<FenceEntry> fences_;
+};
+
+} // namespace fineline
+
+#endif
@@ -28,6 +28,8 @@
 #include <condition_variable>
 
 #include "assertions.h"
+#include "options.h"
+#include "logsort.h"
 
 namespace fineline {
 
@@ -44,8 +46,11 @@ public:
     using EpochNumber = typename Buffer<LogPage>::EpochNumber;
 
     LogFlusher(std::shared_ptr<Buffer<LogPage>> buffer,
-            std::shared_ptr<PersistentLog<LogPage>> log)
-        : buffer_(buffer), log_(log), shutdown_(false)
+            std::shared_ptr<PersistentLog<LogPage>> log,
+            const Options& options = Options{})
+        : buffer_(buffer), log_(log), shutdown_(false),
+        sorter_(options.get<unsigned>("log_sort_threads"),
+                options.get<unsigned>("log_sort_parallel_threshold"))
     {
         hardened_epoch_ = buffer->get_current_epoch();
         // Thread runs continuously -- no need for a wakeup/wait mechanism.
@@ -77,7 +82,7 @@ public:
             if (shutdown_.load()) { break; }
             if (!page) { break; }
 
-            page->sort_slots();
+            sorter_.sort(*page);
             log_->append_page(*page, epoch);
             assert<0>(hardened_epoch_ + 1 == epoch, "Log flusher missed an epoch!");
             hardened_epoch_++;
@@ -101,6 +106,7 @@ private:
     std::shared_ptr<PersistentLog<LogPage>> log_;
     std::atomic<EpochNumber> hardened_epoch_;
     std::atomic<bool> shutdown_;
+    SlotSorter<LogPage> sorter_;
 
     std::mutex mutex_;
     std::condition_variable cond_;
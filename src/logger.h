@@ -76,6 +76,17 @@ public:
         if (logit) { l->log(LRType::Construct, id); }
     }
 
+    /*
+     * Resumes logging for an object recovered from the log, whose last record had the given
+     * sequence number. Merged log levels order the records of each object by sequence number
+     * only, so sequence numbers must not start over when an object is recovered.
+     */
+    void resume(IdType id, SeqNumType seq)
+    {
+        id_ = id;
+        seq_ = seq;
+    }
+
     IdType id() { return id_; }
     SeqNumType seq_num() { return seq_; }
 
@@ -114,6 +114,17 @@ struct alignas(LogrecAlignment) LogrecHeader
     LogrecLength length() const { return length_; }
     LRType type() const { return type_; }
 
+    /*
+     * The normalized (node_id, seq_num) key as a single integer, i.e., comparing two sort keys
+     * yields the same result as cmp() below. Used by integer-based sort kernels (see logsort.h).
+     */
+    uint64_t sort_key() const
+    {
+        static_assert(sizeof(NodeId) + sizeof(SeqNum) <= sizeof(uint64_t),
+                "LogrecHeader sort key must fit in 64 bits");
+        return (static_cast<uint64_t>(node_id()) << (8 * sizeof(SeqNum))) | seq_num();
+    }
+
 private:
     static int cmp(
             const LogrecHeader<NodeId, SeqNum, LogrecLength>& a,
@@ -23,9 +23,12 @@
 #define FINELINE_LOGREC_H
 
 #include <memory>
+#include <utility>
+#include <vector>
 
 #include "lrtype.h"
 #include "logpage.h"
+#include "node_image.h"
 
 namespace fineline {
 
@@ -54,7 +57,7 @@ struct LogrecInsert : public Logrec<NodePtr>
     using Key = typename N::KeyType;
     using Value = typename N::ValueType;
 
-    LogrecInsert(NodePtr node, char* payload)
+    LogrecInsert(NodePtr node, const char* payload)
         : Logrec<NodePtr>(node)
     {
         LogEncoder<Key, Value>::decode(payload, &key, &value);
@@ -74,11 +77,46 @@ struct LogrecInsert : public Logrec<NodePtr>
     Value value;
 };
 
+/// Chunk of a node image (see NodeImage)
+template <class N, class NodePtr>
+struct LogrecImage : public Logrec<NodePtr>
+{
+    using Key = typename N::KeyType;
+    using Value = typename N::ValueType;
+
+    LogrecImage(NodePtr node, const char* payload)
+        : Logrec<NodePtr>(node), first(NodeImage<Key, Value>::is_first(payload))
+    {
+        NodeImage<Key, Value>::decode(payload, [this] (const Key& k, const Value& v) {
+            entries.emplace_back(k, v);
+        });
+    }
+
+    void redo()
+    {
+        if (first) { this->node->clear(); }
+        for (auto& e : entries) {
+            N::insert(this->node, e.first, e.second, false);
+        }
+    }
+
+    void print(std::ostream& out) const
+    {
+        out << "image entries=" << entries.size() << (first ? " first" : "");
+    }
+
+    bool first;
+    std::vector<std::pair<Key, Value>> entries;
+};
 
 template <class N, class NodePtr>
 std::unique_ptr<Logrec<NodePtr>>
-ConstructLogRec(LRType type, NodePtr node, char* payload)
+ConstructLogRec(LRType type, NodePtr node, const char* payload)
 {
+    if (type == NodeImageType) {
+        return std::unique_ptr<Logrec<NodePtr>>{new LogrecImage<N, NodePtr>(node, payload)};
+    }
+
     Logrec<NodePtr>* res = nullptr;
     switch (type) {
         case LRType::Insert: res = new LogrecInsert<N, NodePtr>(node, payload); break;
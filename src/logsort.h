@@ -0,0 +1,463 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FINELINE_LOGSORT_H
+#define FINELINE_LOGSORT_H
+
+#include <vector>
+#include <array>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "assertions.h"
+
+namespace fineline {
+
+using foster::assert;
+
+/**
+ * \brief Small pool of helper threads that execute one batch of tasks at a time.
+ *
+ * The caller of run() always executes the first task itself, so a pool created with N threads
+ * spawns only N-1 helpers. Helpers sleep on a condition variable between batches.
+ */
+class SortHelperPool
+{
+public:
+    SortHelperPool(unsigned threads)
+        : generation_(0), pending_(0), shutdown_(false)
+    {
+        for (unsigned i = 1; i < threads; i++) {
+            helpers_.emplace_back(new std::thread {&SortHelperPool::helper_loop, this, i});
+        }
+    }
+
+    ~SortHelperPool()
+    {
+        {
+            std::unique_lock<std::mutex> lck {mutex_};
+            shutdown_ = true;
+            cond_.notify_all();
+        }
+        for (auto& t : helpers_) { t->join(); }
+    }
+
+    unsigned size() const { return helpers_.size() + 1; }
+
+    /// Runs task(i) for i in [0, count) and returns when all of them have finished.
+    void run(unsigned count, std::function<void(unsigned)> task)
+    {
+        assert<1>(count <= size());
+        {
+            std::unique_lock<std::mutex> lck {mutex_};
+            task_ = task;
+            task_count_ = count;
+            pending_ = count - 1;
+            generation_++;
+            cond_.notify_all();
+        }
+
+        task(0);
+
+        std::unique_lock<std::mutex> lck {mutex_};
+        done_cond_.wait(lck, [this] { return pending_ == 0; });
+    }
+
+protected:
+    void helper_loop(unsigned id)
+    {
+        uint64_t seen = 0;
+        while (true) {
+            std::function<void(unsigned)> task;
+            {
+                std::unique_lock<std::mutex> lck {mutex_};
+                cond_.wait(lck, [this,seen] { return shutdown_ || generation_ != seen; });
+                if (shutdown_) { return; }
+                seen = generation_;
+                if (id >= task_count_) { continue; }
+                task = task_;
+            }
+
+            task(id);
+
+            std::unique_lock<std::mutex> lck {mutex_};
+            if (--pending_ == 0) { done_cond_.notify_one(); }
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<std::thread>> helpers_;
+    std::function<void(unsigned)> task_;
+    unsigned task_count_;
+    uint64_t generation_;
+    unsigned pending_;
+    bool shutdown_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::condition_variable done_cond_;
+};
+
+/**
+ * \brief Sorts the slots of a log page on the (node_id, seq_num) key of its log record headers.
+ *
+ * Instead of the comparison sort of foster::SlotArray::sort_slots(), which compares normalized
+ * keys with memcmp, this class extracts each key as a 64-bit integer (see
+ * LogrecHeader::sort_key()) and sorts (key, slot number) pairs with an LSD radix sort using 8-bit
+ * digits. Digits that are equal in all keys (e.g., the high bytes of node IDs and sequence
+ * numbers) are detected from the histograms and skipped, so a typical page needs only 4-5
+ * passes. Slots are then permuted once into their final position. Payloads are never moved.
+ *
+ * For large pages, the pairs can be split into contiguous chunks which are sorted in parallel by
+ * a pool of helper threads and then merged pairwise. Scratch buffers are kept across invocations,
+ * so a sorter should be reused for every page, e.g., by the log flusher thread.
+ *
+ * Transactions sort their private logs at commit time (see TxnPrivateLog), so a page in the log
+ * buffer is a concatenation of sorted runs, one per commit. Run boundaries are found while
+ * extracting the keys, and the runs are merged in a single pass with a tree of losers instead of
+ * radix sorted, however many there are. With helper threads, the key space is split into
+ * ranges that are merged in parallel. A page that consists of a single run (e.g., a large
+ * transaction that filled a whole page) is not touched at all. Only pages whose runs are too
+ * short to be commit groups, e.g., of single-record transactions, are radix sorted.
+ */
+template <class LogPage>
+class SlotSorter
+{
+public:
+    using Slot = typename LogPage::Slot;
+    using SlotNumber = typename LogPage::SlotNumber;
+
+    struct SortEntry
+    {
+        uint64_t key;
+        uint32_t slot;
+
+        friend bool operator<(const SortEntry& a, const SortEntry& b) { return a.key < b.key; }
+    };
+
+    static constexpr size_t RadixBits = 8;
+    static constexpr size_t RadixBuckets = 1 << RadixBits;
+    static constexpr size_t RadixPasses = sizeof(uint64_t) * 8 / RadixBits;
+    // Below this many slots, std::sort on the extracted keys beats the histogram overhead
+    static constexpr size_t MinRadixSlots = 64;
+    // Below this average run length, a page is essentially unsorted and radix sorting beats merging
+    static constexpr size_t MinMergeRunLength = 8;
+    // Keys sampled per helper thread to pick the boundaries of parallel merge ranges
+    static constexpr size_t MergeSamplesPerThread = 16;
+
+    SlotSorter(unsigned threads = 1, size_t parallel_threshold = 0)
+        : parallel_threshold_(parallel_threshold)
+    {
+        if (threads > 1) { pool_.reset(new SortHelperPool{threads}); }
+    }
+
+    void sort(LogPage& page)
+    {
+        size_t count = page.slot_count();
+        if (count < 2) { return; }
+
+        entries_.resize(count);
+        chunk_begin_.assign(1, 0);
+        for (size_t i = 0; i < count; i++) {
+            entries_[i] = SortEntry{page.get_slot(i).key.sort_key(), static_cast<uint32_t>(i)};
+            if (i > 0 && entries_[i].key < entries_[i-1].key) {
+                chunk_begin_.push_back(i);
+            }
+        }
+
+        unsigned runs = chunk_begin_.size();
+        if (runs == 1) { return; }
+
+        if (count / runs >= MinMergeRunLength) {
+            chunk_begin_.push_back(count);
+            merge_runs(count, runs);
+        }
+        else {
+            unsigned chunks = 1;
+            if (pool_ && count >= parallel_threshold_) {
+                chunks = std::min<size_t>(pool_->size(), count / MinRadixSlots);
+            }
+
+            if (chunks <= 1) {
+                sort_entries(entries_.data(), count, scratch_);
+            }
+            else {
+                sort_parallel(count, chunks);
+            }
+        }
+
+        permute_slots(page, count);
+        assert<3>(page.slots_are_sorted());
+    }
+
+protected:
+
+    static void sort_entries(SortEntry* entries, size_t count, std::vector<SortEntry>& scratch)
+    {
+        if (count < MinRadixSlots) {
+            std::sort(entries, entries + count);
+            return;
+        }
+
+        // Compute histograms of all digits in a single pass
+        std::array<std::array<uint32_t, RadixBuckets>, RadixPasses> hist;
+        for (auto& h : hist) { h.fill(0); }
+        for (size_t i = 0; i < count; i++) {
+            uint64_t key = entries[i].key;
+            for (size_t p = 0; p < RadixPasses; p++) {
+                hist[p][(key >> (p * RadixBits)) & (RadixBuckets - 1)]++;
+            }
+        }
+
+        scratch.resize(count);
+        SortEntry* src = entries;
+        SortEntry* dest = scratch.data();
+
+        for (size_t p = 0; p < RadixPasses; p++) {
+            auto& h = hist[p];
+            size_t shift = p * RadixBits;
+
+            // Skip digit if it is the same for all keys
+            if (h[(src[0].key >> shift) & (RadixBuckets - 1)] == count) { continue; }
+
+            // Turn histogram into exclusive prefix sums, i.e., bucket offsets
+            uint32_t sum = 0;
+            for (auto& c : h) {
+                uint32_t tmp = c;
+                c = sum;
+                sum += tmp;
+            }
+
+            for (size_t i = 0; i < count; i++) {
+                dest[h[(src[i].key >> shift) & (RadixBuckets - 1)]++] = src[i];
+            }
+            std::swap(src, dest);
+        }
+
+        if (src != entries) {
+            std::copy(src, src + count, entries);
+        }
+    }
+
+    void sort_parallel(size_t count, unsigned chunks)
+    {
+        chunk_scratch_.resize(chunks);
+        chunk_begin_.resize(chunks + 1);
+        for (unsigned c = 0; c <= chunks; c++) {
+            chunk_begin_[c] = count * c / chunks;
+        }
+
+        pool_->run(chunks, [this](unsigned c) {
+            sort_entries(entries_.data() + chunk_begin_[c], chunk_begin_[c+1] - chunk_begin_[c],
+                    chunk_scratch_[c]);
+        });
+
+        merge_chunks(count, chunks);
+    }
+
+    /*
+     * Merges the sorted ranges of entries_ delimited by chunk_begin_ pairwise until a single run
+     * is left. Pairs of each round are distributed across helper threads, if there are any.
+     */
+    void merge_chunks(size_t count, unsigned chunks)
+    {
+        merged_.resize(count);
+        SortEntry* src = entries_.data();
+        SortEntry* dest = merged_.data();
+        unsigned threads = pool_ ? pool_->size() : 1;
+
+        while (chunks > 1) {
+            unsigned pairs = (chunks + 1) / 2;
+            auto merge_pairs = [&](unsigned t) {
+                for (unsigned pr = t; pr < pairs; pr += threads) {
+                    size_t b = chunk_begin_[2*pr];
+                    size_t m = chunk_begin_[std::min(2*pr + 1, chunks)];
+                    size_t e = chunk_begin_[std::min(2*pr + 2, chunks)];
+                    std::merge(src + b, src + m, src + m, src + e, dest + b);
+                }
+            };
+
+            if (threads > 1 && pairs > 1) {
+                pool_->run(std::min(pairs, threads), merge_pairs);
+            }
+            else {
+                merge_pairs(0);
+            }
+
+            for (unsigned pr = 0; pr < pairs; pr++) {
+                chunk_begin_[pr] = chunk_begin_[2*pr];
+            }
+            chunk_begin_[pairs] = count;
+            chunks = pairs;
+            std::swap(src, dest);
+        }
+
+        if (src != entries_.data()) {
+            std::copy(src, src + count, entries_.data());
+        }
+    }
+
+    /*
+     * Merges the sorted runs of entries_ delimited by chunk_begin_ into merged_ and swaps the two.
+     * With helper threads, keys sampled from the whole page are used to split the key space into
+     * one range per thread. The part of each run in a range is found by binary search, so each
+     * thread merges its range from all runs into its own section of the output.
+     */
+    void merge_runs(size_t count, unsigned runs)
+    {
+        merged_.resize(count);
+        unsigned threads = pool_ && count >= parallel_threshold_
+            ? std::min<size_t>(pool_->size(), count / MinRadixSlots) : 1;
+        if (threads < 1) { threads = 1; }
+
+        // Range t covers keys in [splitters_[t], splitters_[t+1]); the last one has no upper bound
+        splitters_.clear();
+        if (threads > 1) {
+            size_t samples = threads * MergeSamplesPerThread;
+            for (size_t i = 0; i < samples; i++) {
+                splitters_.push_back(entries_[i * count / samples].key);
+            }
+            std::sort(splitters_.begin(), splitters_.end());
+            for (unsigned t = 1; t < threads; t++) {
+                splitters_[t] = splitters_[t * MergeSamplesPerThread];
+            }
+            splitters_.resize(threads);
+        }
+
+        // range_begin_[t * runs + r] is where range t starts in run r
+        range_begin_.resize((threads + 1) * runs);
+        for (unsigned r = 0; r < runs; r++) {
+            const SortEntry* b = entries_.data() + chunk_begin_[r];
+            const SortEntry* e = entries_.data() + chunk_begin_[r+1];
+            range_begin_[r] = chunk_begin_[r];
+            for (unsigned t = 1; t < threads; t++) {
+                range_begin_[t * runs + r] = std::lower_bound(b, e, SortEntry{splitters_[t], 0})
+                    - entries_.data();
+            }
+            range_begin_[threads * runs + r] = chunk_begin_[r+1];
+        }
+
+        merge_scratch_.resize(threads);
+        auto merge_range = [this, runs](unsigned t) {
+            size_t out = 0;
+            for (unsigned r = 0; r < runs; r++) {
+                out += range_begin_[t * runs + r] - chunk_begin_[r];
+            }
+            merge_loser_tree(entries_.data(), &range_begin_[t * runs], &range_begin_[(t+1) * runs],
+                    runs, merged_.data() + out, merge_scratch_[t]);
+        };
+
+        if (threads > 1) {
+            pool_->run(threads, merge_range);
+        }
+        else {
+            merge_range(0);
+        }
+
+        std::swap(entries_, merged_);
+    }
+
+    struct MergeScratch
+    {
+        std::vector<size_t> head;
+        std::vector<unsigned> tree;
+        std::vector<unsigned> winner;
+    };
+
+    /*
+     * Merges the sorted ranges [begin[r], end[r]) of src into dest with a tree of losers. Leaf r
+     * holds the head of range r and each inner node the range that lost the match played there.
+     * Once the head of the overall winner is output, only the matches on the path from its leaf
+     * to the root are replayed, so every entry costs log2(runs) comparisons. Ties are won by the
+     * earlier range, which keeps the merge stable.
+     */
+    static void merge_loser_tree(const SortEntry* src, const size_t* begin, const size_t* end,
+            unsigned runs, SortEntry* dest, MergeScratch& scratch)
+    {
+        auto& head = scratch.head;
+        auto& tree = scratch.tree;
+        auto& winner = scratch.winner;
+        head.assign(begin, begin + runs);
+        tree.resize(runs);
+        winner.resize(2 * runs);
+
+        auto wins = [&](unsigned a, unsigned b) {
+            if (head[a] == end[a]) { return false; }
+            if (head[b] == end[b]) { return true; }
+            uint64_t ka = src[head[a]].key;
+            uint64_t kb = src[head[b]].key;
+            return ka < kb || (ka == kb && a < b);
+        };
+
+        // Play all matches bottom-up, with leaf r at position runs + r of the winner array
+        for (unsigned r = 0; r < runs; r++) { winner[runs + r] = r; }
+        for (unsigned n = runs - 1; n > 0; n--) {
+            unsigned a = winner[2*n], b = winner[2*n + 1];
+            bool a_wins = wins(a, b);
+            winner[n] = a_wins ? a : b;
+            tree[n] = a_wins ? b : a;
+        }
+        unsigned w = runs > 1 ? winner[1] : 0;
+
+        size_t total = 0;
+        for (unsigned r = 0; r < runs; r++) { total += end[r] - begin[r]; }
+
+        for (size_t i = 0; i < total; i++) {
+            dest[i] = src[head[w]++];
+            for (unsigned n = (runs + w) / 2; n > 0; n /= 2) {
+                if (wins(tree[n], w)) { std::swap(tree[n], w); }
+            }
+        }
+    }
+
+    void permute_slots(LogPage& page, size_t count)
+    {
+        // Slots are over-aligned (see LogrecAlignment), so they are copied as raw bytes
+        slots_.resize(count * sizeof(Slot));
+        ::memcpy(slots_.data(), &page.get_slot(0), count * sizeof(Slot));
+        for (size_t i = 0; i < count; i++) {
+            ::memcpy(&page.get_slot(i), &slots_[entries_[i].slot * sizeof(Slot)], sizeof(Slot));
+        }
+    }
+
+private:
+    size_t parallel_threshold_;
+    std::unique_ptr<SortHelperPool> pool_;
+
+    std::vector<SortEntry> entries_;
+    std::vector<SortEntry> scratch_;
+    std::vector<SortEntry> merged_;
+    std::vector<char> slots_;
+    std::vector<std::vector<SortEntry>> chunk_scratch_;
+    std::vector<size_t> chunk_begin_;
+    std::vector<uint64_t> splitters_;
+    std::vector<size_t> range_begin_;
+    std::vector<MergeScratch> merge_scratch_;
+};
+
+} // namespace fineline
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FINELINE_NODE_IMAGE_H
+#define FINELINE_NODE_IMAGE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lrtype.h"
+#include "logpage.h"
+
+namespace fineline {
+
+/*
+ * Log record type of node images. LRType is defined by foster-btree, so images take a value at
+ * the end of its range, which foster does not use.
+ */
+constexpr LRType NodeImageType = static_cast<LRType>(0x7f);
+
+/**
+ * \brief Log records that hold the whole state of a node, i.e., a node image.
+ *
+ * Recovering a node only requires the records from its newest image on (see
+ * NodeHistoryIterator), so logging an image every so many updates bounds the time to recover
+ * a node regardless of its age. An image is logged in chunks of at most ChunkSize bytes of
+ * encoded entries, so that it fits in log pages of any size. Each chunk is a record of type
+ * NodeImageType whose payload holds flags, which tell whether it is the first chunk of the
+ * image, and the key-value pairs of the chunk.
+ */
+template <class K, class V>
+struct NodeImage
+{
+    static constexpr size_t ChunkSize = 4096;
+    static constexpr uint8_t FirstChunk = 1;
+
+    /// Logs an image of the entries in [begin, end), which are key-value pairs
+    template <class Logger, class Iter>
+    static void log(Logger& logger, Iter begin, Iter end)
+    {
+        uint8_t flags = FirstChunk;
+        std::string chunk;
+        for (auto it = begin; it != end; ++it) {
+            size_t length = LogEncoder<K, V>::get_payload_length(it->first, it->second);
+            if (!chunk.empty() && chunk.size() + length > ChunkSize) {
+                logger.log(NodeImageType, flags, chunk);
+                flags = 0;
+                chunk.clear();
+            }
+            size_t offset = chunk.size();
+            chunk.resize(offset + length);
+            LogEncoder<K, V>::encode(&chunk[offset], it->first, it->second);
+        }
+        // Image of an empty node still has its first chunk
+        if (!chunk.empty() || flags == FirstChunk) { logger.log(NodeImageType, flags, chunk); }
+    }
+
+    /// Whether the chunk held by the given payload is the first one of its image
+    static bool is_first(const char* payload)
+    {
+        uint8_t flags;
+        LogEncoder<uint8_t>::decode(payload, &flags);
+        return flags & FirstChunk;
+    }
+
+    /// Calls f(key, value) for each entry in the chunk held by the given payload
+    template <class F>
+    static void decode(const char* payload, F f)
+    {
+        uint8_t flags;
+        std::string chunk;
+        LogEncoder<uint8_t, std::string>::decode(payload, &flags, &chunk);
+        const char* p = chunk.data();
+        const char* end = p + chunk.size();
+        while (p < end) {
+            K key;
+            V value;
+            LogEncoder<K, V>::decode(p, &key, &value);
+            p += LogEncoder<K, V>::get_payload_length(key, value);
+            f(key, value);
+        }
+    }
+};
+
+/// Whether the given record begins a node image, from which a node can be recovered
+template <class LogrecHeader>
+bool is_image_start(const LogrecHeader& hdr, const char* payload)
+{
+    // Flags precede the entries, so the types of the latter do not matter here
+    return hdr.type() == NodeImageType && NodeImage<int, int>::is_first(payload);
+}
+
+/**
+ * \brief Iterates over the log records of a node from its newest image on, in log order.
+ *
+ * The log is read backward until the first chunk of the newest image, and no further (see
+ * FileBasedLog::fetch), so the records of older images and of the updates before them are
+ * not read at all. Records are copied as they are read, since log iterators only keep their
+ * current block in memory, and then returned in the opposite order. If the node has no image,
+ * this reads its whole history, like a forward fetch.
+ */
+template <class Log>
+class NodeHistoryIterator
+{
+public:
+    using LogKey = typename Log::LogKey;
+
+    NodeHistoryIterator(Log& log, uint64_t id)
+    {
+        auto iter = log.fetch(id, false, &is_image_start<LogKey>);
+        LogKey hdr;
+        const char* payload;
+        while (iter->next(hdr, payload)) {
+            records_.push_back(Record{hdr, payloads_.size()});
+            payloads_.append(payload, hdr.length());
+        }
+        pos_ = records_.size();
+    }
+
+    bool next(LogKey& hdr, const char*& payload)
+    {
+        if (pos_ == 0) { return false; }
+        auto& r = records_[--pos_];
+        hdr = r.hdr;
+        payload = payloads_.data() + r.offset;
+        return true;
+    }
+
+private:
+    struct Record
+    {
+        LogKey hdr;
+        size_t offset;
+    };
+
+    std::vector<Record> records_;
+    std::string payloads_;
+    size_t pos_;
+};
+
+template <class Log>
+std::unique_ptr<NodeHistoryIterator<Log>> fetch_history(Log& log, uint64_t id)
+{
+    return std::unique_ptr<NodeHistoryIterator<Log>>{new NodeHistoryIterator<Log>{log, id}};
+}
+
+} // namespace fineline
+
+#endif
@@ -37,16 +37,85 @@ void Options::init_description(popt::options_description& opt)
         ("format", popt::value<bool>()->default_value(false)->implicit_value(true),
          "Whether to format the log, deleting all existing log files or blocks")
         ("log_recycle", popt::value<bool>()->default_value(false)->implicit_value(true),
-         "Whether to clean-up log by deleting old files/partitions")
+         "Whether to recycle log files in the background once node images cover them "
+         "(see FileBasedLog::set_image_epoch)")
         /* File-based log (legacy::log_storage) options */
         ("log_file_size", popt::value<unsigned>()->default_value(1024),
          "Maximum size of a log file (in MB)")
+        ("log_level_paths", popt::value<string>()->default_value(""),
+         "Comma-separated directories of merged log levels 1, 2, ... (the last one holds all "
+         "deeper levels); level 0, the manifest, and the index stay in logpath")
+        ("log_level_file_sizes", popt::value<string>()->default_value(""),
+         "Comma-separated maximum sizes (in MB) of the files of merged log levels 1, 2, ... "
+         "(the last one applies to all deeper levels; default is log_file_size)")
         ("log_max_files", popt::value<unsigned>()->default_value(0),
          "Maximum number of log files to maintain (0 = unlimited)")
+        ("log_volatile", popt::value<bool>()->default_value(false)->implicit_value(true),
+         "Keep log files in memory only, up to log_max_files files (appends fail when full)")
+        ("log_index", popt::value<string>()->default_value("auto"),
+         "Log index implementation: native, sqlite, memory, or auto (memory if log is "
+         "volatile, native otherwise)")
+        ("log_max_open_files", popt::value<unsigned>()->default_value(64),
+         "Maximum number of log files kept open for reading (0 = unlimited)")
         ("log_index_path", popt::value<string>()->default_value("index.db"),
          "Path to log index file")
         ("log_index_path_relative", popt::value<bool>()->default_value(true),
          "Whether log index path is relative to logpath or absolute")
+        ("log_index_rebuild", popt::value<bool>()->default_value(false)->implicit_value(true),
+         "Discard the log index files in logpath and rebuild the index from the log files")
+        ("log_index_rebuild_threads", popt::value<unsigned>()->default_value(4),
+         "Number of log files scanned in parallel when (re)building the log index")
+        ("log_index_cache", popt::value<bool>()->default_value(true),
+         "Keep the metadata of all blocks of the SQLite log index in memory and answer "
+         "fetches from it")
+        ("log_index_batch_interval", popt::value<unsigned>()->default_value(10),
+         "Interval in ms at which SQLite log index insertions are committed in batches "
+         "(0 = commit each insertion synchronously)")
+        ("log_verify_checksums", popt::value<bool>()->default_value(true),
+         "Whether to verify the checksum of each log block read from a log file")
+        ("log_compression", popt::value<string>()->default_value("none"),
+         "Codec used to compress log blocks: none or lz")
+        ("log_fence_interval", popt::value<unsigned>()->default_value(0),
+         "Size in bytes of the segments of uncompressed log blocks that can be read individually "
+         "by fetches (0 = blocks are always read whole)")
+        ("log_bloom_filters", popt::value<bool>()->default_value(true),
+         "Store a Bloom filter of the node IDs of each log block in the log index, so that "
+         "fetches skip blocks that do not contain the node")
+        ("log_merge_fan_in", popt::value<unsigned>()->default_value(64),
+         "Maximum number of sorted runs merged in one pass when merging log files into the "
+         "next level; more runs are merged in several passes")
+        ("log_merge_partitions", popt::value<unsigned>()->default_value(1),
+         "Number of node-ID ranges of about equal size into which the output of a log merge is "
+         "split, each in its own files, so that ranges can be fetched in parallel")
+        ("log_merge_strategy", popt::value<string>()->default_value("none"),
+         "Strategy of the background merges of log files: none (no background merges), "
+         "leveled (one sorted run per level), or tiered (several runs per level)")
+        ("log_merge_level0_files", popt::value<unsigned>()->default_value(4),
+         "Number of sealed level-0 log files that triggers a background merge")
+        ("log_merge_level_ratio", popt::value<unsigned>()->default_value(10),
+         "Size ratio between consecutive levels (leveled), or number of runs per level (tiered)")
+        ("log_merge_bandwidth", popt::value<unsigned>()->default_value(0),
+         "Maximum bandwidth of the reads and writes of log merges (in MB/s, 0 = unlimited)")
+        ("log_read_mmap", popt::value<bool>()->default_value(false)->implicit_value(true),
+         "Read log blocks in place from memory-mapped log files instead of copying them")
+        /* Log device emulation options (see log_device.h) */
+        ("log_device", popt::value<string>()->default_value("native"),
+         "Log device to emulate: native (no emulation), nvme, sata, netdisk, or emulated")
+        ("log_device_write_latency", popt::value<unsigned>()->default_value(0),
+         "Latency of each log block write in an emulated log device (in us)")
+        ("log_device_sync_latency", popt::value<unsigned>()->default_value(0),
+         "Latency of each sync in an emulated log device (in us)")
+        ("log_device_bandwidth", popt::value<unsigned>()->default_value(0),
+         "Write bandwidth of an emulated log device (in MB/s, 0 = unlimited)")
+        ("log_device_jitter", popt::value<unsigned>()->default_value(0),
+         "Maximum deviation of emulated latencies from their configured value (in %)")
+        ("log_device_fsync", popt::value<bool>()->default_value(false)->implicit_value(true),
+         "Whether log files are still synced when an emulated log device is used")
+        /* Log flusher options */
+        ("log_sort_threads", popt::value<unsigned>()->default_value(1),
+         "Number of threads used to sort each log page before it is flushed")
+        ("log_sort_parallel_threshold", popt::value<unsigned>()->default_value(8192),
+         "Minimum number of log records in a page for the sort to use helper threads")
     ;
 }
 
@@ -22,41 +22,83 @@
 #ifndef FINELINE_PERSISTENT_MAP_H
 #define FINELINE_PERSISTENT_MAP_H
 
+#include <set>
 #include <stdexcept>
 
 #include "lrtype.h"
 #include "logpage.h"
+#include "node_image.h"
+#include "log_merge.h"
 
 namespace fineline {
 namespace map {
 
+/// Logs an image of the whole map, from which it can be recovered without older records
+template <
+    class Map,
+    class Logger
+>
+void log_image(const Map& map, Logger& logger)
+{
+    using K = typename Map::key_type;
+    using V = typename Map::mapped_type;
+    NodeImage<K, V>::log(logger, map.begin(), map.end());
+}
+
+/*
+ * Inserts into a map since its last image, which the owner of the map keeps along with it. An
+ * image of the map is logged after every interval inserts, so that recovering the map replays
+ * fewer inserts than that after the image. Each image holds the whole map, so the interval
+ * should grow with the map, e.g., stay above its size. An interval of zero disables images.
+ */
+struct ImageCounter
+{
+    ImageCounter(size_t interval = 0) : interval(interval), inserts(0) {}
+
+    size_t interval;
+    size_t inserts;
+};
+
+/// Inserts into the map and logs the insert, followed by an image of the map if one is due
 template <
     class Map,
     class Logger
 >
 void insert(Map& map, Logger& logger,
         const typename Map::key_type& key,
-        const typename Map::mapped_type& value)
+        const typename Map::mapped_type& value,
+        ImageCounter* images = nullptr)
 {
     map.insert(std::make_pair(key, value));
     logger.log(LRType::Insert, key, value);
+    if (images && images->interval > 0 && ++images->inserts >= images->interval) {
+        log_image(map, logger);
+        images->inserts = 0;
+    }
 }
 
 template <
     class Map,
     class LogrecHeader
 >
-void redo(Map& map, const LogrecHeader& hdr, char* payload)
+void redo(Map& map, const LogrecHeader& hdr, const char* payload)
 {
     using K = typename Map::key_type;
     using V = typename Map::mapped_type;
 
+    // Image replaces whatever was replayed before it
+    if (hdr.type() == NodeImageType) {
+        if (NodeImage<K, V>::is_first(payload)) { map.clear(); }
+        NodeImage<K, V>::decode(payload,
+                [&map] (const K& k, const V& v) { map.insert(std::make_pair(k, v)); });
+        return;
+    }
+
     K key;
     V value;
-    LogEncoder<K, V>::decode(payload, &key, &value);
-
     switch (hdr.type()) {
         case LRType::Insert:
+            LogEncoder<K, V>::decode(payload, &key, &value);
             map.insert(std::make_pair(key, value));
             break;
         case LRType::Construct:
@@ -72,20 +114,82 @@ template <
     class Map,
     class Logger
 >
-void recover(Map& map, Logger&, typename Logger::IdType id)
+void recover(Map& map, Logger& logger, typename Logger::IdType id)
 {
-    // TODO: This is where it gets interesting!
+    // Replay starts from the newest image of the map, if any
     auto log = Logger::SysEnv::log;
-    auto iter = log->fetch(id);
+    auto iter = fetch_history(*log, id);
 
     typename Logger::LogrecHeader hdr;
-    char* payload;
+    const char* payload;
+    typename Logger::SeqNumType seq = 0;
 
     while (iter->next(hdr, payload)) {
         redo(map, hdr, payload);
+        seq = hdr.seq_num();
     }
+
+    // New records follow the recovered ones
+    logger.resume(id, seq);
 }
 
+/**
+ * \brief Drops inserts of keys already inserted into the same map from merged log levels.
+ *
+ * Maps are recovered by replaying inserts with std::map::insert, which leaves existing keys
+ * untouched, so the first insert of each key determines its value, and later inserts of the
+ * key are superseded. Since there are no deletions, this holds regardless of where the earlier
+ * insert is, so the reducer drops any insert of a key that it has seen before for the same
+ * map. Keys are tracked from the last image of the map on, since recovery replays from there.
+ *
+ * This assumes that all Insert records of the log are logged by insert() with the key and
+ * value types of Map. Records of other types are kept.
+ */
+template <
+    class Map,
+    class LogKey
+>
+class InsertReducer : public MergeReducer<LogKey>
+{
+public:
+    using K = typename Map::key_type;
+    using V = typename Map::mapped_type;
+
+    InsertReducer() : has_node_(false), node_(0) {}
+
+    void reset() override
+    {
+        keys_.clear();
+        has_node_ = false;
+    }
+
+    bool keep(const LogKey& hdr, const char* payload) override
+    {
+        // Records of each map are adjacent
+        if (!has_node_ || hdr.node_id() != node_) {
+            keys_.clear();
+            has_node_ = true;
+            node_ = hdr.node_id();
+        }
+
+        if (is_image_start(hdr, payload)) {
+            keys_.clear();
+            return true;
+        }
+        if (hdr.type() != LRType::Insert) { return true; }
+
+        K key;
+        V value;
+        LogEncoder<K, V>::decode(payload, &key, &value);
+        return keys_.insert(key).second;
+    }
+
+private:
+    bool has_node_;
+    typename LogKey::IdType node_;
+    std::set<K> keys_;
+};
+
 } // namespace fineline
 } // namespace fineline
 
@@ -82,11 +82,18 @@ public:
     template <class LogBuffer, class RetType>
     void insert_into_buffer(LogBuffer* buffer, RetType& ret)
     {
+        /*
+         * Records are sorted here, on the committing thread, which would otherwise just be
+         * waiting for the flusher. Each inserted page then becomes a sorted run in the log buffer,
+         * so that the flusher can merge runs instead of sorting the whole page (see SlotSorter).
+         */
         if (!has_overflown_) {
+            page_.sort_slots();
             ret = buffer->insert(page_);
         }
         else {
             for (auto p : overflow_.get_page_list()) {
+                p->sort_slots();
                 ret = buffer->insert(*p);
             }
         }
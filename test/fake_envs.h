@@ -50,7 +50,7 @@ public:
         log_buffer = std::make_shared<LogBuffer>();
         log = std::make_shared<PersistentLog>(options);
         commit_buffer = std::make_shared<CommitBuffer>(log_buffer);
-        log_flusher = std::make_shared<LogFlusher>(log_buffer, log);
+        log_flusher = std::make_shared<LogFlusher>(log_buffer, log, options);
     }
 
     static std::shared_ptr<CommitBuffer> commit_buffer;
@@ -28,10 +28,14 @@
 #include <vector>
 #include <map>
 #include <mutex>
+#include <functional>
 #include <stdexcept>
+#include <cstring>
+#include <sys/uio.h>
 
 #include "options.h"
 #include "legacy/lsn.h"
+#include "bloom_filter.h"
 
 namespace fineline {
 namespace test {
@@ -60,33 +64,56 @@ public:
     using FileHighNumber = uint16_t;
     using FileLowNumber = uint16_t;
 
+    struct FakeLogFile;
+    using LogFile = FakeLogFile;
+
     struct FakeLogFile
     {
         FakeLogFile()
         {
         }
 
-        void open_for_read() {};
         void open_for_append() {};
 
-        void read(BlockOffset i, void* dest)
+        /*
+         * Each block is kept in its own fixed-size page, and offsets are computed as if all
+         * blocks were of maximum size, so that reads may still address any byte range.
+         */
+        void read(BlockOffset offset, void* dest, size_t length)
         {
-            if (vector_.size() <= i) {
+            size_t i = offset / PageSize;
+            size_t within = offset % PageSize;
+            if (vector_.size() <= i || within + length > PageSize) {
                 throw std::runtime_error("Invalid offset");
             }
-            std::memcpy(dest, &vector_.data()[i], PageSize);
+            std::memcpy(dest, vector_[i].data() + within, length);
         }
 
-        BlockOffset append(const void* src)
+        BlockOffset append(const iovec* iov, int iovcnt, bool /* sync */ = true)
         {
             std::lock_guard<TASLock> lck(lock_);
             vector_.emplace_back();
             BlockOffset i = vector_.size() - 1;
-            std::memcpy(&vector_.data()[i], src, PageSize);
+            char* dest = vector_[i].data();
+            for (int k = 0; k < iovcnt; k++) {
+                std::memcpy(dest, iov[k].iov_base, iov[k].iov_len);
+                dest += iov[k].iov_len;
+            }
 
-            return i;
+            return i * PageSize;
+        }
+
+        // Blocks are not contiguous, so they can only be copied with read()
+        std::shared_ptr<const char> map_for_read(size_t)
+        {
+            throw std::runtime_error("Fake log file does not support mapped reads");
         }
 
+        size_t get_size() { return vector_.size() * PageSize; }
+
+        void sync() {}
+        void destroy() {}
+
         FileNumber num() { return 0; }
 
         std::vector<Page> vector_;
@@ -111,11 +138,37 @@ public:
         return get_file(FileNumber{num, 0});
     }
 
-    std::shared_ptr<FakeLogFile> get_file(FileNumber num)
+    std::shared_ptr<FakeLogFile> get_file(FileNumber num) const
     {
         return files_[num.hi()];
     }
 
+    // Fake files are never deleted
+    void set_deletion_callback(std::function<void(FileNumber)>) {}
+    void retire_files(const std::vector<FileNumber>&) {}
+    void delete_files(const std::vector<FileNumber>&) {}
+    void set_recycle_callback(std::function<void()>) {}
+    void wakeup_recycler() {}
+    void stop_recycler() {}
+
+    // Fake files are not persistent, so there is never anything to recover
+    std::vector<FileNumber> list_files(FileHighNumber) const { return {}; }
+    std::vector<FileHighNumber> list_levels() const { return {}; }
+
+    // Files are not merged, since all blocks of a level are kept in a single file
+    size_t get_file_size(FileHighNumber = 0) const { return 0; }
+
+    std::shared_ptr<FakeLogFile> create_merge_file(FileHighNumber)
+    {
+        throw std::runtime_error("Fake log files cannot be merged");
+    }
+
+    void commit_merge(const std::vector<std::shared_ptr<FakeLogFile>>&,
+            const std::vector<FileNumber>&)
+    {
+        throw std::runtime_error("Fake log files cannot be merged");
+    }
+
 protected:
     std::array<std::shared_ptr<FakeLogFile>, MaxLevels> files_;
 };
@@ -128,15 +181,20 @@ public:
 
     void insert_block(
             uint32_t /* file */,
-            uint32_t /* block */,
+            uint32_t block,
             uint64_t /* epoch */,
             uint64_t min,
-            uint64_t max
+            uint64_t max,
+            const BloomFilter* /* filter */ = nullptr
     )
     {
-        blocks_.emplace_back(min, max);
+        blocks_.push_back(BlockEntry{min, max, block});
     }
 
+    void delete_file(uint32_t /* file */) {}
+
+    bool get_last_block(uint32_t, uint32_t&, uint32_t&, uint64_t&) { return false; }
+
     class FetchBlockIterator
     {
     public:
@@ -153,9 +211,9 @@ public:
         {
             auto& vec = owner_->blocks_;
             while (!pos_on_end()) {
-                if (key_ >= vec[pos_].first && key_ <= vec[pos_].second) {
+                if (key_ >= vec[pos_].min && key_ <= vec[pos_].max) {
                     file = 1;
-                    block = pos_;
+                    block = vec[pos_].block;
                     advance_pos();
                     return true;
                 }
@@ -180,8 +238,22 @@ public:
         return std::unique_ptr<FetchBlockIterator>{new FetchBlockIterator{this, key, forward}};
     }
 
+    // Without merges, all blocks are in level 0
+    std::unique_ptr<FetchBlockIterator> fetch_blocks(uint64_t key, bool forward,
+            uint32_t /* level */)
+    {
+        return fetch_blocks(key, forward);
+    }
+
 protected:
-    std::vector<std::pair<uint64_t, uint64_t>> blocks_;
+    struct BlockEntry
+    {
+        uint64_t min;
+        uint64_t max;
+        uint32_t block;
+    };
+
+    std::vector<BlockEntry> blocks_;
 };
 
 } // namespace test
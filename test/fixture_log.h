@@ -0,0 +1,231 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef FINELINE_TEST_FIXTURE_LOG_H
+#define FINELINE_TEST_FIXTURE_LOG_H
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <cstring>
+
+#include "fineline.h"
+#include "fixture_tempfile.h"
+
+namespace fineline {
+namespace test {
+
+using TestLog = DftPersistentLogTemp<DftLogPage>;
+using TestLogFile = legacy::log_file<TestLog::BlockSize>;
+constexpr size_t BlockSize = TestLog::BlockSize;
+
+// Fills a sorted page with records of a few nodes, each carrying a textual payload
+inline void fill_page(DftLogPage& page, unsigned first_id, unsigned last_id)
+{
+    page.clear();
+    for (unsigned seq = 1; ; seq++) {
+        for (unsigned id = first_id; id <= last_id; id++) {
+            DftLogrecHeader hdr {id, seq, foster::LRType::Insert};
+            std::string payload = "node " + std::to_string(id) + " update " + std::to_string(seq);
+            if (!page.try_insert(hdr, payload)) {
+                page.sort_slots();
+                return;
+            }
+        }
+    }
+}
+
+// Copies the records of the given node into dest
+inline void filter_node(const DftLogPage& src, DftLogPage& dest, unsigned id)
+{
+    dest.clear();
+    for (int i = 0; i < src.slot_count(); i++) {
+        auto& slot = src.get_slot(i);
+        if (slot.key.node_id() == id) {
+            ASSERT_TRUE(dest.try_insert_raw(slot.key,
+                        reinterpret_cast<const char*>(src.get_payload(slot.ptr))));
+        }
+    }
+}
+
+inline void check_equal(const DftLogPage& a, const DftLogPage& b)
+{
+    ASSERT_EQ(a.slot_count(), b.slot_count());
+    for (int i = 0; i < a.slot_count(); i++) {
+        auto& sa = a.get_slot(i);
+        auto& sb = b.get_slot(i);
+        ASSERT_EQ(sa.key, sb.key);
+        ASSERT_EQ(sa.key.length(), sb.key.length());
+        ASSERT_EQ(sa.key.type(), sb.key.type());
+        ASSERT_EQ(0, ::memcmp(a.get_payload(sa.ptr), b.get_payload(sb.ptr), sa.key.length()));
+    }
+}
+
+/*
+ * Fixture of the tests of the file-based log, which is opened in a temporary directory with the
+ * options given by the members below
+ */
+class LogFixture : public TmpDirFixture
+{
+protected:
+    Options make_options(bool format)
+    {
+        Options options;
+        options.set("logpath", get_temp_dir());
+        options.set("format", format);
+        options.set("log_compression", codec_);
+        options.set("log_read_mmap", mmap_);
+        options.set("log_fence_interval", fence_interval_);
+        options.set("log_index", index_);
+        options.set("log_file_size", file_size_);
+        return options;
+    }
+
+    // Appends one page per node ID, with records of that node only
+    void append_pages(unsigned first, unsigned last, bool format)
+    {
+        TestLog log {make_options(format)};
+        std::unique_ptr<DftLogPage> page {new DftLogPage};
+        for (unsigned id = first; id <= last; id++) {
+            fill_page(*page, id, id);
+            log.append_page(*page, id);
+        }
+    }
+
+    size_t recovered_size()
+    {
+        TestLogFile file {get_temp_dir(), TestLogFile::FileNumber{0, 1}};
+        return file.get_size();
+    }
+
+    std::string file_path()
+    {
+        TestLogFile file {get_temp_dir(), TestLogFile::FileNumber{0, 1}};
+        return file.make_log_name();
+    }
+
+    void corrupt_byte(size_t offset)
+    {
+        std::fstream f {file_path(), std::ios::in | std::ios::out | std::ios::binary};
+        f.seekg(offset);
+        char c = f.get();
+        f.seekp(offset);
+        f.put(c ^ 0x01);
+    }
+
+    // Checks that each page appended by append_pages can be fetched back
+    void check_pages(unsigned first, unsigned last)
+    {
+        std::unique_ptr<DftLogPage> expected {new DftLogPage};
+        std::unique_ptr<DftLogPage> fetched {new DftLogPage};
+        TestLog log {make_options(false)};
+        for (unsigned id = first; id <= last; id++) {
+            fill_page(*expected, id, id);
+            fetched->clear();
+
+            auto iter = log.fetch(id);
+            DftLogrecHeader hdr;
+            const char* payload;
+            while (iter->next(hdr, payload)) {
+                ASSERT_TRUE(fetched->try_insert_raw(hdr, payload));
+            }
+            check_equal(*expected, *fetched);
+        }
+    }
+
+    using Records = std::map<unsigned, std::vector<std::string>>;
+
+    static void collect(TestLog::LogFileIterator& iter, Records& records)
+    {
+        DftLogrecHeader hdr;
+        const char* payload;
+        while (iter.next(hdr, payload)) {
+            records[hdr.node_id()].emplace_back(payload, hdr.length());
+        }
+    }
+
+    // Appends pages with records of the same nodes, whose sequence numbers continue across pages
+    void append_history(TestLog& log, unsigned first_epoch, unsigned last_epoch)
+    {
+        append_history(log, first_epoch, last_epoch,
+            [] (DftLogPage& page, DftLogrecHeader& hdr) {
+                std::string payload = "node " + std::to_string(hdr.node_id()) + " update "
+                    + std::to_string(hdr.seq_num());
+                return page.try_insert(hdr, payload);
+            });
+    }
+
+    // Same, but each record is inserted by the given function, which returns false if the
+    // page is full
+    template <class Insert>
+    void append_history(TestLog& log, unsigned first_epoch, unsigned last_epoch, Insert insert)
+    {
+        std::unique_ptr<DftLogPage> page {new DftLogPage};
+        seq_.resize(nodes_ + 1, 0);
+        for (unsigned i = first_epoch; i <= last_epoch; i++) {
+            page->clear();
+            bool full = false;
+            while (!full) {
+                for (unsigned id = 1; id <= nodes_ && !full; id++) {
+                    DftLogrecHeader hdr {id, seq_[id] + 1, foster::LRType::Insert};
+                    full = !insert(*page, hdr);
+                    if (!full) { seq_[id]++; }
+                }
+            }
+            page->sort_slots();
+            log.append_page(*page, i);
+        }
+    }
+
+    // Waits for a file to be deleted, e.g., by the recycler thread; false if it never is
+    static bool wait_deleted(const fs::path& file)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (fs::exists(file) && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return !fs::exists(file);
+    }
+
+    Records fetch_all(TestLog& log, bool forward)
+    {
+        Records records;
+        for (unsigned id = 1; id <= nodes_; id++) { collect(*log.fetch(id, forward), records); }
+        return records;
+    }
+
+    std::string codec_ = "none";
+    bool mmap_ = false;
+    unsigned fence_interval_ = 0;
+    std::string index_ = "auto";
+    unsigned file_size_ = 1024;
+    unsigned nodes_ = 20;
+    std::vector<unsigned> seq_;
+};
+
+} // namespace test
+} // namespace fineline
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define ENABLE_TESTING
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <thread>
+
+#include "fineline.h"
+
+using namespace fineline;
+
+void make_plog(DftLogPage& plog)
+{
+    plog.clear();
+    DftLogrecHeader hdr {1, 1, foster::LRType::Insert};
+    plog.try_insert(hdr, std::string{"value"});
+}
+
+TEST(TestCommitBuffer, EpochOfCurrentPage)
+{
+    auto buffer = std::make_shared<DftLogBuffer>();
+    DftCommitBuffer commit_buffer {buffer};
+    std::unique_ptr<DftLogPage> plog {new DftLogPage};
+    make_plog(*plog);
+
+    // Groups commit with the epoch of the page they are copied into. The timeout policy may
+    // release a page at any time, so a group may share the page of the previous one or not,
+    // but it never commits with an older epoch, nor with one not yet produced.
+    auto epoch = commit_buffer.insert(*plog);
+    EXPECT_GT(epoch, 0u);
+    EXPECT_LE(epoch, buffer->get_current_epoch());
+    auto second_epoch = commit_buffer.insert(*plog);
+    EXPECT_GE(second_epoch, epoch);
+    EXPECT_LE(second_epoch, buffer->get_current_epoch());
+
+    // Timeout policy releases the page, so that the next group goes into a new one without
+    // releasing it itself, and must not commit with the epoch of the previous group
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{10};
+    while (buffer->get_current_epoch() == second_epoch
+            && std::chrono::steady_clock::now() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+    auto released_epoch = buffer->get_current_epoch();
+    ASSERT_GT(released_epoch, second_epoch);
+    auto next_epoch = commit_buffer.insert(*plog);
+    EXPECT_GE(next_epoch, released_epoch);
+    EXPECT_LE(next_epoch, buffer->get_current_epoch());
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -23,6 +23,7 @@
 
 #include <gtest/gtest.h>
 #include <cstring>
+#include <vector>
 #include <sqlite3.h>
 
 #include "options.h"
@@ -37,11 +38,10 @@ protected:
     virtual void SetUp()
     {
         fineline::test::TmpDirFixture::SetUp();
-        fineline::Options options;
-        options.set("logpath", get_temp_dir());
-        options.set("log_index_path", string{DBFile});
-        options.set("log_index_path_relative", true);
-        log_ = new fineline::legacy::SQLiteLogIndex {options};
+        options_.set("logpath", get_temp_dir());
+        options_.set("log_index_path", string{DBFile});
+        options_.set("log_index_path_relative", true);
+        log_ = new fineline::legacy::SQLiteLogIndex {options_};
     }
 
     virtual void TearDown()
@@ -50,6 +50,17 @@ protected:
         fineline::test::TmpDirFixture::TearDown();
     }
 
+    // Returns the (file, block) pairs fetched for the given key
+    std::vector<std::pair<uint32_t, uint32_t>> fetch(uint64_t key)
+    {
+        std::vector<std::pair<uint32_t, uint32_t>> result;
+        uint32_t file, block;
+        auto iter = log_->fetch_blocks(key, true);
+        while (iter->next(file, block)) { result.emplace_back(file, block); }
+        return result;
+    }
+
+    fineline::Options options_;
     fineline::legacy::SQLiteLogIndex* log_;
 };
 
@@ -95,6 +106,33 @@ TEST_F(TestSQLite, InsertionTest)
     EXPECT_EQ(i, 3);
 }
 
+TEST_F(TestSQLite, CachedFetch)
+{
+    log_->insert_block(1, 1, 1, 10, 20);
+    log_->insert_block(1, 2, 2, 15, 25);
+    log_->insert_block(2, 1, 3, 10, 30);
+    log_->delete_file(3);
+
+    using Blocks = std::vector<std::pair<uint32_t, uint32_t>>;
+    Blocks first {{1, 1}, {2, 1}};
+    Blocks second {{1, 2}, {2, 1}};
+    EXPECT_EQ(fetch(12), first);
+    EXPECT_EQ(fetch(22), second);
+
+    // Cache is loaded from the database, and queries without cache give the same results
+    for (bool cache : {false, true}) {
+        delete log_;
+        options_.set("log_index_cache", cache);
+        log_ = new fineline::legacy::SQLiteLogIndex {options_};
+        EXPECT_EQ(fetch(12), first);
+        EXPECT_EQ(fetch(22), second);
+    }
+
+    // Deletions are reflected in the cache
+    log_->delete_file(1);
+    EXPECT_EQ(fetch(12), (Blocks{{2, 1}}));
+}
+
 int main(int argc, char **argv)
 {
     ::testing::InitGoogleTest(&argc, argv);
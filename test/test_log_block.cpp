@@ -0,0 +1,294 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define ENABLE_TESTING
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <iterator>
+
+#include "fixture_log.h"
+
+using namespace fineline;
+using namespace fineline::test;
+
+class TestLogBlock : public LogFixture {};
+
+TEST_F(TestLogBlock, TornTail)
+{
+    append_pages(1, 3, true);
+    EXPECT_EQ(recovered_size(), 3 * BlockSize);
+
+    // Leftover of an incomplete append is trimmed
+    fs::resize_file(file_path(), 3 * BlockSize + BlockSize / 2);
+    EXPECT_EQ(recovered_size(), 3 * BlockSize);
+
+    // Full-sized block with a bad checksum is trimmed as well
+    corrupt_byte(2 * BlockSize + sizeof(LogBlockHeader) + 100);
+    EXPECT_EQ(recovered_size(), 2 * BlockSize);
+
+    // Next append overwrites the torn block
+    append_pages(4, 4, false);
+    EXPECT_EQ(recovered_size(), 3 * BlockSize);
+
+    // Torn first block leaves an empty file
+    fs::resize_file(file_path(), BlockSize / 2);
+    EXPECT_EQ(recovered_size(), 0u);
+
+    // File without any block, e.g., in the format that preceded block headers, is not
+    // overwritten
+    std::ofstream{file_path(), std::ios::binary | std::ios::trunc} << std::string(BlockSize, 'x');
+    EXPECT_THROW(recovered_size(), std::runtime_error);
+}
+
+TEST_F(TestLogBlock, ChecksumMismatchOnRead)
+{
+    append_pages(1, 2, true);
+    corrupt_byte(sizeof(LogBlockHeader) + 100);
+
+    TestLog log {make_options(false)};
+    DftLogrecHeader hdr;
+    const char* payload;
+
+    auto iter = log.fetch(2);
+    EXPECT_TRUE(iter->next(hdr, payload));
+    EXPECT_EQ(hdr.node_id(), 2u);
+    EXPECT_THROW(log.fetch(1), std::runtime_error);
+}
+
+TEST_F(TestLogBlock, EmulatedDevice)
+{
+    auto options = make_options(true);
+    options.set("log_device", std::string{"emulated"});
+    options.set("log_device_sync_latency", 2000u);
+
+    TestLog log {options};
+    std::unique_ptr<DftLogPage> page {new DftLogPage};
+    fill_page(*page, 1, 1);
+
+    auto begin = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < 3; i++) { log.append_page(*page, i); }
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+    EXPECT_GE(elapsed, std::chrono::microseconds{3 * 2000});
+}
+
+TEST_F(TestLogBlock, Compressed)
+{
+    codec_ = "lz";
+    append_pages(1, 3, true);
+
+    // Blocks are smaller than a page, and tail detection works with variable-length blocks
+    size_t size = recovered_size();
+    EXPECT_LT(size, BlockSize);
+    fs::resize_file(file_path(), size + 100);
+    EXPECT_EQ(recovered_size(), size);
+
+    check_pages(1, 3);
+}
+
+TEST_F(TestLogBlock, MappedReads)
+{
+    mmap_ = true;
+    append_pages(1, 3, true);
+    check_pages(1, 3);
+
+    {
+        // Pages remain valid while the file grows
+        TestLog log {make_options(false)};
+        DftLogrecHeader hdr;
+        const char* payload;
+        auto iter = log.scan([] (const DftLogrecHeader&) { return true; });
+        ASSERT_TRUE(iter->next(hdr, payload));
+        std::string first {payload, hdr.length()};
+
+        std::unique_ptr<DftLogPage> page {new DftLogPage};
+        fill_page(*page, 4, 4);
+        for (unsigned i = 0; i < 100; i++) { log.append_page(*page, 100 + i); }
+        EXPECT_EQ(first, std::string(payload, hdr.length()));
+    }
+
+    // Compressed blocks are decoded from the mapping
+    codec_ = "lz";
+    append_pages(5, 6, false);
+    check_pages(5, 6);
+
+    // Corruption is still detected
+    corrupt_byte(sizeof(LogBlockHeader) + 100);
+    TestLog log {make_options(false)};
+    EXPECT_THROW(log.fetch(1), std::runtime_error);
+}
+
+TEST_F(TestLogBlock, MappedPastEnd)
+{
+    // Index points past the end of a sealed file, which is within its mapping
+    mmap_ = true;
+    file_size_ = 1;
+    index_ = "native";
+    { TestLog log {make_options(true)}; }
+    {
+        NativeLogIndex index {make_options(false)};
+        index.insert_block(TestLogFile::FileNumber(0, 1).data(), 2 * 1024 * 1024, 1000, 1, 1);
+    }
+    append_pages(1, 1024 * 1024 / BlockSize + 10, false);
+
+    TestLog log {make_options(false)};
+    Records records;
+    EXPECT_THROW(collect(*log.fetch(1), records), std::runtime_error);
+}
+
+TEST_F(TestLogBlock, Fenced)
+{
+    fence_interval_ = 512;
+    std::unique_ptr<DftLogPage> page {new DftLogPage};
+    std::unique_ptr<DftLogPage> expected {new DftLogPage};
+    std::unique_ptr<DftLogPage> fetched {new DftLogPage};
+
+    for (bool mmap : {false, true}) {
+        mmap_ = mmap;
+        {
+            TestLog log {make_options(true)};
+            for (unsigned i = 0; i < 3; i++) {
+                fill_page(*page, 10 * i + 1, 10 * i + 10);
+                log.append_page(*page, i);
+            }
+        }
+
+        TestLog log {make_options(false)};
+        for (unsigned id : {1, 5, 10, 11, 25, 30}) {
+            fill_page(*page, (id - 1) / 10 * 10 + 1, (id - 1) / 10 * 10 + 10);
+            filter_node(*page, *expected, id);
+            fetched->clear();
+
+            auto iter = log.fetch(id);
+            DftLogrecHeader hdr;
+            const char* payload;
+            while (iter->next(hdr, payload)) {
+                ASSERT_TRUE(fetched->try_insert_raw(hdr, payload));
+            }
+            check_equal(*expected, *fetched);
+        }
+
+        // Scans read whole blocks
+        unsigned count = 0;
+        DftLogrecHeader hdr;
+        const char* payload;
+        auto iter = log.scan([] (const DftLogrecHeader&) { return true; });
+        while (iter->next(hdr, payload)) { count++; }
+        EXPECT_GT(count, 0u);
+    }
+}
+
+TEST_F(TestLogBlock, Volatile)
+{
+    auto options = make_options(true);
+    options.set("log_volatile", true);
+    options.set("log_max_files", 2u);
+    options.set("log_file_size", 1u);
+
+    // Enough pages to fill several files, which are recycled as soon as they are complete
+    const unsigned count = 3 * (1024 * 1024 / BlockSize);
+    TestLog log {options};
+    std::unique_ptr<DftLogPage> page {new DftLogPage};
+    for (unsigned id = 1; id <= count; id++) {
+        fill_page(*page, id, id);
+        log.recycle(id);
+        log.append_page(*page, id);
+    }
+    EXPECT_TRUE(fs::is_empty(get_temp_dir()));
+
+    DftLogrecHeader hdr;
+    const char* payload;
+    EXPECT_FALSE(log.fetch(1)->next(hdr, payload));
+    auto iter = log.fetch(count);
+    ASSERT_TRUE(iter->next(hdr, payload));
+    EXPECT_EQ(hdr.node_id(), count);
+
+    // Full scans see the remaining pages in order, in both directions
+    for (bool forward : {true, false}) {
+        auto scan = log.scan([] (const DftLogrecHeader&) { return true; }, forward);
+        unsigned last = forward ? 0 : count + 1;
+        unsigned pages = 0;
+        while (scan->next(hdr, payload)) {
+            if (hdr.node_id() != last) {
+                EXPECT_TRUE(forward ? hdr.node_id() > last : hdr.node_id() < last);
+                last = hdr.node_id();
+                pages++;
+            }
+        }
+        EXPECT_GT(pages, 0u);
+        EXPECT_LE(pages, 2 * (1024 * 1024 / BlockSize));
+    }
+
+    // Without recycling, appends fail once the files exceed the memory bound
+    EXPECT_THROW({
+        for (unsigned id = count + 1; id <= 2 * count; id++) {
+            fill_page(*page, id, id);
+            log.append_page(*page, id);
+        }
+    }, std::runtime_error);
+    iter = log.fetch(count);
+    ASSERT_TRUE(iter->next(hdr, payload));
+    EXPECT_EQ(hdr.node_id(), count);
+}
+
+TEST_F(TestLogBlock, VolatileExtPage)
+{
+    // Blocks of 1MB pages do not fit in a 1MB file, which must then hold a single block
+    using ExtTestLog = DftPersistentLogTemp<ExtLogPage>;
+    auto options = make_options(true);
+    options.set("log_volatile", true);
+    options.set("log_max_files", 2u);
+    options.set("log_file_size", 1u);
+
+    auto cwd_entries = [] {
+        auto cwd = fs::current_path();
+        return std::distance(fs::directory_iterator{cwd}, fs::directory_iterator{});
+    };
+    auto entries = cwd_entries();
+
+    ExtTestLog log {options};
+    std::unique_ptr<ExtLogPage> page {new ExtLogPage};
+    for (unsigned id = 1; id <= 3; id++) {
+        page->clear();
+        DftLogrecHeader hdr {id, 1, foster::LRType::Insert};
+        ASSERT_TRUE(page->try_insert(hdr, id));
+        log.recycle(id - 1);
+        log.append_page(*page, id);
+    }
+    EXPECT_TRUE(fs::is_empty(get_temp_dir()));
+    EXPECT_EQ(cwd_entries(), entries);
+
+    // Only the files of the last two pages are kept, since the first one was recycled
+    DftLogrecHeader hdr;
+    const char* payload;
+    EXPECT_FALSE(log.fetch(1)->next(hdr, payload));
+    for (unsigned id : {2, 3}) {
+        auto iter = log.fetch(id);
+        ASSERT_TRUE(iter->next(hdr, payload));
+        EXPECT_EQ(hdr.node_id(), id);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
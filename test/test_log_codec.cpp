@@ -0,0 +1,169 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define ENABLE_TESTING
+
+#include <gtest/gtest.h>
+#include <random>
+#include <vector>
+
+#include "fixture_log.h"
+
+using namespace fineline;
+using namespace fineline::test;
+
+TEST(TestCRC32C, KnownValue)
+{
+    const char* str = "123456789";
+    EXPECT_EQ(crc32c::compute(0, str, 9), 0xe3069283);
+    EXPECT_EQ(crc32c::compute_sw(0, str, 9), 0xe3069283);
+    // checksums can be computed incrementally
+    EXPECT_EQ(crc32c::compute(crc32c::compute(0, str, 4), str + 4, 5), 0xe3069283);
+}
+
+TEST(TestCRC32C, MatchesSoftware)
+{
+    std::mt19937 gen;
+    std::vector<unsigned char> buffer(3 * crc32c::LongBlock * 4);
+    for (auto& c : buffer) { c = gen(); }
+
+    // Cover unaligned starts as well as the long and short 3-way loops
+    for (size_t len : {0ul, 7ul, 100ul, 3 * crc32c::ShortBlock, 3 * crc32c::LongBlock + 13,
+            buffer.size() - 3})
+    {
+        for (size_t start : {0, 1, 3}) {
+            EXPECT_EQ(crc32c::compute(0, &buffer[start], len),
+                    crc32c::compute_sw(0, &buffer[start], len));
+        }
+    }
+}
+
+TEST(TestLogCodec, LZRoundTrip)
+{
+    std::mt19937 gen;
+    std::string random(10000, 0);
+    for (auto& c : random) { c = gen(); }
+    std::string text;
+    while (text.size() < 100000) { text += "update record " + std::to_string(text.size()); }
+
+    for (auto& input : {std::string{}, std::string{"abc"}, std::string(1000, 'x'), random, text}) {
+        std::vector<char> compressed(input.size() + input.size() / 255 + 16);
+        size_t clen = lz::compress(input.data(), input.size(), compressed.data(),
+                compressed.size());
+        ASSERT_GT(clen, 0u);
+
+        std::vector<char> output(input.size());
+        size_t dlen;
+        ASSERT_TRUE(lz::decompress(compressed.data(), clen, output.data(), output.size(), dlen));
+        ASSERT_EQ(dlen, input.size());
+        ASSERT_TRUE(std::equal(output.begin(), output.end(), input.begin()));
+    }
+
+    // Output does not fit
+    std::vector<char> small(100);
+    EXPECT_EQ(0u, lz::compress(random.data(), random.size(), small.data(), small.size()));
+}
+
+TEST(TestLogCodec, PageRoundTrip)
+{
+    std::unique_ptr<DftLogPage> page {new DftLogPage};
+    std::unique_ptr<DftLogPage> decoded {new DftLogPage};
+    std::vector<char> buffer(sizeof(DftLogPage));
+    LogPageCodec<DftLogPage> codec;
+
+    fill_page(*page, 1, 5);
+    size_t length = codec.encode(*page, buffer.data(), buffer.size());
+    ASSERT_GT(length, 0u);
+    EXPECT_LT(length, sizeof(DftLogPage) / 2);
+
+    ASSERT_TRUE(codec.decode(buffer.data(), length, *decoded));
+    check_equal(*page, *decoded);
+
+    // Truncated input is rejected
+    EXPECT_FALSE(codec.decode(buffer.data(), length / 2, *decoded));
+}
+
+TEST(TestLogCodec, FencedPartialDecode)
+{
+    std::unique_ptr<DftLogPage> page {new DftLogPage};
+    std::unique_ptr<DftLogPage> decoded {new DftLogPage};
+    std::unique_ptr<DftLogPage> expected {new DftLogPage};
+    std::vector<char> buffer(sizeof(DftLogPage));
+    using Codec = FencedPageCodec<DftLogPage>;
+    Codec codec {256};
+
+    fill_page(*page, 1, 20);
+    size_t length = codec.encode(*page, buffer.data(), buffer.size());
+    ASSERT_GT(length, 0u);
+    ASSERT_TRUE(codec.decode(buffer.data(), length, *decoded));
+    check_equal(*page, *decoded);
+
+    FenceDirectory dir;
+    ::memcpy(&dir, buffer.data(), sizeof(FenceDirectory));
+    const char* entries = buffer.data() + sizeof(FenceDirectory);
+    const char* records = buffer.data() + Codec::directory_length(dir);
+    ASSERT_TRUE(Codec::check_directory(dir, entries, length));
+    EXPECT_GT(dir.count, 1u);
+
+    for (unsigned id : {1, 7, 20}) {
+        size_t first, last, begin, end;
+        Codec::find_segments(dir, entries, id, first, last);
+        Codec::segment_range(dir, entries, first, last, begin, end);
+        EXPECT_LT(end - begin, dir.records_length / 2);
+
+        decoded->clear();
+        ASSERT_TRUE(codec.decode_segments(dir, entries, first, last, records + begin,
+                    *decoded));
+        // Segments may hold records of neighboring nodes, which fetches filter out
+        filter_node(*page, *expected, id);
+        std::unique_ptr<DftLogPage> filtered {new DftLogPage};
+        filter_node(*decoded, *filtered, id);
+        check_equal(*expected, *filtered);
+    }
+
+    // Nodes outside the page have no segments
+    size_t first, last;
+    Codec::find_segments(dir, entries, 0, first, last);
+    EXPECT_EQ(first, last);
+
+    // Corrupt segments are detected
+    buffer[Codec::directory_length(dir) + 10] ^= 1;
+    decoded->clear();
+    EXPECT_FALSE(codec.decode_segments(dir, entries, 0, 1, records, *decoded));
+}
+
+TEST(TestBloomFilter, FalsePositives)
+{
+    BloomFilter filter;
+    for (uint64_t id = 1; id <= 1000; id++) { filter.add(id); }
+    unsigned positives = 0;
+    for (uint64_t id = 1; id <= 1000; id++) {
+        EXPECT_TRUE(filter.may_contain(id));
+        if (filter.may_contain(id + 1000)) { positives++; }
+    }
+    EXPECT_LT(positives, 50u);
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,300 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define ENABLE_TESTING
+
+#include <gtest/gtest.h>
+#include <set>
+
+#include "fixture_log.h"
+
+using namespace fineline;
+using namespace fineline::test;
+
+class TestLogIndex : public LogFixture {};
+
+TEST_F(TestLogIndex, NativeIndex)
+{
+    auto options = make_options(true);
+    auto blocks = [&options] (uint64_t key) {
+        NativeLogIndex index {options};
+        std::vector<uint32_t> result;
+        uint32_t file, block;
+        auto iter = index.fetch_blocks(key, true);
+        while (iter->next(file, block)) { result.push_back(block); }
+        return result;
+    };
+    std::string path = get_temp_dir() + "/index.db.blocks";
+
+    {
+        NativeLogIndex index {options};
+        for (uint32_t i = 0; i < 10; i++) { index.insert_block(1 + i / 5, i, i, i, i + 1); }
+    }
+    EXPECT_EQ(blocks(3), (std::vector<uint32_t>{2, 3}));
+    EXPECT_EQ(fs::file_size(path), 10 * sizeof(NativeIndexRecord));
+
+    // Torn record at the end is dropped
+    fs::resize_file(path, 10 * sizeof(NativeIndexRecord) - 3);
+    EXPECT_EQ(blocks(9), (std::vector<uint32_t>{8}));
+    EXPECT_EQ(fs::file_size(path), 9 * sizeof(NativeIndexRecord));
+
+    // File is rewritten once most of its blocks were deleted
+    {
+        NativeLogIndex index {options};
+        index.delete_file(1);
+    }
+    EXPECT_EQ(blocks(3), std::vector<uint32_t>{});
+    EXPECT_EQ(blocks(6), (std::vector<uint32_t>{5, 6}));
+    EXPECT_EQ(fs::file_size(path), 4 * sizeof(NativeIndexRecord));
+}
+
+TEST_F(TestLogIndex, IndexRecovery)
+{
+    // Native index loses the records that were not yet written back
+    append_pages(1, 6, true);
+    fs::resize_file(get_temp_dir() + "/index.db.blocks",
+            3 * (sizeof(NativeIndexRecord) + sizeof(BloomFilter)));
+    check_pages(1, 6);
+    {
+        TestLog log {make_options(false)};
+        EXPECT_EQ(log.last_epoch(), 6u);
+    }
+
+    // SQLite index is rebuilt from scratch, and new blocks continue from the last epoch
+    index_ = "sqlite";
+    fs::remove(get_temp_dir() + "/index.db.blocks");
+    check_pages(1, 6);
+    append_pages(7, 8, false);
+    check_pages(1, 8);
+
+    TestLog log {make_options(false)};
+    EXPECT_EQ(log.last_epoch(), 8u);
+}
+
+TEST_F(TestLogIndex, TornTailIndex)
+{
+    // Last blocks are torn, but the index still has them when the file is appended to again
+    for (std::string name : {"native", "sqlite"}) {
+        index_ = name;
+        append_pages(1, 6, true);
+        uint32_t file, block;
+        {
+            SelectableLogIndex index {make_options(false)};
+            auto iter = index.fetch_blocks(5, true);
+            ASSERT_TRUE(iter->next(file, block));
+        }
+        fs::resize_file(file_path(), block + 100);
+        append_pages(5, 6, false);
+        check_pages(1, 6);
+    }
+}
+
+TEST_F(TestLogIndex, BloomFilter)
+{
+    // Block covers nodes 1 to 100, but only contains nodes 1 and 100
+    BloomFilter filter;
+    filter.add(1);
+    filter.add(100);
+
+    for (std::string name : {"memory", "native", "sqlite"}) {
+        index_ = name;
+        auto options = make_options(true);
+        auto blocks = [&options] (uint64_t key) {
+            SelectableLogIndex index {options};
+            unsigned count = 0;
+            uint32_t file, block;
+            auto iter = index.fetch_blocks(key, true);
+            while (iter->next(file, block)) { count++; }
+            return count;
+        };
+
+        {
+            SelectableLogIndex index {options};
+            index.insert_block(1, 0, 1, 1, 100, &filter);
+            index.insert_block(1, 1, 2, 1, 100);
+
+            uint32_t file, block;
+            auto iter = index.fetch_blocks(50, true);
+            // Only the block without a filter may contain the node
+            ASSERT_TRUE(iter->next(file, block));
+            EXPECT_EQ(block, 1u);
+            EXPECT_FALSE(iter->next(file, block));
+        }
+
+        // Filters are persisted along with the blocks
+        if (name != "memory") {
+            EXPECT_EQ(blocks(100), 2u);
+            EXPECT_EQ(blocks(50), 1u);
+        }
+    }
+}
+
+TEST_F(TestLogIndex, IndexRebuild)
+{
+    // Enough pages for a few files, with epochs that do not start at 1
+    file_size_ = 1;
+    const unsigned first = 5;
+    const unsigned last = first + 3 * (1024 * 1024 / BlockSize);
+    append_pages(first, last, true);
+
+    // Only headers are read, even with Bloom filters, so a corrupt payload goes unnoticed
+    corrupt_byte(sizeof(LogBlockHeader) + 100);
+
+    for (std::string name : {"native", "sqlite"}) {
+        index_ = name;
+        auto options = make_options(false);
+        options.set("log_index_rebuild", true);
+        options.set("log_index_rebuild_threads", 2u);
+        {
+            // Epochs are taken from the block headers
+            TestLog log {options};
+            EXPECT_EQ(log.last_epoch(), last);
+        }
+        check_pages(first + 1, last);
+    }
+}
+
+TEST_F(TestLogIndex, EpochRange)
+{
+    // Several chunks, the first of which is released, with gaps between epochs
+    MemoryLogIndex index;
+    const uint32_t count = 3 * MemoryLogIndex::ChunkSize;
+    for (uint32_t i = 0; i < count; i++) {
+        index.insert_block(i < MemoryLogIndex::ChunkSize ? 1 : 2, i, 2 * i + 2, 0, 0);
+    }
+    index.delete_file(1);
+
+    auto blocks = [&index] (uint64_t from, uint64_t to) {
+        std::vector<uint32_t> result;
+        uint32_t file, block;
+        auto iter = index.fetch_epochs(from, to);
+        while (iter->next(file, block)) { result.push_back(block); }
+        return result;
+    };
+    EXPECT_EQ(blocks(2101, 2108), (std::vector<uint32_t>{1050, 1051, 1052}));
+    EXPECT_EQ(blocks(2050, 2052), (std::vector<uint32_t>{1024}));
+    EXPECT_EQ(blocks(0, 2052).size(), 1u);
+    EXPECT_EQ(blocks(2 * count, 2 * count + 10), std::vector<uint32_t>{count - 1});
+    EXPECT_TRUE(blocks(2 * count + 1, 2 * count + 10).empty());
+
+    // Log scans, with pages whose epochs are their node IDs
+    append_pages(1, 10, true);
+    for (std::string name : {"native", "sqlite"}) {
+        index_ = name;
+        for (bool cache : {true, false}) {
+            auto options = make_options(false);
+            options.set("log_index_cache", cache);
+            TestLog log {options};
+
+            std::set<unsigned> nodes;
+            DftLogrecHeader hdr;
+            const char* payload;
+            auto iter = log.scan_epochs(3, 6);
+            while (iter->next(hdr, payload)) { nodes.insert(hdr.node_id()); }
+            EXPECT_EQ(nodes, (std::set<unsigned>{3, 4, 5}));
+            EXPECT_FALSE(log.scan_epochs(11, 20)->next(hdr, payload));
+        }
+    }
+}
+
+TEST_F(TestLogIndex, FetchMany)
+{
+    // Each page holds ten nodes, with fenced blocks, which are read whole by fetch_many
+    fence_interval_ = 4;
+    {
+        TestLog log {make_options(true)};
+        std::unique_ptr<DftLogPage> page {new DftLogPage};
+        for (unsigned i = 0; i < 6; i++) {
+            fill_page(*page, 10 * i + 1, 10 * i + 10);
+            log.append_page(*page, i + 1);
+        }
+    }
+
+    using Records = std::map<unsigned, std::vector<std::string>>;
+    auto collect = [] (TestLog::LogFileIterator& iter, Records& records) {
+        DftLogrecHeader hdr;
+        const char* payload;
+        while (iter.next(hdr, payload)) {
+            records[hdr.node_id()].emplace_back(payload, hdr.length());
+        }
+    };
+
+    const std::vector<uint64_t> keys {3, 15, 17, 42, 99};
+    for (std::string name : {"native", "sqlite"}) {
+        index_ = name;
+        for (bool cache : {true, false}) {
+            auto options = make_options(false);
+            options.set("log_index_cache", cache);
+            TestLog log {options};
+            for (bool forward : {true, false}) {
+                Records expected, fetched;
+                for (auto key : keys) { collect(*log.fetch(key, forward), expected); }
+                collect(*log.fetch_many(keys, forward), fetched);
+                EXPECT_EQ(fetched.size(), 4u);
+                EXPECT_EQ(fetched, expected);
+            }
+            DftLogrecHeader hdr;
+            const char* payload;
+            EXPECT_FALSE(log.fetch_many({})->next(hdr, payload));
+        }
+    }
+}
+
+TEST_F(TestLogIndex, LevelFetch)
+{
+    // Blocks of level 0 and of merged levels 1 and 2, whose number is in the high bits of files
+    const uint32_t level1 = 1u << MemoryLogIndex::LevelShift;
+    const uint32_t level2 = 2u << MemoryLogIndex::LevelShift;
+    for (std::string name : {"memory", "native", "sqlite"}) {
+        index_ = name;
+        for (bool cache : {true, false}) {
+            auto options = make_options(true);
+            options.set("log_index_cache", cache);
+            options.set("log_index_path", name + (cache ? ".cached" : ""));
+            SelectableLogIndex index {options};
+            index.insert_block(level2 + 1, 0, 1, 1, 10);
+            index.insert_block(level1 + 1, 0, 2, 1, 10);
+            index.insert_block(level1 + 1, 1, 2, 20, 30);
+            index.insert_block(level1 + 2, 0, 3, 1, 10);
+            index.insert_block(1, 0, 4, 1, 10);
+
+            auto files = [&index] (uint64_t key, bool forward, uint32_t level) {
+                std::vector<uint32_t> result;
+                uint32_t file, block;
+                auto iter = index.fetch_blocks(key, forward, level);
+                while (iter->next(file, block)) { result.push_back(file); }
+                return result;
+            };
+            EXPECT_EQ(files(5, true, 1), (std::vector<uint32_t>{level1 + 1, level1 + 2}));
+            EXPECT_EQ(files(5, false, 1), (std::vector<uint32_t>{level1 + 2, level1 + 1}));
+            EXPECT_EQ(files(25, true, 1), std::vector<uint32_t>{level1 + 1});
+            EXPECT_EQ(files(5, true, 0), std::vector<uint32_t>{1});
+            EXPECT_EQ(files(5, false, 2), std::vector<uint32_t>{level2 + 1});
+            EXPECT_TRUE(files(5, true, 3).empty());
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,399 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define ENABLE_TESTING
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <set>
+#include <thread>
+
+#include "fixture_log.h"
+#include "persistent_map.h"
+
+using namespace fineline;
+using namespace fineline::test;
+
+class TestLogMerge : public LogFixture {};
+
+TEST_F(TestLogMerge, Merge)
+{
+    // A few files of pages with the same nodes; a small fan-in makes the merge take several
+    // passes
+    file_size_ = 1;
+    const unsigned pages = 2 * (1024 * 1024 / BlockSize) + 10;
+
+    for (std::string name : {"native", "sqlite"}) {
+        index_ = name;
+        seq_.clear();
+        auto options = make_options(true);
+        options.set("log_merge_fan_in", 8u);
+        Records expected, expected_backward;
+        {
+            TestLog log {options};
+            append_history(log, 1, pages);
+            expected = fetch_all(log, true);
+            expected_backward = fetch_all(log, false);
+            EXPECT_EQ(expected.size(), nodes_);
+
+            // Iterator created before the merge still reads the merged files
+            auto old_iter = log.fetch(7);
+            EXPECT_EQ(log.merge_level(0), 2u);
+            EXPECT_EQ(log.merge_level(0), 0u);
+            Records old_records;
+            collect(*old_iter, old_records);
+            EXPECT_EQ(old_records[7], expected[7]);
+            old_iter.reset();
+
+            EXPECT_EQ(fetch_all(log, true), expected);
+            EXPECT_EQ(fetch_all(log, false), expected_backward);
+
+            // Fetches of both levels stop early
+            Records stopped;
+            auto stop = [] (const DftLogrecHeader& hdr, const char*) { return hdr.seq_num() == 3; };
+            collect(*log.fetch(7, false, stop), stopped);
+            auto& all = expected_backward[7];
+            EXPECT_EQ(stopped[7], std::vector<std::string>(all.begin(), all.end() - 2));
+        }
+
+        // Merged files are deleted, and no temporary file is left behind
+        std::set<std::string> files;
+        for (auto& entry : fs::directory_iterator{get_temp_dir()}) {
+            files.insert(entry.path().filename().string());
+        }
+        EXPECT_EQ(files.count("log.0.1") + files.count("log.0.2"), 0u);
+        EXPECT_EQ(files.count("log.0.3"), 1u);
+        size_t merged = 0;
+        for (auto& f : files) {
+            EXPECT_NE(f.substr(0, 6), "merge.");
+            if (f.substr(0, 6) == "log.1.") { merged++; }
+        }
+        EXPECT_EQ(merged, 2u);
+
+        for (bool rebuild : {false, true}) {
+            options = make_options(false);
+            options.set("log_index_rebuild", rebuild);
+            TestLog log {options};
+            EXPECT_EQ(log.last_epoch(), pages);
+            EXPECT_EQ(fetch_all(log, true), expected);
+            EXPECT_EQ(fetch_all(log, false), expected_backward);
+        }
+    }
+}
+
+TEST_F(TestLogMerge, MergeCrash)
+{
+    file_size_ = 1;
+    const unsigned pages = 2 * (1024 * 1024 / BlockSize) + 10;
+    Records expected;
+    {
+        TestLog log {make_options(true)};
+        append_history(log, 1, pages);
+        expected = fetch_all(log, true);
+        EXPECT_EQ(log.merge_level(0), 2u);
+    }
+
+    // Crash after the manifest committed the merge, but before its output was renamed, and
+    // an output of a merge that did not commit
+    auto dir = fs::path{get_temp_dir()};
+    std::string merged;
+    for (auto& entry : fs::directory_iterator{dir}) {
+        auto f = entry.path().filename().string();
+        if (f.substr(0, 6) == "log.1.") { merged = f.substr(4); }
+    }
+    ASSERT_FALSE(merged.empty());
+    fs::rename(dir / ("log." + merged), dir / ("merge." + merged));
+    std::ofstream {(dir / "merge.1.99").string()} << "torn";
+
+    for (bool rebuild : {false, true}) {
+        auto options = make_options(false);
+        options.set("log_index_rebuild", rebuild);
+        TestLog log {options};
+        EXPECT_EQ(log.last_epoch(), pages);
+        EXPECT_EQ(fetch_all(log, true), expected);
+    }
+    EXPECT_TRUE(fs::exists(dir / ("log." + merged)));
+    EXPECT_FALSE(fs::exists(dir / ("merge." + merged)));
+    EXPECT_FALSE(fs::exists(dir / "merge.1.99"));
+}
+
+TEST_F(TestLogMerge, MergeScheduler)
+{
+    // Files are sealed every 127 pages, and merged into level 1 every two files
+    file_size_ = 1;
+    const unsigned file_pages = 1024 * 1024 / BlockSize;
+    for (std::string strategy : {"leveled", "tiered"}) {
+        seq_.clear();
+        auto options = make_options(true);
+        options.set("log_merge_strategy", strategy);
+        options.set("log_merge_level0_files", 2u);
+        options.set("log_merge_level_ratio", 2u);
+        std::vector<size_t> runs;
+        {
+            TestLog log {options};
+            for (unsigned i = 0; i < 8; i++) {
+                // Fetches run concurrently with merges
+                append_history(log, i * file_pages + 1, (i + 1) * file_pages + 1);
+                Records fetched = fetch_all(log, true);
+                for (unsigned id = 1; id <= nodes_; id++) {
+                    EXPECT_EQ(fetched[id].size(), seq_[id]);
+                }
+            }
+            Records expected = fetch_all(log, true);
+
+            // Scheduler catches up once the flusher stops
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds{30};
+            while (log.merge_backlog().pending_levels > 0
+                    && std::chrono::steady_clock::now() < deadline)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds{10});
+            }
+            auto backlog = log.merge_backlog();
+            EXPECT_EQ(backlog.pending_levels, 0u);
+            EXPECT_GT(backlog.merges_done, 0u);
+            EXPECT_LT(backlog.level0_files, 2u);
+            EXPECT_EQ(fetch_all(log, true), expected);
+
+            auto levels = log.get_levels();
+            ASSERT_GT(levels.size(), 1u);
+            if (strategy == "leveled") {
+                for (auto& l : levels) { EXPECT_LE(l.runs, 1u); }
+            }
+            for (auto& l : levels) { runs.push_back(l.runs); }
+        }
+
+        // Runs of files merged before the log was opened are counted from their block headers
+        TestLog log {make_options(false)};
+        std::vector<size_t> reopened;
+        for (auto& l : log.get_levels()) { reopened.push_back(l.runs); }
+        EXPECT_EQ(reopened, runs);
+    }
+}
+
+TEST_F(TestLogMerge, MergeReducer)
+{
+    // Each node inserts the same few keys over and over, so merges keep a few records per node
+    using Map = std::map<std::string, std::string>;
+    file_size_ = 1;
+    const unsigned pages = 2 * (1024 * 1024 / BlockSize) + 10;
+    const unsigned keys = 5;
+    TestLog log {make_options(true)};
+    log.set_merge_reducer(std::make_shared<map::InsertReducer<Map, DftLogrecHeader>>());
+
+    append_history(log, 1, pages, [keys] (DftLogPage& page, DftLogrecHeader& hdr) {
+        auto update = hdr.seq_num() - 1;
+        return page.try_insert(hdr, "key" + std::to_string(update % keys),
+                std::to_string(update));
+    });
+
+    auto replay = [&log] (unsigned id, size_t& count) {
+        Map m;
+        auto iter = log.fetch(id);
+        DftLogrecHeader hdr;
+        const char* payload;
+        for (count = 0; iter->next(hdr, payload); count++) { map::redo(m, hdr, payload); }
+        return m;
+    };
+
+    std::vector<Map> expected(nodes_ + 1);
+    std::vector<size_t> counts(nodes_ + 1);
+    for (unsigned id = 1; id <= nodes_; id++) {
+        expected[id] = replay(id, counts[id]);
+        EXPECT_EQ(counts[id], seq_[id]);
+    }
+
+    EXPECT_EQ(log.merge_level(0), 2u);
+    for (unsigned id = 1; id <= nodes_; id++) {
+        size_t count;
+        EXPECT_EQ(replay(id, count), expected[id]);
+        EXPECT_LT(count, counts[id] / 2);
+    }
+}
+
+/*
+ * Transaction context of TxnLogger that collects the records logged into pages, which are
+ * appended to the log of SysEnv with increasing epochs
+ */
+struct PageTxnContext
+{
+    struct SysEnv { static TestLog* log; };
+
+    static PageTxnContext* get()
+    {
+        static PageTxnContext ctx;
+        return &ctx;
+    }
+
+    template <typename... T>
+    void log(DftLogrecHeader& hdr, const T&... args)
+    {
+        if (page->try_insert(hdr, args...)) { return; }
+        flush();
+        ASSERT_TRUE(page->try_insert(hdr, args...));
+    }
+
+    void flush()
+    {
+        if (page->slot_count() == 0) { return; }
+        page->sort_slots();
+        SysEnv::log->append_page(*page, ++epoch);
+        page->clear();
+    }
+
+    std::unique_ptr<DftLogPage> page {new DftLogPage};
+    unsigned epoch = 0;
+};
+
+TestLog* PageTxnContext::SysEnv::log = nullptr;
+
+TEST_F(TestLogMerge, SeqAfterRestart)
+{
+    // Map is recovered and updated again, and its records then merged into a single run
+    using Map = std::map<std::string, std::string>;
+    using Logger = TxnLogger<PageTxnContext, DftLogrecHeader>;
+    file_size_ = 1;
+    const unsigned id = 1;
+    const unsigned keys = 60000;
+    auto ctx = PageTxnContext::get();
+    auto insert_all = [&] (Map& map, Logger& logger, const std::string& value) {
+        for (unsigned i = 0; i < keys; i++) {
+            map::insert(map, logger, "key" + std::to_string(i), value);
+        }
+        ctx->flush();
+    };
+
+    Map expected;
+    {
+        TestLog log {make_options(true)};
+        PageTxnContext::SysEnv::log = &log;
+        Logger logger;
+        Logger::initialize(&logger, id);
+        insert_all(expected, logger, "before");
+    }
+
+    // Inserts of existing keys leave the map unchanged, so replaying them first would not
+    TestLog log {make_options(false)};
+    PageTxnContext::SysEnv::log = &log;
+    {
+        Map map;
+        Logger logger;
+        map::recover(map, logger, id);
+        EXPECT_EQ(map, expected);
+        insert_all(map, logger, "after");
+        EXPECT_EQ(map, expected);
+    }
+
+    EXPECT_GT(log.merge_level(0), 1u);
+    Map map;
+    Logger logger;
+    map::recover(map, logger, id);
+    EXPECT_EQ(map, expected);
+    PageTxnContext::SysEnv::log = nullptr;
+}
+
+TEST_F(TestLogMerge, Partitions)
+{
+    // Merged files are large enough to hold the whole output, which is split by key range only
+    file_size_ = 1;
+    const unsigned pages = 2 * (1024 * 1024 / BlockSize) + 10;
+
+    for (std::string name : {"native", "sqlite"}) {
+        index_ = name;
+        seq_.clear();
+        auto options = make_options(true);
+        options.set("log_level_file_sizes", std::string{"64"});
+        options.set("log_merge_partitions", 4u);
+        TestLog log {options};
+        append_history(log, 1, pages);
+        Records expected = fetch_all(log, true);
+        EXPECT_EQ(log.key_partitions().size(), 1u);
+        EXPECT_EQ(log.merge_level(0), 2u);
+
+        // Each partition is a file of level 1, and no node is split across them
+        auto partitions = log.key_partitions();
+        EXPECT_EQ(partitions.size(), 4u);
+        EXPECT_EQ(partitions.front().lo, 0u);
+        EXPECT_EQ(partitions.back().hi, std::numeric_limits<uint64_t>::max());
+        for (size_t i = 1; i < partitions.size(); i++) {
+            EXPECT_EQ(partitions[i].lo, partitions[i - 1].hi + 1);
+        }
+
+        // Partitions are fetched in parallel, each with the records of its nodes only
+        std::vector<Records> fetched(partitions.size());
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < partitions.size(); i++) {
+            threads.emplace_back([&, i] {
+                collect(*log.fetch_range(partitions[i].lo, partitions[i].hi), fetched[i]);
+            });
+        }
+        for (auto& t : threads) { t.join(); }
+        Records all;
+        for (size_t i = 0; i < partitions.size(); i++) {
+            for (auto& elem : fetched[i]) {
+                EXPECT_GE(elem.first, partitions[i].lo);
+                EXPECT_LE(elem.first, partitions[i].hi);
+                EXPECT_EQ(all.count(elem.first), 0u);
+                all[elem.first] = elem.second;
+            }
+        }
+        EXPECT_EQ(all, expected);
+
+        Records empty;
+        collect(*log.fetch_range(nodes_ + 1, nodes_ + 10), empty);
+        EXPECT_TRUE(empty.empty());
+    }
+}
+
+TEST_F(TestLogMerge, PartitionsAcrossFiles)
+{
+    // Merged files are smaller than the output, so that ranges span several files
+    file_size_ = 1;
+    const unsigned pages = 6 * (1024 * 1024 / BlockSize);
+
+    for (unsigned parts : {1u, 2u}) {
+        seq_.clear();
+        auto options = make_options(true);
+        options.set("log_level_file_sizes", std::string{"1"});
+        options.set("log_merge_partitions", parts);
+        {
+            TestLog log {options};
+            append_history(log, 1, pages);
+            EXPECT_GT(log.merge_level(0), 2u);
+            EXPECT_GT(log.get_levels().at(1).files, 2u);
+            EXPECT_EQ(log.key_partitions().size(), parts);
+        }
+
+        // Ranges are read back from the merged files
+        TestLog log {make_options(false)};
+        auto partitions = log.key_partitions();
+        EXPECT_EQ(partitions.size(), parts);
+        EXPECT_EQ(partitions.front().lo, 0u);
+        EXPECT_EQ(partitions.back().hi, std::numeric_limits<uint64_t>::max());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,151 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define ENABLE_TESTING
+
+#include <gtest/gtest.h>
+#include <random>
+#include <memory>
+
+#include "default_templates.h"
+#include "logsort.h"
+
+using fineline::DftLogrecHeader;
+using fineline::ExtLogPage;
+using foster::LRType;
+
+/*
+ * Fills a page with records of random nodes, each one carrying its own node ID and sequence
+ * number as payload, so that we can verify that payloads still match their slots after sorting.
+ */
+void fill_page(ExtLogPage& page, unsigned max_node_id)
+{
+    std::mt19937 gen;
+    std::uniform_int_distribution<uint32_t> node_distr {1, max_node_id};
+    std::vector<uint32_t> seqs(max_node_id + 1, 0);
+
+    page.clear();
+    while (true) {
+        uint32_t id = node_distr(gen);
+        uint32_t seq = ++seqs[id];
+        DftLogrecHeader hdr {id, seq, LRType::Insert};
+        if (!page.try_insert(hdr, id, seq)) { break; }
+    }
+}
+
+/*
+ * Fills a page with the given number of sorted runs, like the log buffer pages produced by
+ * committing transactions that sort their private logs.
+ */
+void fill_page_with_runs(ExtLogPage& page, unsigned runs)
+{
+    std::unique_ptr<ExtLogPage> tmp {new ExtLogPage};
+    fill_page(*tmp, 100000);
+
+    page.clear();
+    size_t per_run = tmp->slot_count() / runs;
+    for (unsigned r = 0; r < runs; r++) {
+        size_t end = (r == runs - 1) ? tmp->slot_count() : (r + 1) * per_run;
+        std::vector<DftLogrecHeader> run;
+        for (size_t i = r * per_run; i < end; i++) {
+            run.push_back(tmp->get_slot(i).key);
+        }
+        std::sort(run.begin(), run.end());
+        for (auto hdr : run) {
+            ASSERT_TRUE(page.try_insert(hdr, hdr.node_id(), hdr.seq_num()));
+        }
+    }
+}
+
+void check_page(const ExtLogPage& page)
+{
+    ASSERT_TRUE(page.slots_are_sorted());
+
+    auto iter = page.iterate();
+    DftLogrecHeader hdr;
+    const char* payload;
+    while (iter->next(hdr, payload)) {
+        uint32_t id, seq;
+        fineline::LogEncoder<uint32_t, uint32_t>::decode(payload, &id, &seq);
+        ASSERT_EQ(hdr.node_id(), id);
+        ASSERT_EQ(hdr.seq_num(), seq);
+    }
+}
+
+TEST(TestLogSort, SortKeyMatchesComparison)
+{
+    DftLogrecHeader a {1, 300, LRType::Insert};
+    DftLogrecHeader b {2, 1, LRType::Insert};
+    DftLogrecHeader c {2, 256, LRType::Insert};
+
+    EXPECT_TRUE(a < b);
+    EXPECT_LT(a.sort_key(), b.sort_key());
+    EXPECT_TRUE(b < c);
+    EXPECT_LT(b.sort_key(), c.sort_key());
+}
+
+TEST(TestLogSort, SingleThreaded)
+{
+    std::unique_ptr<ExtLogPage> page {new ExtLogPage};
+    fineline::SlotSorter<ExtLogPage> sorter;
+
+    for (unsigned max_id : {10, 1000, 1000000}) {
+        fill_page(*page, max_id);
+        sorter.sort(*page);
+        check_page(*page);
+    }
+}
+
+TEST(TestLogSort, MultiThreaded)
+{
+    std::unique_ptr<ExtLogPage> page {new ExtLogPage};
+    fineline::SlotSorter<ExtLogPage> sorter {3, 0};
+
+    for (unsigned max_id : {10, 1000, 1000000}) {
+        fill_page(*page, max_id);
+        sorter.sort(*page);
+        check_page(*page);
+    }
+}
+
+TEST(TestLogSort, SortedRuns)
+{
+    std::unique_ptr<ExtLogPage> page {new ExtLogPage};
+    fineline::SlotSorter<ExtLogPage> sorter;
+    fineline::SlotSorter<ExtLogPage> parallel_sorter {3, 0};
+
+    // Runs of 2000 are shorter than MinMergeRunLength, i.e., fall back to radix sort
+    for (unsigned runs : {1, 2, 5, 17, 300, 2000}) {
+        fill_page_with_runs(*page, runs);
+        sorter.sort(*page);
+        check_page(*page);
+
+        fill_page_with_runs(*page, runs);
+        parallel_sorter.sort(*page);
+        check_page(*page);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,284 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2016 Caetano Sauer
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define ENABLE_TESTING
+
+#include <gtest/gtest.h>
+#include <vector>
+
+#include "fixture_log.h"
+
+using namespace fineline;
+using namespace fineline::test;
+
+class TestLogStorage : public LogFixture {};
+
+TEST_F(TestLogStorage, Manifest)
+{
+    file_size_ = 1;
+    const unsigned count = 2 * (1024 * 1024 / BlockSize);
+    append_pages(1, count, true);
+    std::string manifest = get_temp_dir() + "/manifest";
+    EXPECT_TRUE(fs::exists(manifest));
+
+    // Directory is not scanned, so a stray file goes unnoticed
+    std::ofstream {get_temp_dir() + "/stray"};
+    append_pages(count + 1, count + 2, false);
+    check_pages(1, count + 2);
+
+    // Without a manifest the directory is scanned again, and a new manifest is written
+    fs::remove(manifest);
+    EXPECT_THROW(TestLog {make_options(false)}, std::runtime_error);
+    fs::remove(get_temp_dir() + "/stray");
+    check_pages(1, count + 2);
+    EXPECT_TRUE(fs::exists(manifest));
+
+    // Corrupt manifest is ignored as well
+    {
+        std::fstream f {manifest, std::ios::in | std::ios::out | std::ios::binary};
+        f.seekp(20);
+        f.put(0x7f);
+    }
+    check_pages(1, count + 2);
+}
+
+TEST_F(TestLogStorage, Recycle)
+{
+    // Files are sealed every 127 pages; the first one holds epochs 1 to 127
+    file_size_ = 1;
+    const unsigned file_pages = 1024 * 1024 / BlockSize;
+    auto options = make_options(true);
+    options.set("log_recycle", true);
+    auto first_file = fs::path{get_temp_dir()} / "log.0.1";
+    Records recycled;
+    {
+        TestLog log {options};
+        append_history(log, 1, 2 * file_pages + 10);
+        Records expected = fetch_all(log, true);
+        EXPECT_EQ(log.recycle(file_pages), 0u);
+
+        // Iterator created before recycling still reads the recycled file
+        auto old_iter = log.fetch(7);
+        EXPECT_EQ(log.recycle(file_pages + 1), 1u);
+        EXPECT_EQ(log.recycle(file_pages + 1), 0u);
+        recycled = fetch_all(log, true);
+        for (unsigned id = 1; id <= nodes_; id++) {
+            auto& all = expected[id];
+            auto& rest = recycled[id];
+            EXPECT_LT(rest.size(), all.size());
+            EXPECT_TRUE(std::equal(rest.begin(), rest.end(), all.end() - rest.size()));
+        }
+
+        EXPECT_TRUE(fs::exists(first_file));
+        Records old_records;
+        collect(*old_iter, old_records);
+        EXPECT_EQ(old_records[7], expected[7]);
+        old_iter.reset();
+        // File is deleted by the recycler thread
+        EXPECT_TRUE(wait_deleted(first_file));
+    }
+
+    {
+        options.set("format", false);
+        TestLog log {options};
+        EXPECT_EQ(fetch_all(log, true), recycled);
+
+        // Recycler thread recycles the files covered by node images
+        log.set_image_epoch(2 * file_pages + 1);
+        EXPECT_TRUE(wait_deleted(fs::path{get_temp_dir()} / "log.0.2"));
+        Records rest = fetch_all(log, true);
+        for (unsigned id = 1; id <= nodes_; id++) {
+            EXPECT_LT(rest[id].size(), recycled[id].size());
+        }
+    }
+}
+
+TEST_F(TestLogStorage, RecycleImages)
+{
+    // Checkpoint logs an image of each node, with other records in between
+    file_size_ = 1;
+    const unsigned file_pages = 1024 * 1024 / BlockSize;
+    auto options = make_options(true);
+    options.set("log_recycle", true);
+    TestLog log {options};
+    unsigned epoch = 2 * file_pages;
+    append_history(log, 1, epoch);
+    const unsigned checkpoint_begin = epoch + 1;
+    std::unique_ptr<DftLogPage> page {new DftLogPage};
+    for (unsigned id = 1; id <= nodes_; id++) {
+        page->clear();
+        DftLogrecHeader hdr {id, ++seq_[id], NodeImageType};
+        ASSERT_TRUE(page->try_insert(hdr, uint8_t{NodeImage<int, int>::FirstChunk},
+                    "image of node " + std::to_string(id)));
+        log.append_page(*page, ++epoch);
+        append_history(log, epoch + 1, epoch + 10);
+        epoch += 10;
+    }
+
+    // Files before the checkpoint are recycled, but not those that hold its images
+    log.set_image_epoch(checkpoint_begin);
+    EXPECT_TRUE(wait_deleted(fs::path{get_temp_dir()} / "log.0.2"));
+    EXPECT_TRUE(fs::exists(fs::path{get_temp_dir()} / "log.0.3"));
+    for (unsigned id = 1; id <= nodes_; id++) {
+        auto iter = fetch_history(log, id);
+        DftLogrecHeader hdr;
+        const char* payload;
+        ASSERT_TRUE(iter->next(hdr, payload));
+        EXPECT_TRUE(is_image_start(hdr, payload));
+        EXPECT_EQ(hdr.node_id(), id);
+    }
+}
+
+TEST_F(TestLogStorage, RecycleRetired)
+{
+    // Log is copied while a reader holds a recycled file, as if it crashed before deleting it
+    file_size_ = 1;
+    index_ = "native";
+    const unsigned file_pages = 1024 * 1024 / BlockSize;
+    auto snap = fs::path{get_temp_dir()} / "snap";
+    Records recycled;
+    {
+        auto options = make_options(true);
+        options.set("log_recycle", true);
+        TestLog log {options};
+        append_history(log, 1, 2 * file_pages + 10);
+        auto old_iter = log.fetch(7);
+        EXPECT_EQ(log.recycle(file_pages + 1), 1u);
+        recycled = fetch_all(log, true);
+
+        fs::create_directory(snap);
+        for (auto& entry : fs::directory_iterator{get_temp_dir()}) {
+            if (fs::is_regular_file(entry.path())) {
+                fs::copy_file(entry.path(), snap / entry.path().filename());
+            }
+        }
+    }
+
+    // Recycled file is deleted when the copy is opened, and removed from its index as well
+    auto options = make_options(false);
+    options.set("logpath", snap.string());
+    {
+        TestLog log {options};
+        EXPECT_FALSE(fs::exists(snap / "log.0.1"));
+        EXPECT_EQ(fetch_all(log, true), recycled);
+    }
+    NativeLogIndex index {options};
+    uint32_t file, block;
+    auto iter = index.fetch_blocks(7, true);
+    while (iter->next(file, block)) {
+        EXPECT_NE(file, TestLogFile::FileNumber(0, 1).data());
+    }
+}
+
+TEST_F(TestLogStorage, TieredStorage)
+{
+    // Merged files go to a separate directory and are twice as large as those of level 0
+    file_size_ = 1;
+    const unsigned pages = 2 * (1024 * 1024 / BlockSize) + 10;
+    auto cold = fs::path{get_temp_dir()} / "cold";
+    auto options = make_options(true);
+    options.set("log_level_paths", cold.string());
+    options.set("log_level_file_sizes", std::string{"2"});
+    Records expected;
+    {
+        TestLog log {options};
+        append_history(log, 1, pages);
+        expected = fetch_all(log, true);
+        EXPECT_EQ(log.merge_level(0), 2u);
+        EXPECT_EQ(fetch_all(log, true), expected);
+    }
+
+    auto count_merged = [] (const fs::path& dir) {
+        size_t merged = 0;
+        for (auto& entry : fs::directory_iterator{dir}) {
+            auto f = entry.path().filename().string();
+            EXPECT_NE(f.substr(0, 6), "merge.");
+            if (f.substr(0, 6) == "log.1.") { merged++; }
+        }
+        return merged;
+    };
+    EXPECT_EQ(count_merged(get_temp_dir()), 0u);
+    EXPECT_EQ(count_merged(cold), 1u);
+    EXPECT_TRUE(fs::exists(fs::path{get_temp_dir()} / "log.0.3"));
+
+    for (bool rebuild : {false, true}) {
+        options = make_options(false);
+        options.set("log_level_paths", cold.string());
+        options.set("log_index_rebuild", rebuild);
+        TestLog log {options};
+        EXPECT_EQ(log.last_epoch(), pages);
+        EXPECT_EQ(fetch_all(log, true), expected);
+    }
+
+    // Scan rejects a merged file found outside the directory of its level
+    for (auto& entry : fs::directory_iterator{cold}) {
+        fs::rename(entry.path(), fs::path{get_temp_dir()} / entry.path().filename());
+    }
+    options.set("log_index_rebuild", true);
+    EXPECT_THROW(TestLog{options}, std::runtime_error);
+}
+
+TEST_F(TestLogStorage, FdCache)
+{
+    using legacy::log_fd_cache;
+    log_fd_cache cache {2};
+    const int invalid_fd = log_fd_cache::invalid_fd;
+    std::vector<std::string> paths;
+    for (unsigned i = 0; i < 4; i++) {
+        paths.push_back(get_temp_dir() + "/file" + std::to_string(i));
+        std::ofstream {paths.back()} << "data";
+    }
+
+    log_fd_cache::entry entries[4];
+    int fd0 = cache.pin(entries[0], paths[0]);
+    for (unsigned i = 1; i < 4; i++) {
+        cache.pin(entries[i], paths[i]);
+        entries[i].unpin();
+    }
+
+    // Pinned entry stays open, while others are evicted down to the capacity
+    EXPECT_EQ(cache.size(), 2u);
+    EXPECT_EQ(entries[0].try_pin(), fd0);
+    entries[0].unpin();
+    entries[0].unpin();
+
+    // Evicted entries are reopened on demand
+    unsigned cached = 0;
+    for (auto& e : entries) {
+        int fd = e.try_pin();
+        if (fd != invalid_fd) { cached++; e.unpin(); }
+    }
+    EXPECT_EQ(cached, 2u);
+    for (unsigned i = 0; i < 4; i++) {
+        EXPECT_NE(cache.pin(entries[i], paths[i]), invalid_fd);
+        entries[i].unpin();
+    }
+    EXPECT_EQ(cache.size(), 2u);
+
+    for (auto& e : entries) { cache.remove(e); }
+    EXPECT_EQ(cache.size(), 0u);
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -65,6 +65,47 @@ TEST(TestInsertions, SimpleInsertions)
     }
 }
 
+TEST(TestInsertions, RecoverFromImage)
+{
+    const int LOGGER_ID = 2;
+    const size_t IMAGE_INTERVAL = 32;
+    fineline::map::ImageCounter image_counter {IMAGE_INTERVAL};
+    std::map<string, string> map;
+    std::map<string, string> recovered_map;
+
+    {
+        TxnLogger logger;
+        TxnContext ctx;
+
+        // Values are large enough for images to span several chunks
+        TxnLogger::initialize(&logger, LOGGER_ID);
+        for (int i = 0; i < 200; i++) {
+            fineline::map::insert(map, logger, "key" + std::to_string(i),
+                    std::string(100 + i, 'a' + i % 26), &image_counter);
+        }
+
+        ctx.commit();
+    }
+
+    {
+        TxnLogger logger;
+        fineline::map::recover(recovered_map, logger, LOGGER_ID);
+    }
+    ASSERT_EQ(map, recovered_map);
+
+    // Replay covers the chunks of the newest image and the inserts after it only
+    auto iter = fineline::fetch_history(*TestEnv::log, LOGGER_ID);
+    fineline::DftLogrecHeader hdr;
+    const char* payload;
+    size_t count = 0, images = 0;
+    while (iter->next(hdr, payload)) {
+        if (count++ == 0) { ASSERT_TRUE(fineline::is_image_start(hdr, payload)); }
+        if (hdr.type() == fineline::NodeImageType) { images++; }
+    }
+    ASSERT_GT(images, 1);
+    ASSERT_LT(count - images, IMAGE_INTERVAL);
+}
+
 int main(int argc, char **argv)
 {
     ::testing::InitGoogleTest(&argc, argv);